@@ -0,0 +1,269 @@
+#include "alloc.h"
+
+#include <atomic>
+#include <cassert>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <set>
+
+static std::mutex alloc_lk;
+/* Free extents by offset, and the same extents by length */
+static std::map<uint64_t, uint64_t> alloc_extents;
+static std::set<std::pair<uint64_t, uint64_t>> alloc_bylen;
+/* End of the device, everything past it is free */
+static uint64_t alloc_end;
+static uint64_t alloc_nfree;
+/* Bumped on reset, runs from before it are stale */
+static std::atomic<uint64_t> alloc_gen;
+
+/* Blocks [r_next, r_end) a thread allocates from without the lock */
+typedef struct alloc_run
+{
+  uint64_t r_next;
+  uint64_t r_end;
+  uint64_t r_gen;
+
+  ~alloc_run();
+} alloc_run;
+
+static thread_local alloc_run run;
+
+static void
+extent_remove(std::map<uint64_t, uint64_t>::iterator it)
+{
+  alloc_bylen.erase({ it->second, it->first });
+  alloc_nfree -= it->second;
+  alloc_extents.erase(it);
+}
+
+static void
+extent_add(uint64_t offset, uint64_t size)
+{
+  alloc_extents[offset] = size;
+  alloc_bylen.insert({ size, offset });
+  alloc_nfree += size;
+}
+
+/* Give [OFFSET, OFFSET + SIZE) back, merging it with free neighbours */
+static void
+extent_insert(uint64_t offset, uint64_t size)
+{
+  auto next = alloc_extents.lower_bound(offset);
+
+  assert(next == alloc_extents.end() || offset + size <= next->first);
+  if (next != alloc_extents.end() && offset + size == next->first) {
+    size += next->second;
+    extent_remove(next);
+  }
+
+  next = alloc_extents.lower_bound(offset);
+  if (next != alloc_extents.begin()) {
+    auto prev = std::prev(next);
+    assert(prev->first + prev->second <= offset);
+    if (prev->first + prev->second == offset) {
+      offset = prev->first;
+      size += prev->second;
+      extent_remove(prev);
+    }
+  }
+
+  extent_add(offset, size);
+}
+
+/* Take [OFFSET, OFFSET + SIZE) out of the free extent IT, which holds it */
+static void
+extent_take(std::map<uint64_t, uint64_t>::iterator it,
+            uint64_t offset,
+            uint64_t size)
+{
+  uint64_t start = it->first;
+  uint64_t len = it->second;
+
+  assert(start <= offset && offset + size <= start + len);
+  extent_remove(it);
+  if (offset > start) {
+    extent_add(start, offset - start);
+  }
+
+  if (offset + size < start + len) {
+    extent_add(offset + size, start + len - offset - size);
+  }
+}
+
+/*
+ * Blocks right at HINT, or in the free extent closest to it if that is within
+ * ALLOC_NEAR blocks on either side. Ties go to the extent after HINT.
+ */
+static uint64_t
+alloc_near_locked(uint64_t size, uint64_t hint)
+{
+  auto next = alloc_extents.upper_bound(hint);
+  uint64_t dist = ALLOC_NEAR + 1;
+  uint64_t offset = ALLOC_NOHINT;
+  uint64_t end;
+
+  if (hint == alloc_end) {
+    alloc_end += size;
+    return hint;
+  }
+
+  if (next != alloc_extents.end() && next->second >= size &&
+      next->first - hint < dist) {
+    dist = next->first - hint;
+    offset = next->first;
+  }
+
+  if (next != alloc_extents.begin()) {
+    auto prev = std::prev(next);
+    end = prev->first + prev->second;
+    if (end >= hint + size) {
+      extent_take(prev, hint, size);
+      return hint;
+    }
+
+    /* Take the tail of the extent, as close to HINT as it gets */
+    if (prev->second >= size && (end >= hint || hint - end < dist)) {
+      extent_take(prev, end - size, size);
+      return end - size;
+    }
+  }
+
+  if (offset != ALLOC_NOHINT) {
+    extent_take(next, offset, size);
+  }
+
+  return offset;
+}
+
+/* Smallest extent that fits, or the end of the device */
+static uint64_t
+alloc_locked(uint64_t size)
+{
+  auto fit = alloc_bylen.lower_bound({ size, 0 });
+  uint64_t offset;
+
+  if (fit != alloc_bylen.end()) {
+    offset = fit->second;
+    extent_take(alloc_extents.find(offset), offset, size);
+    return offset;
+  }
+
+  /* A free extent at the end only has to be grown */
+  if (!alloc_extents.empty()) {
+    auto last = std::prev(alloc_extents.end());
+    if (last->first + last->second == alloc_end) {
+      offset = last->first;
+      extent_remove(last);
+      alloc_end = offset + size;
+      return offset;
+    }
+  }
+
+  offset = alloc_end;
+  alloc_end += size;
+  return offset;
+}
+
+/*
+ * Replace the run of the thread with a new one of at least SIZE blocks. Takes
+ * a whole run if an extent has one, else the largest extent that fits, before
+ * growing the device.
+ */
+static void
+alloc_refill(uint64_t size)
+{
+  uint64_t gen = alloc_gen.load(std::memory_order_acquire);
+  uint64_t len = ALLOC_RUN;
+
+  std::lock_guard<std::mutex> guard(alloc_lk);
+  if (run.r_gen == gen && run.r_next < run.r_end) {
+    extent_insert(run.r_next, run.r_end - run.r_next);
+  }
+
+  if (alloc_bylen.lower_bound({ ALLOC_RUN, 0 }) == alloc_bylen.end() &&
+      !alloc_bylen.empty() && alloc_bylen.rbegin()->first >= size) {
+    len = alloc_bylen.rbegin()->first;
+  }
+
+  run.r_next = alloc_locked(len);
+  run.r_end = run.r_next + len;
+  run.r_gen = gen;
+}
+
+alloc_run::~alloc_run()
+{
+  if (r_gen != alloc_gen.load() || r_next == r_end) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(alloc_lk);
+  extent_insert(r_next, r_end - r_next);
+}
+
+uint64_t
+alloc_blocks(uint64_t size, uint64_t hint)
+{
+  uint64_t offset;
+  bool valid;
+
+  valid = run.r_gen == alloc_gen.load(std::memory_order_acquire);
+  if (hint != ALLOC_NOHINT) {
+    if (valid && run.r_next == hint && run.r_end - run.r_next >= size) {
+      run.r_next += size;
+      return hint;
+    }
+
+    std::lock_guard<std::mutex> guard(alloc_lk);
+    offset = alloc_near_locked(size, hint);
+    if (offset != ALLOC_NOHINT) {
+      return offset;
+    }
+  }
+
+  if (size > ALLOC_RUN_MAX) {
+    std::lock_guard<std::mutex> guard(alloc_lk);
+    return alloc_locked(size);
+  }
+
+  if (!valid || run.r_end - run.r_next < size) {
+    alloc_refill(size);
+  }
+
+  offset = run.r_next;
+  run.r_next += size;
+  return offset;
+}
+
+void
+alloc_free(uint64_t offset, uint64_t size)
+{
+  std::lock_guard<std::mutex> guard(alloc_lk);
+  extent_insert(offset, size);
+}
+
+/* Only called with no other thread allocating */
+void
+alloc_reset()
+{
+  std::lock_guard<std::mutex> guard(alloc_lk);
+  alloc_extents.clear();
+  alloc_bylen.clear();
+  alloc_end = 0;
+  alloc_nfree = 0;
+  alloc_gen.fetch_add(1, std::memory_order_release);
+}
+
+uint64_t
+alloc_size()
+{
+  std::lock_guard<std::mutex> guard(alloc_lk);
+  return alloc_end;
+}
+
+uint64_t
+alloc_free_blocks()
+{
+  std::lock_guard<std::mutex> guard(alloc_lk);
+  return alloc_nfree;
+}
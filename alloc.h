@@ -0,0 +1,46 @@
+#ifndef _ALLOC_H_
+#define _ALLOC_H_
+/*
+ * Block allocator
+ *
+ * Free space of the simulated device is kept as extents of PBLKSZ blocks, by
+ * offset so freed neighbours coalesce and space next to a hint is found, and
+ * by length so an allocation takes the smallest extent that fits. The device
+ * only grows when no extent fits.
+ *
+ * Threads carve small allocations out of a run of blocks they took from the
+ * map, and only take the lock of the map once their run is used up. Runs of
+ * threads that exit go back to the map.
+ *
+ * The interface the trees use, allocate_blk and free_blk, is in buf.h.
+ */
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Blocks in the run of a thread */
+#define ALLOC_RUN (256)
+/* Largest allocation carved out of a run, larger ones go to the map */
+#define ALLOC_RUN_MAX (ALLOC_RUN / 4)
+/* Blocks past a hint an allocation still counts as next to it */
+#define ALLOC_NEAR (ALLOC_RUN)
+
+/* Offset of SIZE free blocks, if possible the ones right after HINT */
+uint64_t
+alloc_blocks(uint64_t size, uint64_t hint);
+void
+alloc_free(uint64_t offset, uint64_t size);
+
+/* Drop every extent and run, the device starts out empty again */
+void
+alloc_reset();
+
+/* Blocks of the device, used or free */
+uint64_t
+alloc_size();
+/* Blocks in free extents, not counting those held in runs */
+uint64_t
+alloc_free_blocks();
+
+#define ALLOC_NOHINT ((uint64_t)-1)
+
+#endif
@@ -1,7 +1,17 @@
+#include <algorithm>
 #include <assert.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string.h>
+#include <thread>
+#include <vector>
 
 #include "btree.h"
 #include "buf.h"
+#include "dev.h"
+#include "options.h"
+#include "search.h"
 
 #define INDEX_NULL ((uint16_t)-1)
 
@@ -11,891 +21,3744 @@ typedef struct bpath
   uint16_t p_indexes[BT_MAX_PATH_SIZE];
   btnode p_nodes[BT_MAX_PATH_SIZE];
   uint8_t p_cur;
+  /* First node of the path we still hold a lock on */
+  uint8_t p_top;
+  /* Versions an optimistic path read its nodes at */
+  uint64_t p_versions[BT_MAX_PATH_SIZE];
 } bpath;
 
 typedef bpath* bpath_t;
 
 static int num_splits = 0;
 
-#define BINARY_SEARCH_CUTOFF (64)
+/* Operation a path is acquired for, decides when ancestors can be released */
+#define BT_OP_FIND (0)
+#define BT_OP_INSERT (1)
+#define BT_OP_DELETE (2)
+/* Range scans keep their whole path to step over to the next leaf */
+#define BT_OP_SCAN (3)
 
-int
-binary_search(uint64_t* arr, size_t size, uint64_t key)
-{
+/* Node can take one more key without splitting */
+#define BT_SAFE_INSERT(node) ((node)->n_len < (BT_MAXKEYS(node) - 1))
+/* Node can lose one key without borrowing from or merging with a sibling */
+#define BT_SAFE_DELETE(node) ((node)->n_len > BT_MINKEYS(node))
 
-  /* In many cases linear search is faster then binary as it
-   * can take advantage of streaming prefetching so have a cut
-   * off where we switch to linear search */
-  if (size <= BINARY_SEARCH_CUTOFF) {
-    for (int i = 0; i < size; i++) {
-      if (arr[i] >= key) {
-        return i;
-      }
-    }
+/* A writer holds the node */
+#define BT_VERSION_LOCKED(v) ((v)&1)
+/* Optimistic attempts before a reader gives up and takes locks */
+#define BT_OPTIMISTIC_RETRIES (8)
+#define BT_RESTART (1)
 
-    return size;
-  }
+/*
+ * Leaves lay their keys over everything past the header, followed by the
+ * values packed at the value size of the tree. Wide leaves keep full keys,
+ * encoded ones a 16 or 32 bit delta from hdr_base per key. A full leaf whose
+ * keys are close enough together is encoded instead of being split.
+ */
+#define BT_PACKED(node) ((unsigned char*)(node)->n_dir_top)
 
-  size_t low = 0;
-  size_t high = size;
-  while (low < high) {
-    size_t mid = low + (high - low) / 2;
-    if (arr[mid] >= key) {
-      high = mid;
-    } else {
-      low = mid + 1;
-    }
-  }
-  if (low >= size) {
-    return size;
-  } else {
-    return low;
+static inline size_t
+btenc_width(int enc)
+{
+  switch (enc) {
+    case BT_ENC_D16:
+      return sizeof(uint16_t);
+    case BT_ENC_D32:
+      return sizeof(uint32_t);
+    default:
+      return sizeof(uint64_t);
   }
 }
 
-static void
-btnode_print(btnode_t node)
+/* Largest distance from the base key an encoding can hold */
+static inline uint64_t
+btenc_span(int enc)
 {
-  printf("\nNode %lx %u\n", node->n_ptr.offset, node->n_len);
-  for (int i = 0; i < node->n_len; i += 10) {
-    printf("%d: ", i);
-    for (int j = i; j < i + 10 && j < node->n_len; j++) {
-      printf(" %lx |", node->n_keys[j]);
-    }
-    printf("\n");
-  }
-  if (BT_ISINNER(node)) {
-    printf("\n====CHILDREN=====\n");
-    for (int i = 0; i < (node->n_len + 1); i += 10) {
-      printf("%d: ", i);
-      for (int j = i; j < i + 10 && (j < (node->n_len + 1)); j++) {
-        printf(" %lx |", ((diskptr_t*)(&node->n_ch[j]))->offset);
-      }
-      printf("\n");
-    }
+  switch (enc) {
+    case BT_ENC_D16:
+      return UINT16_MAX;
+    case BT_ENC_D32:
+      return UINT32_MAX;
+    default:
+      return UINT64_MAX;
   }
-  printf("\n==================\n");
 }
 
-static inline void
-btnode_dirty(btnode_t node)
+/* Entries a leaf of TREE holds in encoding ENC */
+static inline size_t
+btenc_cap(btree_t tree, int enc)
 {
-  bdirty(node->n_bp);
+  return bt_leaf_keys(tree->tr_nodesz, btenc_width(enc), tree->tr_vs);
 }
 
-static void
-path_print(bpath_t path)
+static_assert(bt_leaf_keys(BLKSZ, sizeof(uint64_t), sizeof(uint64_t)) >= 4000,
+              "wide leaves with 8 byte values hold too little");
+
+/* Narrowest encoding of TREE for keys in [LOW, HIGH] */
+static inline int
+btenc_choose(btree_t tree, uint64_t low, uint64_t high)
 {
-  for (int i = 0; i < path->p_len; i++) {
-    btnode_print(&path->p_nodes[i]);
+  if (!(tree->tr_flags & BT_TREE_COMPRESS)) {
+    return BT_ENC_WIDE;
+  }
+
+  if (high - low <= btenc_span(BT_ENC_D16)) {
+    return BT_ENC_D16;
   }
+
+  if (high - low <= btenc_span(BT_ENC_D32)) {
+    return BT_ENC_D32;
+  }
+
+  return BT_ENC_WIDE;
 }
 
-static void
-btnode_wrap_bp(btnode_t node, btree_t tree, struct buf* bp)
+/*
+ * Header of a leaf, read once. Readers without locks can see a torn header,
+ * everything they index with has to come from the same snapshot so it stays
+ * inside the block.
+ */
+typedef struct btleaf
 {
-  diskptr_t ptr;
+  btnode_t l_node;
+  int l_enc;
+  uint64_t l_base;
+  size_t l_len;
+  size_t l_stride;
+  unsigned char* l_keys;
+  unsigned char* l_vals;
+} btleaf;
 
-  ptr.size = BLKSZ;
-  ptr.offset = bp->bp_lblkno;
+static inline void
+btleaf_open(btleaf* leaf, btnode_t node)
+{
+  uint8_t enc = node->n_enc;
+  size_t cap, off;
+
+  leaf->l_node = node;
+  leaf->l_enc = (enc == BT_ENC_D16 || enc == BT_ENC_D32) ? enc : BT_ENC_WIDE;
+  leaf->l_base = node->n_base;
+  leaf->l_stride = BT_VALSZ(node);
+  cap = btenc_cap(node->n_tree, leaf->l_enc);
+  off = cap * btenc_width(leaf->l_enc);
+  leaf->l_keys = BT_PACKED(node);
+  leaf->l_vals = BT_PACKED(node) + ((off + 7) & ~(size_t)7);
+  leaf->l_len = std::min((size_t)node->n_len, cap);
+}
 
-  node->n_bp = bp;
-  node->n_data = (btdata_t)bp->bp_data;
-  node->n_tree = tree;
-  node->n_ptr = ptr;
+static inline uint64_t
+btleaf_key(btleaf* leaf, size_t i)
+{
+  switch (leaf->l_enc) {
+    case BT_ENC_D16:
+      return leaf->l_base + ((uint16_t*)leaf->l_keys)[i];
+    case BT_ENC_D32:
+      return leaf->l_base + ((uint32_t*)leaf->l_keys)[i];
+    default:
+      return ((uint64_t*)leaf->l_keys)[i];
+  }
 }
 
-static void
-btnode_init(btnode_t node, btree_t tree, diskptr_t ptr, int lk_flags)
+static inline void*
+btleaf_val(btleaf* leaf, size_t i)
 {
-  struct buf* bp = getblk(ptr.offset, ptr.size * PBLKSZ, lk_flags);
-  node->n_bp = bp;
-  node->n_data = (btdata_t)bp->bp_data;
-  node->n_tree = tree;
-  node->n_ptr = ptr;
+  return leaf->l_vals + i * leaf->l_stride;
 }
 
-/* Node is locked exclusively on create */
-static void
-btnode_create(btnode_t node, btree_t tree, uint8_t type)
+/* Copy a value of VS bytes, the common sizes become fixed size moves */
+static inline void
+btval_copy(void* dst, const void* src, size_t vs)
 {
-  diskptr_t ptr = allocate_blk(BLKSZ);
-  btnode_init(node, tree, ptr, LK_EXCLUSIVE);
-  node->n_type = type;
-  node->n_len = 0;
+  switch (vs) {
+    case 8:
+      memcpy(dst, src, 8);
+      break;
+    case 16:
+      memcpy(dst, src, 16);
+      break;
+    case 24:
+      memcpy(dst, src, 24);
+      break;
+    case 32:
+      memcpy(dst, src, 32);
+      break;
+    default:
+      memcpy(dst, src, vs);
+  }
 }
 
-/* Caller must check to see if parent */
-static uint16_t
-path_getindex(bpath_t path)
+/* Only valid if the encoding can hold KEY */
+static inline void
+btleaf_set(btleaf* leaf, size_t i, uint64_t key, void* value)
 {
-  return path->p_indexes[path->p_cur];
+  switch (leaf->l_enc) {
+    case BT_ENC_D16:
+      ((uint16_t*)leaf->l_keys)[i] = key - leaf->l_base;
+      break;
+    case BT_ENC_D32:
+      ((uint32_t*)leaf->l_keys)[i] = key - leaf->l_base;
+      break;
+    default:
+      ((uint64_t*)leaf->l_keys)[i] = key;
+  }
+  btval_copy(btleaf_val(leaf, i), value, leaf->l_stride);
 }
 
-/*
- * Will iterater through the path and perform COW on all entries within the path
- */
-static void
-path_cow(bpath_t path)
+/* Move COUNT entries of LEAF from index FROM to index TO */
+static inline void
+btleaf_shift(btleaf* leaf, size_t to, size_t from, size_t count)
 {
-  btnode tmp;
-  btnode_t parent = NULL;
-  int idx;
-  /* We hold all the locks of the path exclusively so we can change the parent
-   */
-  for (int i = 0; i < path->p_len; i++) {
-    /* Check if node is not already COWed */
-    tmp = path->p_nodes[i];
-    if (!BT_ALREADY_COW(&tmp)) {
+  size_t w = btenc_width(leaf->l_enc);
 
-      /* Grab our index in our parent */
-      if (i > 0) {
-        parent = &path->p_nodes[i - 1];
-        idx = path->p_indexes[i];
-        /* We are the root so lets update our own parent ptr as well as save the
-         * old tree */
-      } else {
-        /* Init the old tree to be passed back to the user */
-        /* TODO: Update any consumer that this root has changed */
-      }
+  memmove(leaf->l_keys + to * w, leaf->l_keys + from * w, count * w);
+  memmove(btleaf_val(leaf, to), btleaf_val(leaf, from), count * leaf->l_stride);
+}
 
-      btnode_create(&path->p_nodes[i], tmp.n_tree, tmp.n_type);
-      /* Perform the copy of data or however we choose to transfer it over */
-      memcpy(path->p_nodes[i].n_data, tmp.n_data, BLKSZ);
+static inline bool
+btleaf_fits(btleaf* leaf, uint64_t key)
+{
+  return leaf->l_enc == BT_ENC_WIDE ||
+         (key >= leaf->l_base && key - leaf->l_base <= btenc_span(leaf->l_enc));
+}
 
-      /* Update our parent to know of the change */
-      if (i > 0) {
-        memcpy(&parent->n_ch[idx], &path->p_nodes[i].n_ptr, sizeof(diskptr_t));
-      } else {
-        /* Make sure we update our root ptr in our main tree datastructure */
-        path->p_nodes[i].n_tree->tr_ptr = path->p_nodes[i].n_ptr;
+/* Index of the first key >= KEY, or the length of the leaf */
+static inline int
+btleaf_search(btleaf* leaf, uint64_t key)
+{
+  switch (leaf->l_enc) {
+    case BT_ENC_WIDE:
+      return binary_search((uint64_t*)leaf->l_keys, leaf->l_len, key);
+    default:
+      if (key <= leaf->l_base) {
+        return 0;
       }
 
-      buf_unlock(tmp.n_bp, LK_EXCLUSIVE);
+      if (key - leaf->l_base > btenc_span(leaf->l_enc)) {
+        return leaf->l_len;
+      }
 
-      /* We must invalidate the buffer to insure it never writes */
-      bclean(tmp.n_bp);
+      if (leaf->l_enc == BT_ENC_D16) {
+        return binary_search16(
+          (uint16_t*)leaf->l_keys, leaf->l_len, key - leaf->l_base);
+      }
 
-      /* Turn of cow on the node and dirty the node */
-      BT_FRESH_COW(&path->p_nodes[i]);
-      btnode_dirty(&path->p_nodes[i]);
-    }
+      return binary_search32(
+        (uint32_t*)leaf->l_keys, leaf->l_len, key - leaf->l_base);
   }
 }
 
+/* Key conversions between full keys and the deltas of encoded leaves */
+template<typename T>
 static inline void
-path_add(bpath_t path, btree_t tree, diskptr_t ptr, uint16_t cidx, int lk_flags)
-{
-  btnode_init(&path->p_nodes[path->p_len], tree, ptr, lk_flags);
-  path->p_indexes[path->p_len] = cidx;
-  path->p_cur = path->p_len;
-  path->p_len += 1;
-}
-
-static inline btnode_t
-path_getcur(bpath_t path)
-{
-  return &path->p_nodes[path->p_cur];
-}
-
-static inline void
-path_unacquire(bpath_t path, int acquire_as)
+btleaf_decode_keys(T* src, uint64_t base, uint64_t* keys, size_t count)
 {
-  for (int i = 0; i < path->p_len; i++) {
-    buf_unlock(path->p_nodes[i].n_bp, acquire_as);
+  for (size_t i = 0; i < count; i++) {
+    keys[i] = base + src[i];
   }
 }
 
+template<typename T>
 static inline void
-path_backtrack(bpath_t path)
+btleaf_encode_keys(T* dst, uint64_t base, uint64_t* keys, size_t count)
 {
-  if (path->p_cur > 0) {
-    path->p_cur -= 1;
+  for (size_t i = 0; i < count; i++) {
+    dst[i] = keys[i] - base;
   }
 }
 
-static inline btnode_t
-path_fixup_cur_parent(bpath_t path, btnode_t parent)
+/* Decode COUNT entries of LEAF starting at FROM, values are VS bytes apart */
+static void
+btleaf_read(btleaf* leaf,
+            size_t from,
+            size_t count,
+            uint64_t* keys,
+            unsigned char* vals)
 {
-  int num_to_move = BT_MAX_PATH_SIZE - path->p_cur - 1;
-  memmove(&path->p_nodes[path->p_cur + 1],
-          &path->p_nodes[path->p_cur],
-          num_to_move * sizeof(btnode));
-  memcpy(&path->p_nodes[path->p_cur], parent, sizeof(btnode));
-  path->p_cur += 1;
-  path->p_len += 1;
-  return path_getcur(path);
+  switch (leaf->l_enc) {
+    case BT_ENC_D16:
+      btleaf_decode_keys(
+        (uint16_t*)leaf->l_keys + from, leaf->l_base, keys, count);
+      break;
+    case BT_ENC_D32:
+      btleaf_decode_keys(
+        (uint32_t*)leaf->l_keys + from, leaf->l_base, keys, count);
+      break;
+    default:
+      memcpy(keys, (uint64_t*)leaf->l_keys + from, count * sizeof(uint64_t));
+  }
+  memcpy(vals, btleaf_val(leaf, from), count * leaf->l_stride);
 }
 
-static inline void
-path_copy(bpath_t dst, bpath_t src)
+/* Rewrite NODE to hold the COUNT sorted entries in encoding ENC from BASE */
+static void
+btleaf_write(btnode_t node,
+             int enc,
+             uint64_t base,
+             uint64_t* keys,
+             unsigned char* vals,
+             size_t count)
 {
-  memcpy(dst->p_nodes, src->p_nodes, src->p_len * sizeof(btnode));
+  size_t vs = BT_VALSZ(node);
+  btleaf leaf;
+
+  assert(count <= btenc_cap(node->n_tree, enc));
+  node->n_enc = enc;
+  node->n_base = base;
+  node->n_len = count;
+  btleaf_open(&leaf, node);
+  switch (enc) {
+    case BT_ENC_D16:
+      btleaf_encode_keys((uint16_t*)leaf.l_keys, base, keys, count);
+      break;
+    case BT_ENC_D32:
+      btleaf_encode_keys((uint32_t*)leaf.l_keys, base, keys, count);
+      break;
+    default:
+      memcpy(leaf.l_keys, keys, count * sizeof(uint64_t));
+  }
+  memcpy(leaf.l_vals, vals, count * vs);
 }
 
-static btnode_t
-btnode_go_deeper(bpath_t path, uint64_t key, int acquire_as)
+/* Narrowest encoding and base that holds COUNT sorted KEYS, if any */
+static inline int
+btleaf_choose(btnode_t node, uint64_t* keys, size_t count)
 {
-  int idx = 0;
-  int cidx;
+  int enc;
 
-  btnode_t cur = path_getcur(path);
-
-  idx = binary_search(cur->n_keys, cur->n_len, key);
-  if (idx == cur->n_len) {
-    cidx = cur->n_len;
-  } else {
-    uint64_t keyflag = cur->n_keys[idx];
-    if (key > keyflag) {
-      cidx = idx + 1;
-    } else {
-      cidx = idx;
-    }
+  if (count == 0) {
+    return BT_ENC_WIDE;
   }
 
-  diskptr_t ptr = *(diskptr_t*)&cur->n_ch[cidx];
-  path_add(path, cur->n_tree, ptr, cidx, acquire_as);
+  enc = btenc_choose(node->n_tree, keys[0], keys[count - 1]);
+  if (count > btenc_cap(node->n_tree, enc)) {
+    return -1;
+  }
 
-  return path_getcur(path);
+  return enc;
 }
 
 /*
- * Finds the node which should hold param KEY.
+ * Re-encode NODE to the encoding ENC from BASE, which has to be able to hold
+ * every key of the leaf.
  */
-static btnode_t
-btnode_find_child(bpath_t path, uint64_t key, int acquire_as)
+static void
+btleaf_reencode(btnode_t node, int enc, uint64_t base)
 {
-  btnode_t cur = path_getcur(path);
-  while (BT_ISINNER(cur)) {
-    cur = btnode_go_deeper(path, key, acquire_as);
-  };
-
-  return cur;
+  size_t vs = BT_VALSZ(node);
+  uint64_t* keys;
+  unsigned char* vals;
+  btleaf leaf;
+
+  btleaf_open(&leaf, node);
+  keys = (uint64_t*)malloc(leaf.l_len * sizeof(uint64_t));
+  vals = (unsigned char*)malloc(leaf.l_len * vs);
+  btleaf_read(&leaf, 0, leaf.l_len, keys, vals);
+  btleaf_write(node, enc, base, keys, vals, leaf.l_len);
+  free(keys);
+  free(vals);
 }
 
 /*
- * Within a node, find the key thats greater than or equal
- * to value in param KEY.
- * Function will overwrite key with any key that is found
- * so call should ensure to save the real key before calling
- * and check after
+ * Make room in full leaf NODE by moving it to a narrower encoding, returns
+ * false if its keys are too far apart and it has to be split.
  */
-static int
-btnode_find_ge(btree_t tree, uint64_t* key, void* value, int acquire_as)
+static bool
+btleaf_compact(btnode_t node)
 {
-  btnode_t node;
-  int idx;
-  bpath path;
-  path.p_len = 0;
-  path_add(&path, tree, tree->tr_ptr, INDEX_NULL, acquire_as);
-
-  node = btnode_find_child(&path, *key, acquire_as);
+  btleaf leaf;
+  int enc;
 
-  idx = binary_search(node->n_keys, node->n_len, *key);
-  /* Is there no key here */
-  if (idx >= node->n_len) {
-    path_unacquire(&path, acquire_as);
-    return -1;
+  btleaf_open(&leaf, node);
+  if (leaf.l_len == 0) {
+    return false;
   }
 
-#ifdef DEBUG
-  printf("[Find] %lu in %lu\n", *key, node->n_ptr.offset);
-#endif
-
-  *key = node->n_keys[idx];
-  // key is greater than all elements in the array
-  memcpy(value, &node->n_ch[idx + 1], tree->tr_vs);
-
-  path_unacquire(&path, acquire_as);
+  enc = btenc_choose(
+    node->n_tree, btleaf_key(&leaf, 0), btleaf_key(&leaf, leaf.l_len - 1));
+  if (btenc_cap(node->n_tree, enc) <= leaf.l_len + 1) {
+    return false;
+  }
 
-  return 0;
+  btleaf_reencode(node, enc, btleaf_key(&leaf, 0));
+  return true;
 }
 
-static inline btnode_t
-path_parent(bpath_t path)
+/*
+ * Move NODE to an encoding that can also hold KEY, returns false if in that
+ * encoding the leaf would be full and has to be split instead.
+ */
+static bool
+btleaf_widen(btnode_t node, uint64_t key)
 {
-  if (path->p_cur == 0) {
-    return NULL;
+  uint64_t low = key;
+  uint64_t high = key;
+  btleaf leaf;
+  int enc;
+
+  btleaf_open(&leaf, node);
+  if (leaf.l_len > 0) {
+    low = std::min(low, btleaf_key(&leaf, 0));
+    high = std::max(high, btleaf_key(&leaf, leaf.l_len - 1));
   }
 
-  return &path->p_nodes[path->p_cur - 1];
+  enc = btenc_choose(node->n_tree, low, high);
+  if (btenc_cap(node->n_tree, enc) <= leaf.l_len + 1) {
+    return false;
+  }
+
+  btleaf_reencode(node, enc, low);
+  return true;
 }
 
-static void
-btnode_inner_insert(btnode_t node, int idx, uint64_t key, diskptr_t value)
+/* Decode every entry of NODE into freshly allocated arrays */
+static size_t
+btleaf_decode(btnode_t node, uint64_t** keys, unsigned char** vals)
 {
-  assert(BT_ISINNER(node));
-  if (node->n_len) {
-    int num_to_move = node->n_len - idx + 1;
-    memmove(
-      &node->n_keys[idx + 1], &node->n_keys[idx], num_to_move * sizeof(key));
-    memmove(&node->n_ch[idx + 2],
-            &node->n_ch[idx + 1],
-            num_to_move * BT_MAX_VALUE_SIZE);
-  }
+  btleaf leaf;
 
-  node->n_keys[idx] = key;
-  memcpy(&node->n_ch[idx + 1], &value, sizeof(value));
-  node->n_len += 1;
+  btleaf_open(&leaf, node);
+  *keys = (uint64_t*)malloc((leaf.l_len + 1) * sizeof(uint64_t));
+  *vals = (unsigned char*)malloc((leaf.l_len + 1) * BT_VALSZ(node));
+  btleaf_read(&leaf, 0, leaf.l_len, *keys, *vals);
 
-  btnode_dirty(node);
+  return leaf.l_len;
 }
 
-static void
-btnode_split(bpath_t path)
+/*
+ * Move the upper half of leaf NODE into the empty leaf RIGHT, each half in
+ * the narrowest encoding it fits in. Returns the largest key left in NODE.
+ */
+static uint64_t
+btleaf_split(btnode_t node, btnode_t right)
 {
-  int idx;
-  btnode_t node = path_getcur(path);
-  btnode_t pptr = path_parent(path);
-  btnode parent;
-  btnode right_child;
+  size_t vs = BT_VALSZ(node);
+  uint64_t* keys;
+  unsigned char* vals;
+  size_t len, h;
+  int lenc, renc;
+  uint64_t split_key;
 
-#ifdef DEBUG
-  printf("[Split]\n");
-#endif
-
-  /* We are the root */
-  if (pptr == NULL) {
-    btnode_create(&parent, node->n_tree, BT_INNER);
-    /* Set our current node to the child of our new parent */
-    memcpy(&parent.n_ch[0], &node->n_ptr, sizeof(diskptr_t));
+  len = btleaf_decode(node, &keys, &vals);
+  h = len / 2;
 
-    node = path_fixup_cur_parent(path, &parent);
+  /* Either half spans at most what the whole leaf did */
+  lenc = btleaf_choose(node, keys, h);
+  renc = btleaf_choose(node, &keys[h], len - h);
+  assert(lenc >= 0 && renc >= 0);
 
-    /* Fixup root parent ptr in the tree */
-    node->n_tree->tr_ptr = parent.n_ptr;
-
-    idx = 0;
-  } else {
-    parent = *pptr;
-    idx = path_getindex(path);
-  }
+  btleaf_write(node, lenc, keys[0], keys, vals, h);
+  btleaf_write(right, renc, keys[h], &keys[h], &vals[h * vs], len - h);
+  split_key = keys[h - 1];
 
-  btnode_create(&right_child, node->n_tree, node->n_type);
+  free(keys);
+  free(vals);
 
-  right_child.n_len = SPLIT_KEYS;
+  return split_key;
+}
 
-  if (BT_ISLEAF(node)) {
-    node->n_len = SPLIT_KEYS;
-  } else {
-    node->n_len = SPLIT_KEYS - 1;
+/*
+ * Even out sibling leaves LEFT and RIGHT, where SEP separates them in their
+ * parent. Keys of one side may not fit the encoding of the other, so the
+ * split point only moves as far as both halves still fit.
+ */
+static void
+btleaf_even(btnode_t left, btnode_t right, uint64_t* sep)
+{
+  size_t vs = BT_VALSZ(left);
+  uint64_t *keys, *rkeys;
+  unsigned char *vals, *rvals;
+  size_t a, b, n, h;
+  int lenc, renc;
+
+  a = btleaf_decode(left, &keys, &vals);
+  b = btleaf_decode(right, &rkeys, &rvals);
+  n = a + b;
+  keys = (uint64_t*)realloc(keys, n * sizeof(uint64_t));
+  vals = (unsigned char*)realloc(vals, n * vs);
+  memcpy(&keys[a], rkeys, b * sizeof(uint64_t));
+  memcpy(&vals[a * vs], rvals, b * vs);
+  free(rkeys);
+  free(rvals);
+
+  /* Splitting at A gives back the leaves we started with, which fit */
+  h = n / 2;
+  while (h > a && btleaf_choose(left, keys, h) < 0) {
+    h--;
+  }
+  while (h < a && btleaf_choose(right, &keys[h], n - h) < 0) {
+    h++;
   }
 
-  uint64_t split_key = node->n_keys[SPLIT_KEYS - 1];
+  lenc = btleaf_choose(left, keys, h);
+  renc = btleaf_choose(right, &keys[h], n - h);
+  assert(lenc >= 0 && renc >= 0);
 
-  memcpy(&right_child.n_keys[0],
-         &node->n_keys[SPLIT_KEYS],
-         SPLIT_KEYS * sizeof(uint64_t));
-  if (BT_ISLEAF(node))
-    memcpy(&right_child.n_ch[0],
-           &node->n_ch[SPLIT_KEYS],
-           (SPLIT_KEYS + 1) * BT_MAX_VALUE_SIZE);
-  else
-    memcpy(&right_child.n_ch[0],
-           &node->n_ch[SPLIT_KEYS],
-           (SPLIT_KEYS + 1) * BT_MAX_VALUE_SIZE);
+  btleaf_write(left, lenc, keys[0], keys, vals, h);
+  btleaf_write(right, renc, keys[h], &keys[h], &vals[h * vs], n - h);
+  *sep = keys[h - 1];
 
-  /* Setting the pivot key here, with SPLIT_KEYS - 1, means elements to the
-   * right must be strictly greater
-   */
-  btnode_inner_insert(&parent, idx, split_key, right_child.n_ptr);
+  free(keys);
+  free(vals);
+}
 
-  /* Unlock the right child and dirty the children*/
-  btnode_dirty(&right_child);
-  btnode_dirty(node);
+/* Append leaf RIGHT to its left sibling LEFT */
+static void
+btleaf_merge(btnode_t left, btnode_t right)
+{
+  size_t vs = BT_VALSZ(left);
+  uint64_t *keys, *rkeys;
+  unsigned char *vals, *rvals;
+  size_t a, b;
+  int enc;
+
+  a = btleaf_decode(left, &keys, &vals);
+  b = btleaf_decode(right, &rkeys, &rvals);
+  keys = (uint64_t*)realloc(keys, (a + b + 1) * sizeof(uint64_t));
+  vals = (unsigned char*)realloc(vals, (a + b + 1) * vs);
+  memcpy(&keys[a], rkeys, b * sizeof(uint64_t));
+  memcpy(&vals[a * vs], rvals, b * vs);
+
+  enc = btleaf_choose(left, keys, a + b);
+  assert(enc >= 0);
+  btleaf_write(left, enc, (a + b) ? keys[0] : 0, keys, vals, a + b);
+
+  free(keys);
+  free(vals);
+  free(rkeys);
+  free(rvals);
+}
 
-  buf_unlock(right_child.n_bp, LK_EXCLUSIVE);
+/* Leaf takes KEY without splitting or being re-encoded */
+static inline bool
+btleaf_safe_insert(btnode_t node, uint64_t key)
+{
+  btleaf leaf;
 
-  if (parent.n_len == BT_MAX_KEYS) {
-    printf("DOUBLE SPLIT\n");
-    path_backtrack(path);
-    btnode_split(path);
-  }
+  btleaf_open(&leaf, node);
+  return !BT_ISCOW(node) && btleaf_fits(&leaf, key) &&
+         leaf.l_len + 1 < btenc_cap(node->n_tree, leaf.l_enc);
 }
 
 static void
-btnode_leaf_insert(btnode_t node, int idx, uint64_t key, void* value)
+btnode_print(btnode_t node)
 {
-  assert(BT_ISLEAF(node));
-  assert(!BT_ISCOW(node));
+  btleaf leaf;
+
+  btleaf_open(&leaf, node);
+  printf("\nNode %lx %u\n", node->n_ptr.offset, node->n_len);
+  for (int i = 0; i < node->n_len; i += 10) {
+    printf("%d: ", i);
+    for (int j = i; j < i + 10 && j < node->n_len; j++) {
+      printf(" %lx |",
+             BT_ISLEAF(node) ? btleaf_key(&leaf, j) : node->n_keys[j]);
+    }
+    printf("\n");
+  }
+  if (BT_ISINNER(node)) {
+    printf("\n====CHILDREN=====\n");
+    for (int i = 0; i < (node->n_len + 1); i += 10) {
+      printf("%d: ", i);
+      for (int j = i; j < i + 10 && (j < (node->n_len + 1)); j++) {
+        printf(" %lx |", ((diskptr_t*)(&node->n_ch[j]))->offset);
+      }
+      printf("\n");
+    }
+  }
+  printf("\n==================\n");
+}
+
+static inline void
+btnode_dirty(btnode_t node)
+{
+  bdirty(node->n_bp, &node->n_tree->tr_bo);
+}
+
+static void
+path_print(bpath_t path)
+{
+  for (int i = 0; i < path->p_len; i++) {
+    btnode_print(&path->p_nodes[i]);
+  }
+}
+
+static void
+btnode_wrap_bp(btnode_t node, btree_t tree, struct buf* bp)
+{
+  diskptr_t ptr;
+
+  ptr.size = tree->tr_nodesz;
+  ptr.offset = bp->bp_lblkno;
+
+  node->n_bp = bp;
+  node->n_data = (btdata_t)bp->bp_data;
+  node->n_tree = tree;
+  node->n_ptr = ptr;
+  node->n_children = (ct*)&node->n_keys[tree->tr_max_keys];
+}
+
+static inline uint64_t
+btnode_version(btnode_t node)
+{
+  return __atomic_load_n(&node->n_version, __ATOMIC_ACQUIRE);
+}
+
+/* Check that no writer touched the node since we read version V */
+static inline bool
+btnode_validate(btnode_t node, uint64_t v)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&node->n_version, __ATOMIC_RELAXED) == v;
+}
+
+static inline void
+btnode_lock(btnode_t node, int lk_flags)
+{
+  buf_lock(node->n_bp, lk_flags);
+  if (lk_flags == LK_EXCLUSIVE) {
+    __atomic_store_n(&node->n_version, node->n_version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+  }
+}
+
+static inline void
+btnode_unlock(btnode_t node, int lk_flags)
+{
+  if (lk_flags == LK_EXCLUSIVE) {
+    __atomic_store_n(&node->n_version, node->n_version + 1, __ATOMIC_RELEASE);
+  }
+  buf_unlock(node->n_bp, lk_flags);
+}
+
+/* Passing no lock flags gives an unlocked node for optimistic readers */
+static void
+btnode_init(btnode_t node, btree_t tree, diskptr_t ptr, int lk_flags)
+{
+  struct buf* bp = getblk(ptr.offset, ptr.size * PBLKSZ, 0);
+  node->n_bp = bp;
+  node->n_data = (btdata_t)bp->bp_data;
+  node->n_tree = tree;
+  node->n_ptr = ptr;
+  node->n_children = (ct*)&node->n_keys[tree->tr_max_keys];
+  /* Every descent goes through inner nodes, keep them over leaves */
+  if (BT_ISINNER(node)) {
+    buf_set_prio(bp);
+  }
+  btnode_lock(node, lk_flags);
+}
+
+/*
+ * Node is locked exclusively on create. NEAR is the node that will be to its
+ * left if there is one, the new node goes right behind it on disk if it can
+ * so scans read the two in one go.
+ */
+static void
+btnode_create(btnode_t node, btree_t tree, uint8_t type, diskptr_t* near)
+{
+  diskptr_t ptr = (near != NULL) ? allocate_blk_near(tree->tr_nodesz, *near)
+                                 : allocate_blk(tree->tr_nodesz);
+  ptr.epoch = tree->tr_epoch.load(std::memory_order_relaxed);
+  btnode_init(node, tree, ptr, LK_EXCLUSIVE);
+  node->n_type = type;
+  node->n_len = 0;
+  node->n_enc = BT_ENC_WIDE;
+  node->n_base = 0;
+  node->n_hdr.hdr_deltas = 0;
+  node->n_hdr.hdr_ndeltas = 0;
+}
+
+/*
+ * Read the root pointer, retrying if a writer is in the middle of swapping it
+ */
+static diskptr_t
+btree_getroot(btree_t tree)
+{
+  diskptr_t ptr;
+  uint64_t seq;
+
+  do {
+    seq = tree->tr_seq.load(std::memory_order_acquire);
+    ptr = tree->tr_ptr;
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while ((seq & 1) || seq != tree->tr_seq.load(std::memory_order_relaxed));
+
+  return ptr;
+}
+
+/* Caller must hold the current root exclusively */
+static void
+btree_setroot(btree_t tree, diskptr_t ptr)
+{
+  tree->tr_seq.fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  tree->tr_ptr = ptr;
+  tree->tr_seq.fetch_add(1, std::memory_order_release);
+}
+
+/*
+ * Pin the current epoch of TREE, returns the slot to release it with. Slots
+ * are spread over threads so pins do not bounce a shared cache line.
+ */
+static int
+btree_enter(btree_t tree)
+{
+  static std::atomic<int> nthreads;
+  thread_local int hint = nthreads.fetch_add(1) % BT_EPOCH_SLOTS;
+  std::atomic<uint64_t>* slot;
+  uint64_t word, pinned;
+  int i = hint;
+
+  for (int n = 0; n < BT_EPOCH_SLOTS; n++, i = (i + 1) % BT_EPOCH_SLOTS) {
+    word = 0;
+    pinned = BT_SLOT_READER | (tree->tr_epoch.load() + 1);
+    if (tree->tr_slots[i].s_epoch.compare_exchange_strong(word, pinned)) {
+      return i;
+    }
+  }
+
+  /*
+   * Every slot is taken, join the one we hint at. Its epoch is no newer than
+   * the current one, so sharing it only keeps more blocks around.
+   */
+  slot = &tree->tr_slots[hint].s_epoch;
+  word = slot->load();
+  do {
+    if (word == 0) {
+      pinned = BT_SLOT_READER | (tree->tr_epoch.load() + 1);
+    } else {
+      assert(word < UINT64_MAX - BT_SLOT_READER);
+      pinned = word + BT_SLOT_READER;
+    }
+  } while (!slot->compare_exchange_weak(word, pinned));
+
+  return hint;
+}
+
+static void
+btree_exit(btree_t tree, int slot)
+{
+  std::atomic<uint64_t>* word = &tree->tr_slots[slot].s_epoch;
+  uint64_t cur, next;
+
+  /* The last reader out frees the slot */
+  cur = word->load();
+  do {
+    next = (cur < 2 * BT_SLOT_READER) ? 0 : cur - BT_SLOT_READER;
+  } while (!word->compare_exchange_weak(cur, next));
+}
+
+/*
+ * Keeps the epoch pinned for the scope of a call into the tree, along with
+ * the buffers it reads without locking them
+ */
+typedef struct btepoch_guard
+{
+  btree_t g_tree;
+  int g_slot;
+  int g_bslot;
+
+  btepoch_guard(btree_t tree)
+    : g_tree(tree)
+    , g_slot(btree_enter(tree))
+    , g_bslot(buf_enter())
+  {
+  }
+  ~btepoch_guard()
+  {
+    buf_exit(g_bslot);
+    btree_exit(g_tree, g_slot);
+  }
+
+  /* Pin the current epochs instead, nothing unlocked may be used across */
+  void repin()
+  {
+    buf_exit(g_bslot);
+    btree_exit(g_tree, g_slot);
+    g_slot = btree_enter(g_tree);
+    g_bslot = buf_enter();
+  }
+} btepoch_guard;
+
+/*
+ * Calls that visit many leaves repin every BT_REPIN_LEAVES of them, so they
+ * do not hold back eviction of everything they looked up.
+ */
+#define BT_REPIN_LEAVES (64)
+
+/*
+ * PTR was just taken out of the tree. Readers that pin an epoch from here on
+ * can no longer find it, the ones that could are pinned at this one or older.
+ */
+static void
+btree_retire(btree_t tree, diskptr_t ptr)
+{
+  btretired retired;
+
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  retired.r_ptr = ptr;
+  retired.r_epoch = tree->tr_epoch.load();
+
+  std::lock_guard<std::mutex> guard(tree->tr_retire_lk);
+  tree->tr_retired.push_back(retired);
+}
+
+/*
+ * Free the retired blocks nothing needs anymore. The last checkpoint needs
+ * what was retired in the current epoch, a snapshot what was retired after
+ * it, and readers what was retired since they pinned their epoch.
+ */
+static void
+btree_reclaim(btree_t tree)
+{
+  uint64_t oldest = tree->tr_epoch.load();
+  uint64_t epoch;
+  size_t kept = 0;
+
+  for (int i = 0; i < BT_EPOCH_SLOTS; i++) {
+    epoch = BT_SLOT_EPOCH(tree->tr_slots[i].s_epoch.load());
+    if (epoch != 0) {
+      oldest = std::min(oldest, epoch - 1);
+    }
+  }
+
+  std::lock_guard<std::mutex> guard(tree->tr_retire_lk);
+  if (!tree->tr_snapshots.empty()) {
+    oldest = std::min(oldest, *tree->tr_snapshots.begin() + 1);
+  }
+
+  for (auto& retired : tree->tr_retired) {
+    if (retired.r_epoch < oldest) {
+      free_blk(retired.r_ptr);
+      tree->tr_freed.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+
+    tree->tr_retired[kept] = retired;
+    kept += 1;
+  }
+  tree->tr_retired.resize(kept);
+}
+
+/* Caller must check to see if parent */
+static uint16_t
+path_getindex(bpath_t path)
+{
+  return path->p_indexes[path->p_cur];
+}
+
+/*
+ * Delta chains, see BT_TREE_DELTA. Chains only hang off leaves a checkpoint
+ * wrote out, which are never changed in place. Records are added with the
+ * leaf held exclusively, so optimistic readers that looked at a chain see the
+ * version of its leaf change. The shard locks only guard the maps.
+ */
+static inline btdeltashard*
+btdelta_shard(btree_t tree, uint64_t off)
+{
+  /* Leaves are nodes apart, spread them over all the shards */
+  return &tree->tr_deltas[(off * 0x9E3779B97F4A7C15ULL) >> 58];
+}
+
+static_assert(BT_DELTA_SHARDS == 64, "shard hash takes the top 6 bits");
+
+/* Chain of the leaf at OFF in SHARD, which is held */
+static inline btchain*
+btdelta_chain(btdeltashard* shard, uint64_t off)
+{
+  auto it = shard->s_chains.find(off);
+  return (it == shard->s_chains.end()) ? NULL : &it->second;
+}
+
+/* Newest record of CHAIN for KEY, or -1 */
+static inline int
+btdelta_index(btchain* chain, uint64_t key)
+{
+  for (int i = chain->c_len - 1; i >= 0; i--) {
+    if (chain->c_deltas[i].d_key == key) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static bool
+btdelta_chained(btnode_t node)
+{
+  btdeltashard* shard = btdelta_shard(node->n_tree, node->n_ptr.offset);
+
+  if (shard->s_count.load(std::memory_order_acquire) == 0) {
+    return false;
+  }
+
+  std::shared_lock<std::shared_mutex> guard(shard->s_lk);
+  return btdelta_chain(shard, node->n_ptr.offset) != NULL;
+}
+
+/* Append KEY and VALUE to CHAIN, the leaf it hangs off is LEAF */
+static void
+btdelta_append(btree_t tree,
+               btchain* chain,
+               btleaf* leaf,
+               uint64_t key,
+               void* value)
+{
+  btdelta* delta;
+  bool isnew;
+  int idx;
+
+  idx = btleaf_search(leaf, key);
+  isnew = (idx >= leaf->l_len || btleaf_key(leaf, idx) != key);
+  isnew = isnew && btdelta_index(chain, key) < 0;
+
+  delta = &chain->c_deltas[chain->c_len];
+  delta->d_key = key;
+  memcpy(delta->d_data, value, tree->tr_vs);
+  chain->c_len += 1;
+  chain->c_inserts += isnew;
+}
+
+/* Empty chain for the leaf at OFF in SHARD, which is held exclusively */
+static btchain*
+btdelta_new(btree_t tree, btdeltashard* shard, uint64_t off)
+{
+  btchain* chain = &shard->s_chains[off];
+
+  chain->c_len = 0;
+  chain->c_inserts = 0;
+  shard->s_count.fetch_add(1, std::memory_order_release);
+  tree->tr_nchains.fetch_add(1, std::memory_order_relaxed);
+
+  return chain;
+}
+
+/*
+ * Record KEY and VALUE against checkpointed leaf NODE, held exclusively.
+ * Returns false if the leaf has to be copied instead, because its chain is
+ * full or folding the chain in could overflow it.
+ */
+static bool
+btdelta_add(btnode_t node, uint64_t key, void* value)
+{
+  btree_t tree = node->n_tree;
+  btdeltashard* shard;
+  btchain* chain;
+  size_t inserts;
+  btleaf leaf;
+  bool isnew;
+  int idx;
+
+  if (!(tree->tr_flags & BT_TREE_DELTA) || !BT_ISCOW(node)) {
+    return false;
+  }
+
+  btleaf_open(&leaf, node);
+  if (!btleaf_fits(&leaf, key)) {
+    return false;
+  }
+
+  idx = btleaf_search(&leaf, key);
+  isnew = (idx >= leaf.l_len || btleaf_key(&leaf, idx) != key);
+
+  shard = btdelta_shard(tree, node->n_ptr.offset);
+  std::unique_lock<std::shared_mutex> guard(shard->s_lk);
+  chain = btdelta_chain(shard, node->n_ptr.offset);
+  inserts = 0;
+  if (chain != NULL) {
+    if (chain->c_len == BT_DELTA_MAX) {
+      return false;
+    }
+
+    isnew = isnew && btdelta_index(chain, key) < 0;
+    inserts = chain->c_inserts;
+  }
+
+  /* Folded in the leaf has to be able to take one more key */
+  if (isnew && leaf.l_len + inserts + 1 >= btenc_cap(tree, leaf.l_enc)) {
+    return false;
+  }
+
+  if (chain == NULL) {
+    chain = btdelta_new(tree, shard, node->n_ptr.offset);
+  }
+
+  btdelta_append(tree, chain, &leaf, key, value);
+  tree->tr_delta_dirty.store(true, std::memory_order_relaxed);
+
+  return true;
+}
+
+/*
+ * Check the chain of leaf NODE for the smallest key >= KEY, newest record
+ * first. If HAVE, *FOUND is what the leaf itself holds and only a key no
+ * larger replaces it. Returns true if *FOUND and VALUE came from the chain.
+ */
+static bool
+btdelta_ge(btnode_t node, uint64_t key, uint64_t* found, bool have, void* value)
+{
+  btree_t tree = node->n_tree;
+  btdeltashard* shard;
+  btchain* chain;
+  btdelta* delta;
+  bool hit = false;
+
+  shard = btdelta_shard(tree, node->n_ptr.offset);
+  if (shard->s_count.load(std::memory_order_acquire) == 0) {
+    return false;
+  }
+
+  std::shared_lock<std::shared_mutex> guard(shard->s_lk);
+  chain = btdelta_chain(shard, node->n_ptr.offset);
+  if (chain == NULL) {
+    return false;
+  }
+
+  for (int i = chain->c_len - 1; i >= 0; i--) {
+    delta = &chain->c_deltas[i];
+    if (delta->d_key < key) {
+      continue;
+    }
+
+    /* Records win over the leaf, newer records over older ones */
+    if (have && (delta->d_key > *found || (delta->d_key == *found && hit))) {
+      continue;
+    }
+
+    *found = delta->d_key;
+    btval_copy(value, delta->d_data, tree->tr_vs);
+    have = true;
+    hit = true;
+  }
+
+  return hit;
+}
+
+/* Copy the chain of leaf NODE to CHAIN, returns false if it has none */
+static bool
+btdelta_copy(btnode_t node, btchain* chain)
+{
+  btdeltashard* shard = btdelta_shard(node->n_tree, node->n_ptr.offset);
+  btchain* found;
+
+  if (shard->s_count.load(std::memory_order_acquire) == 0) {
+    return false;
+  }
+
+  std::shared_lock<std::shared_mutex> guard(shard->s_lk);
+  found = btdelta_chain(shard, node->n_ptr.offset);
+  if (found == NULL) {
+    return false;
+  }
+
+  *chain = *found;
+  return true;
+}
+
+/* Newest record of CHAIN for the smallest key >= KEY, or -1 */
+static int
+btdelta_next(btchain* chain, uint64_t key)
+{
+  int next = -1;
+
+  for (int i = chain->c_len - 1; i >= 0; i--) {
+    if (chain->c_deltas[i].d_key < key) {
+      continue;
+    }
+
+    if (next < 0 || chain->c_deltas[i].d_key < chain->c_deltas[next].d_key) {
+      next = i;
+    }
+  }
+
+  return next;
+}
+
+/* Fold the chain of the checkpointed leaf at OFF into NODE, its copy */
+static void
+btdelta_fold(btnode_t node, uint64_t off)
+{
+  btree_t tree = node->n_tree;
+  btdeltashard* shard;
+  btchain chain;
+  btdelta* delta;
+  btleaf leaf;
+  int idx;
+
+  shard = btdelta_shard(tree, off);
+  if (shard->s_count.load(std::memory_order_acquire) == 0) {
+    return;
+  }
+
+  {
+    std::unique_lock<std::shared_mutex> guard(shard->s_lk);
+    auto it = shard->s_chains.find(off);
+    if (it == shard->s_chains.end()) {
+      return;
+    }
+
+    chain = it->second;
+    shard->s_chains.erase(it);
+    shard->s_count.fetch_sub(1, std::memory_order_release);
+    tree->tr_nchains.fetch_sub(1, std::memory_order_relaxed);
+    tree->tr_delta_dirty.store(true, std::memory_order_relaxed);
+  }
+
+  for (int i = 0; i < chain.c_len; i++) {
+    delta = &chain.c_deltas[i];
+    btleaf_open(&leaf, node);
+    idx = btleaf_search(&leaf, delta->d_key);
+    if (idx < leaf.l_len && btleaf_key(&leaf, idx) == delta->d_key) {
+      btval_copy(btleaf_val(&leaf, idx), delta->d_data, leaf.l_stride);
+      continue;
+    }
+
+    btleaf_shift(&leaf, idx + 1, idx, leaf.l_len - idx);
+    btleaf_set(&leaf, idx, delta->d_key, delta->d_data);
+    node->n_len += 1;
+  }
+}
+
+/*
+ * Copy checkpointed NODE, held exclusively, to a new block and point PARENT at
+ * the copy through child IDX. With no parent NODE is the root and the tree is
+ * pointed at it instead. On return NODE is the copy.
+ */
+static void
+btnode_cow(btnode_t node, btnode_t parent, int idx)
+{
+  btnode tmp = *node;
+
+  /* Leaf copies stay close to the original, and so to their neighbours */
+  btnode_create(
+    node, tmp.n_tree, tmp.n_type, BT_ISLEAF(&tmp) ? &tmp.n_ptr : NULL);
+  /* Perform the copy of data or however we choose to transfer it over */
+  memcpy(node->n_data, tmp.n_data, BT_NODESZ(node));
+  node->n_tree->tr_copied.fetch_add(BT_NODESZ(node), std::memory_order_relaxed);
+
+  /* Update our parent to know of the change */
+  if (parent != NULL) {
+    memcpy(&parent->n_ch[idx], &node->n_ptr, sizeof(diskptr_t));
+  } else {
+    /* Make sure we update our root ptr in our main tree datastructure */
+    /* TODO: Update any consumer that this root has changed */
+    btree_setroot(node->n_tree, node->n_ptr);
+  }
+
+  btnode_unlock(&tmp, LK_EXCLUSIVE);
+
+  /* We must invalidate the buffer to insure it never writes */
+  bclean(tmp.n_bp);
+  btree_retire(tmp.n_tree, tmp.n_ptr);
+
+  /* Turn of cow on the node and dirty the node */
+  BT_FRESH_COW(node);
+  if (BT_ISLEAF(node)) {
+    btdelta_fold(node, tmp.n_ptr.offset);
+  }
+  btnode_dirty(node);
+}
+
+/*
+ * Will iterater through the path and perform COW on all entries within the path
+ */
+static void
+path_cow(bpath_t path)
+{
+  /* We hold all the locks of the path exclusively so we can change the parent,
+   * the first locked node is either the root or was already COW'd as locks are
+   * only released above nodes that are not COW
+   */
+  for (int i = path->p_top; i < path->p_len; i++) {
+    /* Only nodes a checkpoint wrote out have to be copied, anything created
+     * or copied since can be changed in place */
+    if (!BT_ISCOW(&path->p_nodes[i])) {
+      continue;
+    }
+
+    if (i > path->p_top) {
+      btnode_cow(
+        &path->p_nodes[i], &path->p_nodes[i - 1], path->p_indexes[i]);
+    } else {
+      assert(i == 0);
+      btnode_cow(&path->p_nodes[i], NULL, 0);
+    }
+  }
+}
+
+static inline void
+path_add(bpath_t path, btree_t tree, diskptr_t ptr, uint16_t cidx, int lk_flags)
+{
+  btnode_init(&path->p_nodes[path->p_len], tree, ptr, lk_flags);
+  path->p_indexes[path->p_len] = cidx;
+  path->p_cur = path->p_len;
+  path->p_len += 1;
+}
+
+/*
+ * Start a path at the root of the tree. The root can be swapped out (COW or a
+ * root split) while we wait on its lock, so make sure it is still the root
+ * once we hold it.
+ */
+static void
+path_add_root(bpath_t path, btree_t tree, int acquire_as)
+{
+  diskptr_t ptr;
+
+  for (;;) {
+    path->p_len = 0;
+    path->p_top = 0;
+    ptr = btree_getroot(tree);
+    path_add(path, tree, ptr, INDEX_NULL, acquire_as);
+    if (btree_getroot(tree).offset == ptr.offset) {
+      return;
+    }
+
+    btnode_unlock(&path->p_nodes[0], acquire_as);
+  }
+}
+
+static inline btnode_t
+path_getcur(bpath_t path)
+{
+  return &path->p_nodes[path->p_cur];
+}
+
+static inline void
+path_unacquire(bpath_t path, int acquire_as)
+{
+  for (int i = path->p_top; i < path->p_len; i++) {
+    btnode_unlock(&path->p_nodes[i], acquire_as);
+  }
+}
+
+static inline bool
+btnode_safe(btnode_t node, int op)
+{
+  switch (op) {
+    case BT_OP_INSERT:
+      return !BT_ISCOW(node) && BT_SAFE_INSERT(node);
+    case BT_OP_DELETE:
+      return !BT_ISCOW(node) && BT_SAFE_DELETE(node);
+    case BT_OP_SCAN:
+      return false;
+    default:
+      return true;
+  }
+}
+
+/*
+ * Lock crabbing, if the current node can take the operation without
+ * splitting, collapsing or being COW'd then nothing above it will be
+ * touched so release every ancestor we still hold.
+ */
+static inline void
+path_crab(bpath_t path, int acquire_as, int op)
+{
+  if (!btnode_safe(path_getcur(path), op)) {
+    return;
+  }
+
+  for (int i = path->p_top; i < path->p_cur; i++) {
+    btnode_unlock(&path->p_nodes[i], acquire_as);
+  }
+
+  path->p_top = path->p_cur;
+}
+
+static inline void
+path_backtrack(bpath_t path)
+{
+  if (path->p_cur > path->p_top) {
+    path->p_cur -= 1;
+  }
+}
+
+static inline btnode_t
+path_fixup_cur_parent(bpath_t path, btnode_t parent)
+{
+  int num_to_move = BT_MAX_PATH_SIZE - path->p_cur - 1;
+  memmove(&path->p_nodes[path->p_cur + 1],
+          &path->p_nodes[path->p_cur],
+          num_to_move * sizeof(btnode));
+  memmove(&path->p_indexes[path->p_cur + 1],
+          &path->p_indexes[path->p_cur],
+          num_to_move * sizeof(uint16_t));
+  memcpy(&path->p_nodes[path->p_cur], parent, sizeof(btnode));
+  /* Old root is the first child of the new one */
+  path->p_indexes[path->p_cur + 1] = 0;
+  path->p_cur += 1;
+  path->p_len += 1;
+  return path_getcur(path);
+}
+
+static inline void
+path_copy(bpath_t dst, bpath_t src)
+{
+  memcpy(dst->p_nodes, src->p_nodes, src->p_len * sizeof(btnode));
+}
+
+/*
+ * Rebuild the directory of an inner node after its keys changed. It is part
+ * of the node so a COW copies it along.
+ */
+static inline void
+btnode_dir_build(btnode_t node)
+{
+#ifdef INNER_DIRECTORY
+  assert(BT_ISINNER(node));
+  dir_build(node->n_keys, node->n_len, node->n_dir, node->n_dir_top);
+#endif
+}
+
+/* Index of the child of inner node CUR, holding LEN keys, that covers KEY */
+static inline int
+btnode_child_index(btnode_t cur, size_t len, uint64_t key)
+{
+#ifdef INNER_DIRECTORY
+  int idx = dir_search(cur->n_keys, len, cur->n_dir, cur->n_dir_top, key);
+#else
+  int idx = binary_search(cur->n_keys, len, key);
+#endif
+  if (idx == len) {
+    return len;
+  }
+
+  uint64_t keyflag = cur->n_keys[idx];
+  if (key > keyflag) {
+    return idx + 1;
+  }
+
+  return idx;
+}
+
+static btnode_t
+btnode_go_deeper(bpath_t path, uint64_t key, int acquire_as)
+{
+  btnode_t cur = path_getcur(path);
+  int cidx = btnode_child_index(cur, cur->n_len, key);
+
+  diskptr_t ptr = *(diskptr_t*)&cur->n_ch[cidx];
+  path_add(path, cur->n_tree, ptr, cidx, acquire_as);
+
+  return path_getcur(path);
+}
+
+/*
+ * Finds the node which should hold param KEY, crabbing locks for OP on the
+ * way down.
+ */
+static btnode_t
+btnode_find_child(bpath_t path, uint64_t key, int acquire_as, int op)
+{
+  btnode_t cur = path_getcur(path);
+  while (BT_ISINNER(cur)) {
+    cur = btnode_go_deeper(path, key, acquire_as);
+    path_crab(path, acquire_as, op);
+  };
+
+  return cur;
+}
+
+/*
+ * Move a path acquired for BT_OP_SCAN over to the next leaf, through the first
+ * ancestor with a child to the right instead of a new descent from the root.
+ * Returns NULL with nothing held at the end of the tree.
+ */
+static btnode_t
+path_next_leaf(bpath_t path, int acquire_as)
+{
+  btnode_t cur;
+  uint16_t cidx;
+
+  while (path->p_cur > path->p_top) {
+    cidx = path_getindex(path);
+    btnode_unlock(path_getcur(path), acquire_as);
+    path->p_len -= 1;
+    path->p_cur -= 1;
+
+    cur = path_getcur(path);
+    if (cidx < cur->n_len) {
+      path_add(path,
+               cur->n_tree,
+               *(diskptr_t*)&cur->n_ch[cidx + 1],
+               cidx + 1,
+               acquire_as);
+      /* Every key is above 0, so this is the leftmost leaf */
+      return btnode_find_child(path, 0, acquire_as, BT_OP_SCAN);
+    }
+  }
+
+  path_unacquire(path, acquire_as);
+  return NULL;
+}
+
+/*
+ * Step an optimistic path down into child CIDX of its current node. Nothing
+ * read from a node can be trusted until its version is validated, as a writer
+ * may be changing it under us. Returns NULL if the current node changed.
+ */
+static btnode_t
+path_go_versioned(bpath_t path, int cidx)
+{
+  btnode_t cur = path_getcur(path);
+  uint64_t v = path->p_versions[path->p_cur];
+  diskptr_t ptr = *(diskptr_t*)&cur->n_ch[cidx];
+
+  /* Make sure the pointer is real before we go fetch it */
+  if (!btnode_validate(cur, v)) {
+    return NULL;
+  }
+
+  path_add(path, cur->n_tree, ptr, cidx, 0);
+  path->p_versions[path->p_cur] = btnode_version(path_getcur(path));
+
+  /* And that it was still our child when we read its version */
+  if (BT_VERSION_LOCKED(path->p_versions[path->p_cur]) ||
+      !btnode_validate(cur, v)) {
+    return NULL;
+  }
+
+  return path_getcur(path);
+}
+
+/* Start an optimistic path at the root, NULL if it is being replaced */
+static btnode_t
+path_root_versioned(bpath_t path, btree_t tree)
+{
+  diskptr_t ptr = btree_getroot(tree);
+
+  path->p_len = 0;
+  path->p_top = 0;
+  path_add(path, tree, ptr, INDEX_NULL, 0);
+  path->p_versions[0] = btnode_version(path_getcur(path));
+  if (BT_VERSION_LOCKED(path->p_versions[0]) ||
+      btree_getroot(tree).offset != ptr.offset) {
+    return NULL;
+  }
+
+  return path_getcur(path);
+}
+
+/*
+ * Lock free descent from the current node of PATH to the leaf that should
+ * hold KEY. If BOUNDS is not NULL, every node on the way down gets the
+ * largest key that can be under it, the current one has to have its bound.
+ */
+static btnode_t
+path_seek_versioned(bpath_t path, uint64_t key, uint64_t* bounds)
+{
+  btnode_t cur = path_getcur(path);
+  size_t len;
+  int cidx;
+
+  while (BT_ISINNER(cur)) {
+    /* Length may be torn, keep the search inside the node */
+    len = std::min((size_t)cur->n_len, (size_t)BT_MAXKEYS(cur));
+    cidx = btnode_child_index(cur, len, key);
+    /* Read before the descent, which validates the node */
+    if (bounds != NULL) {
+      bounds[path->p_cur + 1] =
+        (cidx < len) ? cur->n_keys[cidx] : bounds[path->p_cur];
+    }
+
+    cur = path_go_versioned(path, cidx);
+    if (cur == NULL) {
+      return NULL;
+    }
+  }
+
+  return cur;
+}
+
+/*
+ * Lock free descent to the leaf that should hold KEY. Returns NULL if a writer
+ * got in the way and we should restart, otherwise the leaf, whose version is
+ * the last one of the path.
+ */
+static btnode_t
+path_find_leaf_versioned(bpath_t path, btree_t tree, uint64_t key)
+{
+  if (path_root_versioned(path, tree) == NULL) {
+    return NULL;
+  }
+
+  return path_seek_versioned(path, key, NULL);
+}
+
+/*
+ * Move an optimistic path over to the next leaf through the first ancestor
+ * with a child to the right. Returns 0 once there, -1 at the end of the tree
+ * and BT_RESTART if a node on the path changed since we read it.
+ */
+static int
+path_next_leaf_versioned(bpath_t path)
+{
+  btnode_t cur;
+  uint16_t cidx;
+  size_t len;
+
+  while (path->p_cur > 0) {
+    cidx = path_getindex(path);
+    path->p_len -= 1;
+    path->p_cur -= 1;
+
+    cur = path_getcur(path);
+    len = std::min((size_t)cur->n_len, (size_t)BT_MAXKEYS(cur));
+    if (cidx < len) {
+      cur = path_go_versioned(path, cidx + 1);
+      while (cur != NULL && BT_ISINNER(cur)) {
+        cur = path_go_versioned(path, 0);
+      }
+
+      return (cur == NULL) ? BT_RESTART : 0;
+    }
+
+    if (!btnode_validate(cur, path->p_versions[path->p_cur])) {
+      return BT_RESTART;
+    }
+  }
+
+  return -1;
+}
+
+/*
+ * Optimistic version of btnode_find_ge, returns BT_RESTART if writers kept
+ * changing the nodes we were reading.
+ */
+static int
+btnode_find_ge_optimistic(btree_t tree, uint64_t* key, void* value)
+{
+  btnode_t node;
+  bpath path;
+  uint64_t v, found;
+  btleaf leaf;
+  bool have;
+  int idx;
+
+  for (int i = 0; i < BT_OPTIMISTIC_RETRIES; i++) {
+    node = path_find_leaf_versioned(&path, tree, *key);
+    if (node == NULL) {
+      continue;
+    }
+
+    v = path.p_versions[path.p_cur];
+    btleaf_open(&leaf, node);
+    idx = btleaf_search(&leaf, *key);
+    have = (idx < leaf.l_len);
+    if (have) {
+      found = btleaf_key(&leaf, idx);
+      btval_copy(value, btleaf_val(&leaf, idx), leaf.l_stride);
+    }
+    have = btdelta_ge(node, *key, &found, have, value) || have;
+    if (!btnode_validate(node, v)) {
+      continue;
+    }
+
+    if (!have) {
+      return -1;
+    }
+
+    *key = found;
+    return 0;
+  }
+
+  return BT_RESTART;
+}
+
+/*
+ * Within a node, find the key thats greater than or equal
+ * to value in param KEY.
+ * Function will overwrite key with any key that is found
+ * so call should ensure to save the real key before calling
+ * and check after
+ */
+static int
+btnode_find_ge(btree_t tree, uint64_t* key, void* value, int acquire_as)
+{
+  btnode_t node;
+  int idx, error;
+  uint64_t found;
+  btleaf leaf;
+  bpath path;
+  bool have;
+
+#ifdef OPTIMISTIC_READS
+  if (acquire_as == LK_SHARED) {
+    error = btnode_find_ge_optimistic(tree, key, value);
+    if (error != BT_RESTART) {
+      return error;
+    }
+  }
+#endif
+
+  path_add_root(&path, tree, acquire_as);
+
+  node = btnode_find_child(&path, *key, acquire_as, BT_OP_FIND);
+
+  btleaf_open(&leaf, node);
+  idx = btleaf_search(&leaf, *key);
+  have = (idx < leaf.l_len);
+  if (have) {
+    found = btleaf_key(&leaf, idx);
+    btval_copy(value, btleaf_val(&leaf, idx), leaf.l_stride);
+  }
+  have = btdelta_ge(node, *key, &found, have, value) || have;
+
+  /* Is there no key here */
+  if (!have) {
+    path_unacquire(&path, acquire_as);
+    return -1;
+  }
+
+#ifdef DEBUG
+  printf("[Find] %lu in %lu\n", *key, node->n_ptr.offset);
+#endif
+
+  *key = found;
+
+  path_unacquire(&path, acquire_as);
+
+  return 0;
+}
+
+/* Returns NULL if we do not hold the parent */
+static inline btnode_t
+path_parent(bpath_t path)
+{
+  if (path->p_cur == path->p_top) {
+    return NULL;
+  }
+
+  return &path->p_nodes[path->p_cur - 1];
+}
+
+/*
+ * Optimistic descent for writers, inner nodes are crabbed with shared locks
+ * and only the leaf is locked exclusively. On return the path holds just the
+ * leaf. Returns NULL with nothing held if the root is a leaf.
+ */
+static btnode_t
+btnode_find_leaf_optimistic(bpath_t path, btree_t tree, uint64_t key)
+{
+  btnode_t cur;
+
+  path_add_root(path, tree, LK_SHARED);
+  if (BT_ISLEAF(path_getcur(path))) {
+    path_unacquire(path, LK_SHARED);
+    return NULL;
+  }
+
+  for (;;) {
+    cur = btnode_go_deeper(path, key, LK_SHARED);
+    if (BT_ISLEAF(cur)) {
+      break;
+    }
+
+    path_crab(path, LK_SHARED, BT_OP_FIND);
+  }
+
+  /*
+   * The parent is still held shared so the leaf cannot be split or COW'd
+   * from under us while we trade in our lock
+   */
+  btnode_unlock(cur, LK_SHARED);
+  btnode_lock(cur, LK_EXCLUSIVE);
+  btnode_unlock(path_parent(path), LK_SHARED);
+  path->p_top = path->p_cur;
+
+  return cur;
+}
+
+static void
+btnode_inner_insert(btnode_t node, int idx, uint64_t key, diskptr_t value)
+{
+  assert(BT_ISINNER(node));
+  /* Keys idx.. and the children to their right shift over by one */
   int num_to_move = node->n_len - idx;
   if (num_to_move > 0) {
     memmove(
       &node->n_keys[idx + 1], &node->n_keys[idx], num_to_move * sizeof(key));
+    memmove(&node->n_ch[idx + 2],
+            &node->n_ch[idx + 1],
+            num_to_move * BT_MAX_VALUE_SIZE);
+  }
+
+  node->n_keys[idx] = key;
+  memcpy(&node->n_ch[idx + 1], &value, sizeof(value));
+  node->n_len += 1;
+  btnode_dir_build(node);
+
+  btnode_dirty(node);
+}
+
+/*
+ * Give the root a new, empty, parent so it can be split. The path then holds
+ * the new root above the old one, returns the old root.
+ */
+static btnode_t
+path_grow_root(bpath_t path)
+{
+  btnode_t node = path_getcur(path);
+  btnode parent;
+
+  assert(path->p_cur == 0);
+  btnode_create(&parent, node->n_tree, BT_INNER, NULL);
+  /* Set our current node to the child of our new parent */
+  memcpy(&parent.n_ch[0], &node->n_ptr, sizeof(diskptr_t));
+
+  node = path_fixup_cur_parent(path, &parent);
+
+  /* Fixup root parent ptr in the tree */
+  btree_setroot(node->n_tree, parent.n_ptr);
+
+  return node;
+}
+
+static void
+btnode_split(bpath_t path)
+{
+  int idx, half;
+  btnode_t node = path_getcur(path);
+  btnode_t pptr = path_parent(path);
+  btnode parent;
+  btnode right_child;
+
+#ifdef DEBUG
+  printf("[Split]\n");
+#endif
+
+  /* We are the root */
+  if (pptr == NULL) {
+    node = path_grow_root(path);
+    parent = *path_parent(path);
+    idx = 0;
+  } else {
+    parent = *pptr;
+    idx = path_getindex(path);
+  }
+
+  btnode_create(&right_child, node->n_tree, node->n_type, &node->n_ptr);
+
+  uint64_t split_key;
+
+  if (BT_ISLEAF(node)) {
+    split_key = btleaf_split(node, &right_child);
+  } else {
+    half = BT_SPLITKEYS(node);
+    right_child.n_len = half;
+    node->n_len = half - 1;
+    split_key = node->n_keys[half - 1];
+
+    memcpy(&right_child.n_keys[0], &node->n_keys[half], half * sizeof(uint64_t));
+    memcpy(&right_child.n_ch[0],
+           &node->n_ch[half],
+           (half + 1) * BT_MAX_VALUE_SIZE);
+
+    btnode_dir_build(node);
+    btnode_dir_build(&right_child);
+  }
+
+  /* Setting the pivot key here, with half - 1, means elements to the
+   * right must be strictly greater
+   */
+  btnode_inner_insert(&parent, idx, split_key, right_child.n_ptr);
+
+  /* Unlock the right child and dirty the children*/
+  btnode_dirty(&right_child);
+  btnode_dirty(node);
+
+  btnode_unlock(&right_child, LK_EXCLUSIVE);
+
+  if (parent.n_len == BT_MAXKEYS(&parent)) {
+    printf("DOUBLE SPLIT\n");
+    path_backtrack(path);
+    btnode_split(path);
+  }
+}
+
+static void
+btnode_leaf_insert(btnode_t node, int idx, uint64_t key, void* value)
+{
+  btleaf leaf;
+
+  assert(BT_ISLEAF(node));
+  assert(!BT_ISCOW(node));
+  btleaf_open(&leaf, node);
+  assert(btleaf_fits(&leaf, key));
+  assert(leaf.l_len < btenc_cap(node->n_tree, leaf.l_enc));
+
+#ifdef DEBUG
+  printf("[Insert] %lu at %d in node %lu\n", key, idx, node->n_ptr.offset);
+#endif
+
+  btleaf_shift(&leaf, idx + 1, idx, leaf.l_len - idx);
+  btleaf_set(&leaf, idx, key, value);
+  node->n_len += 1;
+
+  btnode_dirty(node);
+}
+
+static void
+btnode_leaf_update(btnode_t node, int idx, void* value)
+{
+  btleaf leaf;
+
+  assert(BT_ISLEAF(node));
+  assert(!BT_ISCOW(node));
+  btleaf_open(&leaf, node);
+  btval_copy(btleaf_val(&leaf, idx), value, leaf.l_stride);
+  btnode_dirty(node);
+}
+
+/*
+ * Path must end at the leaf that should hold KEY. Returns BT_RESTART if the
+ * leaf had to be split to make room for KEY in its encoding, the caller has
+ * to find the leaf again.
+ */
+static int
+btnode_insert(bpath_t path, uint64_t key, void* value)
+{
+  int idx;
+  btleaf leaf;
+
+  btnode_t node = path_getcur(path);
+
+  /*
+   * If node is COW'd this means the entire path leading
+   * to this node must be COW'd
+   * */
+  if (BT_ISCOW(node)) {
+    path_cow(path);
+  }
+
+  btleaf_open(&leaf, node);
+  idx = btleaf_search(&leaf, key);
+
+  /* Update over insert */
+  if (idx < leaf.l_len && btleaf_key(&leaf, idx) == key) {
+    btnode_leaf_update(node, idx, value);
+    return 0;
+  }
+
+  if (!btleaf_fits(&leaf, key) && !btleaf_widen(node, key)) {
+    btnode_split(path);
+    return BT_RESTART;
+  }
+
+  /* Widening re-encodes the leaf, find our slot again */
+  btleaf_open(&leaf, node);
+  idx = btleaf_search(&leaf, key);
+  btnode_leaf_insert(node, idx, key, value);
+
+  /* A full leaf first tries to fit more keys by encoding them narrower */
+  if (node->n_len == btenc_cap(node->n_tree, node->n_enc) &&
+      !btleaf_compact(node)) {
+    btnode_split(path);
+  }
+
+  return 0;
+}
+
+static void
+btnode_leaf_delete(btnode_t node, int idx, void* value)
+{
+  btleaf leaf;
+
+  assert(BT_ISLEAF(node));
+  btleaf_open(&leaf, node);
+  if (value != NULL)
+    btval_copy(value, btleaf_val(&leaf, idx), leaf.l_stride);
+
+  btleaf_shift(&leaf, idx, idx + 1, leaf.l_len - idx - 1);
+  node->n_len -= 1;
+}
+
+/* Remove key IDX and the child to its right from inner node NODE */
+static void
+btnode_inner_remove(btnode_t node, int idx)
+{
+  int num_to_move = node->n_len - idx - 1;
+  if (num_to_move > 0) {
+    memmove(&node->n_keys[idx],
+            &node->n_keys[idx + 1],
+            num_to_move * sizeof(uint64_t));
+    memmove(&node->n_ch[idx + 1],
+            &node->n_ch[idx + 2],
+            num_to_move * BT_MAX_VALUE_SIZE);
+  }
+
+  node->n_len -= 1;
+  btnode_dir_build(node);
+  btnode_dirty(node);
+}
+
+/*
+ * Move M children from the front of inner node RIGHT to the back of its left
+ * sibling LEFT. SEP is their separator in the parent, it rotates down into
+ * LEFT and RIGHT gives up a new one. Leaves go through btleaf_even.
+ */
+static void
+btnode_shift_left(btnode_t left, btnode_t right, int m, uint64_t* sep)
+{
+  int a = left->n_len;
+  int b = right->n_len;
+
+  assert(BT_ISINNER(left));
+  left->n_keys[a] = *sep;
+  memcpy(&left->n_keys[a + 1], &right->n_keys[0], (m - 1) * sizeof(uint64_t));
+  memcpy(&left->n_ch[a + 1], &right->n_ch[0], m * BT_MAX_VALUE_SIZE);
+  *sep = right->n_keys[m - 1];
+  memmove(&right->n_keys[0], &right->n_keys[m], (b - m) * sizeof(uint64_t));
+  memmove(&right->n_ch[0], &right->n_ch[m], (b - m + 1) * BT_MAX_VALUE_SIZE);
+
+  left->n_len = a + m;
+  right->n_len = b - m;
+}
+
+/* Opposite of btnode_shift_left, the back of LEFT goes to the front of RIGHT */
+static void
+btnode_shift_right(btnode_t left, btnode_t right, int m, uint64_t* sep)
+{
+  int a = left->n_len;
+  int b = right->n_len;
+
+  assert(BT_ISINNER(left));
+  memmove(&right->n_keys[m], &right->n_keys[0], b * sizeof(uint64_t));
+  memmove(&right->n_ch[m], &right->n_ch[0], (b + 1) * BT_MAX_VALUE_SIZE);
+  right->n_keys[m - 1] = *sep;
+  memcpy(
+    &right->n_keys[0], &left->n_keys[a - m + 1], (m - 1) * sizeof(uint64_t));
+  memcpy(&right->n_ch[0], &left->n_ch[a - m + 1], m * BT_MAX_VALUE_SIZE);
+  *sep = left->n_keys[a - m];
+
+  left->n_len = a - m;
+  right->n_len = b + m;
+}
+
+/* Append inner node RIGHT to its left sibling LEFT, SEP is their separator */
+static void
+btnode_merge(btnode_t left, btnode_t right, uint64_t sep)
+{
+  int a = left->n_len;
+  int b = right->n_len;
+
+  assert(BT_ISINNER(left));
+  left->n_keys[a] = sep;
+  memcpy(&left->n_keys[a + 1], &right->n_keys[0], b * sizeof(uint64_t));
+  memcpy(&left->n_ch[a + 1], &right->n_ch[0], (b + 1) * BT_MAX_VALUE_SIZE);
+  left->n_len = a + b + 1;
+}
+
+/*
+ * The current node of the path fell below BT_MINKEYS. Borrow from a sibling
+ * if it can spare keys, otherwise merge the two, which takes a key out of the
+ * parent and may underflow it in turn. An unsafe node keeps its parent held
+ * exclusively, so nobody else can be on their way to the sibling.
+ */
+static void
+btnode_rebalance(bpath_t path)
+{
+  btnode_t node = path_getcur(path);
+  btnode_t parent = path_parent(path);
+  btnode_t left, right;
+  btnode sibling;
+  int idx, sidx, lidx;
+
+  /* The root may hold any number of keys but an inner root needs two
+   * children, otherwise its only child takes its place */
+  if (parent == NULL) {
+    assert(path->p_cur == 0);
+    if (BT_ISINNER(node) && node->n_len == 0) {
+      btree_setroot(node->n_tree, *(diskptr_t*)&node->n_ch[0]);
+      bclean(node->n_bp);
+      btree_retire(node->n_tree, node->n_ptr);
+    }
+    return;
+  }
+
+  /* Nothing to pair up with */
+  if (parent->n_len == 0) {
+    return;
+  }
+
+  if (BT_ISCOW(parent)) {
+    path_cow(path);
+  }
+
+  idx = path_getindex(path);
+  sidx = (idx > 0) ? idx - 1 : idx + 1;
+  btnode_init(
+    &sibling, node->n_tree, *(diskptr_t*)&parent->n_ch[sidx], LK_EXCLUSIVE);
+  if (BT_ISCOW(&sibling)) {
+    btnode_cow(&sibling, parent, sidx);
+  }
+
+  lidx = std::min(idx, sidx);
+  left = (sidx < idx) ? &sibling : node;
+  right = (sidx < idx) ? node : &sibling;
+
+  btnode_dirty(node);
+  btnode_dirty(&sibling);
+
+  if (sibling.n_len > BT_MINKEYS(&sibling)) {
+    /* Even the two out */
+    if (BT_ISLEAF(node)) {
+      btleaf_even(left, right, &parent->n_keys[lidx]);
+    } else if (left == node) {
+      btnode_shift_left(left,
+                        right,
+                        (right->n_len - left->n_len) / 2,
+                        &parent->n_keys[lidx]);
+    } else {
+      btnode_shift_right(left,
+                         right,
+                         (left->n_len - right->n_len) / 2,
+                         &parent->n_keys[lidx]);
+    }
+
+    if (BT_ISINNER(node)) {
+      btnode_dir_build(left);
+      btnode_dir_build(right);
+    }
+    btnode_dir_build(parent);
+    btnode_dirty(parent);
+    btnode_unlock(&sibling, LK_EXCLUSIVE);
+    return;
+  }
+
+  if (BT_ISLEAF(left)) {
+    btleaf_merge(left, right);
+  } else {
+    btnode_merge(left, right, parent->n_keys[lidx]);
+    btnode_dir_build(left);
+  }
+  btnode_inner_remove(parent, lidx);
+
+  /* The right node is dead, if it is on the path it is unlocked with it */
+  btnode_unlock(&sibling, LK_EXCLUSIVE);
+  bclean(right->n_bp);
+  btree_retire(right->n_tree, right->n_ptr);
+
+  if (parent->n_len < BT_MINKEYS(parent)) {
+    path_backtrack(path);
+    btnode_rebalance(path);
+  }
+}
+
+/* Path must end at the leaf that should hold KEY */
+static int
+btnode_delete(bpath_t path, uint64_t key, void* value)
+{
+  btnode_t node;
+  btleaf leaf;
+  int idx;
+
+  node = path_getcur(path);
+
+  /* The chain of the leaf may hold KEY, fold it in first */
+  if (BT_ISCOW(node) && btdelta_chained(node)) {
+    path_cow(path);
+  }
+
+  btleaf_open(&leaf, node);
+  idx = btleaf_search(&leaf, key);
+  if (idx >= leaf.l_len || btleaf_key(&leaf, idx) != key) {
+    return -1;
+  }
+
+  /* Never modify a node that belongs to a checkpoint */
+  if (BT_ISCOW(node)) {
+    path_cow(path);
+  }
+
+  btnode_leaf_delete(node, idx, value);
+  btnode_dirty(node);
+
+  if (node->n_len < BT_MINKEYS(node)) {
+    btnode_rebalance(path);
+  }
+
+  return 0;
+}
+
+static inline void
+btnode_mark_cow(btnode_t node)
+{
+  node->n_hdr.hdr_flags = BT_COW;
+}
+
+#define BULK_DONE (0)
+#define BULK_CONTINUE (1)
+#define BULK_MAX ((uint64_t)(-1))
+/* Leaves a single bulk insert pass can spread a run over */
+#define BULK_MAX_NODES (16)
+
+/*
+ * Merge the sorted run at the front of KEYVALUES, up to MAX_KEY, into the leaf
+ * the path is at. The merge runs backwards from the end so every existing
+ * entry moves at most once. What does not fit is spread evenly over new right
+ * siblings, as many as the parent has room for, all in the narrowest encoding
+ * that holds the whole run. Returns the number of keyvalues consumed.
+ */
+static size_t
+btnode_leaf_bulkinsert(bpath_t path,
+                       kvp* keyvalues,
+                       size_t len,
+                       uint64_t max_key)
+{
+  btnode_t node = path_getcur(path);
+  btnode_t parent = path_parent(path);
+  btnode nodes[BULK_MAX_NODES];
+  btleaf leaves[BULK_MAX_NODES];
+  size_t start[BULK_MAX_NODES];
+  size_t vs = BT_VALSZ(node);
+  size_t maxnodes, room, run, dups, total, nnodes, slot, n, cap;
+  uint64_t low, high;
+  uint64_t* keys;
+  unsigned char* vals;
+  bool inplace;
+  btleaf leaf;
+  int64_t i, j, p;
+  int t, idx, enc, e;
+
+  assert(BT_ISLEAF(node));
+  assert(!BT_ISCOW(node));
+
+  /* Adding a key to a full parent makes it split, only fine if we hold it */
+  room = BT_MAXKEYS(node) - 1;
+  if (parent != NULL) {
+    room = std::max(BT_MAXKEYS(node) - 1 - (int)parent->n_len, 1);
+  }
+  maxnodes = std::min((size_t)BULK_MAX_NODES, room + 1);
+
+  btleaf_open(&leaf, node);
+  n = leaf.l_len;
+  low = keyvalues[0].key;
+  high = keyvalues[0].key;
+  if (n > 0) {
+    low = std::min(low, btleaf_key(&leaf, 0));
+    high = std::max(high, btleaf_key(&leaf, n - 1));
+  }
+
+  /* Length of the run that belongs here and that we have room for */
+  run = 0;
+  enc = BT_ENC_WIDE;
+  while (run < len && keyvalues[run].key <= max_key) {
+    e = btenc_choose(node->n_tree, low, std::max(high, keyvalues[run].key));
+    if (n + run >= maxnodes * (btenc_cap(node->n_tree, e) - 1)) {
+      break;
+    }
+    enc = e;
+    run += 1;
+  }
+
+  /* Only an encoded leaf can hold more than we can spread it over */
+  if (run == 0) {
+    btnode_split(path);
+    return 0;
+  }
+
+  /* Keys already in the leaf are only updated */
+  dups = 0;
+  for (i = 0, j = 0; i < n && j < run;) {
+    if (btleaf_key(&leaf, i) == keyvalues[j].key) {
+      dups += 1;
+      i += 1;
+      j += 1;
+    } else if (btleaf_key(&leaf, i) < keyvalues[j].key) {
+      i += 1;
+    } else {
+      j += 1;
+    }
+  }
+
+  total = n + run - dups;
+  cap = btenc_cap(node->n_tree, enc);
+  nnodes = (total + cap - 2) / (cap - 1);
+
+  /* Wide leaves merge in place, others are rewritten from a copy */
+  inplace = (leaf.l_enc == BT_ENC_WIDE && enc == BT_ENC_WIDE);
+  if (inplace) {
+    keys = (uint64_t*)leaf.l_keys;
+    vals = leaf.l_vals;
+  } else {
+    btleaf_decode(node, &keys, &vals);
+  }
+
+  nodes[0] = *node;
+  start[0] = 0;
+  for (t = 1; t < nnodes; t++) {
+    btnode_create(&nodes[t], node->n_tree, BT_LEAF, &nodes[t - 1].n_ptr);
+    start[t] = start[t - 1] + total / nnodes + ((t - 1) < total % nnodes);
+  }
+
+  for (t = 0; t < nnodes; t++) {
+    nodes[t].n_enc = enc;
+    nodes[t].n_base = low;
+    nodes[t].n_len = ((t + 1 < nnodes) ? start[t + 1] : total) - start[t];
+    btleaf_open(&leaves[t], &nodes[t]);
+  }
+
+  /* Entries below p == i in the leaf itself are already in place */
+  i = (int64_t)n - 1;
+  j = (int64_t)run - 1;
+  t = nnodes - 1;
+  for (p = total - 1; p >= 0 && !(inplace && t == 0 && p == i && j < 0);
+       p--) {
+    while (p < start[t]) {
+      t -= 1;
+    }
+    slot = p - start[t];
+
+    if (j >= 0 && (i < 0 || keyvalues[j].key >= keys[i])) {
+      if (i >= 0 && keyvalues[j].key == keys[i]) {
+        i -= 1;
+      }
+      btleaf_set(&leaves[t], slot, keyvalues[j].key, &keyvalues[j].data);
+      j -= 1;
+    } else {
+      btleaf_set(&leaves[t], slot, keys[i], &vals[i * vs]);
+      i -= 1;
+    }
+  }
+
+  if (!inplace) {
+    free(keys);
+    free(vals);
+  }
+
+  for (t = 0; t < nnodes; t++) {
+    btnode_dirty(&nodes[t]);
+  }
+
+  if (nnodes == 1) {
+    return run;
+  }
+
+  if (parent == NULL) {
+    path_grow_root(path);
+    parent = path_parent(path);
+  }
+
+  idx = path_getindex(path);
+  for (t = 1; t < nnodes; t++) {
+    btnode_inner_insert(parent,
+                        idx + t - 1,
+                        btleaf_key(&leaves[t - 1], leaves[t - 1].l_len - 1),
+                        nodes[t].n_ptr);
+    btnode_unlock(&nodes[t], LK_EXCLUSIVE);
+  }
+
+  if (parent->n_len == BT_MAXKEYS(parent)) {
+    path_backtrack(path);
+    btnode_split(path);
+  }
+
+  return run;
+}
+
+int
+btree_delete(void* treep, uint64_t key, void* value)
+{
+  btree_t tree = (btree_t)treep;
+  btepoch_guard guard(tree);
+
+  int ret;
+  bpath path;
+  btnode_t node;
+
+  node = btnode_find_leaf_optimistic(&path, tree, key);
+  if (node != NULL && btnode_safe(node, BT_OP_DELETE)) {
+    ret = btnode_delete(&path, key, value);
+    path_unacquire(&path, LK_EXCLUSIVE);
+    return ret;
+  }
+
+  /* Leaf may collapse, retry holding every unsafe node on the way down */
+  if (node != NULL) {
+    path_unacquire(&path, LK_EXCLUSIVE);
+  }
+
+  path_add_root(&path, tree, LK_EXCLUSIVE);
+  btnode_find_child(&path, key, LK_EXCLUSIVE, BT_OP_DELETE);
+
+  ret = btnode_delete(&path, key, value);
+
+  path_unacquire(&path, LK_EXCLUSIVE);
+
+  return ret;
+}
+
+int
+btnode_bulkinsert(bpath_t path, kvp** keyvalues, size_t* len, uint64_t max_key)
+{
+  int idx;
+  btnode_t next;
+  kvp* kvs = *keyvalues;
+  size_t inserted;
+
+  btnode_t cur = path_getcur(path);
+  if (*len == 0)
+    return BULK_DONE;
+
+  /* If we are at a leaf the remaining keys can go here */
+  if (BT_ISLEAF(cur)) {
+
+    if (BT_ISCOW(cur)) {
+      path_cow(path);
+    }
+
+    inserted = btnode_leaf_bulkinsert(path, kvs, *len, max_key);
+    /* Update our pointer to further along the list */
+    *keyvalues = &kvs[inserted];
+    *len -= inserted;
+
+    return BULK_CONTINUE;
+  }
+
+  next = btnode_go_deeper(path, kvs[0].key, LK_EXCLUSIVE);
+  cur = path_parent(path);
+  /* What is our index */
+  idx = path_getindex(path);
+  /* It is the last child */
+  if (idx != cur->n_len) {
+    /* Change our max key */
+    max_key = path_parent(path)->n_keys[idx];
+  }
+
+  /*
+   * A leaf can fill up no matter how much room it has now so always keep its
+   * parent, inner nodes take at most one key per pass
+   */
+  if (BT_ISINNER(next)) {
+    path_crab(path, LK_EXCLUSIVE, BT_OP_INSERT);
+  }
+
+  return btnode_bulkinsert(path, keyvalues, len, max_key);
+}
+
+/* Assume keyvalues list is sorted */
+int
+btree_bulkinsert(void* treep, kvp* keyvalues, size_t len)
+{
+  btree_t tree = (btree_t)treep;
+  btepoch_guard guard(tree);
+
+  int ret;
+  bpath path;
+  kvp* kvs = keyvalues;
+
+  path_add_root(&path, tree, LK_EXCLUSIVE);
+  ret = btnode_bulkinsert(&path, &keyvalues, &len, BULK_MAX);
+  while (ret != BULK_DONE) {
+    /* We got some amount of keys done */
+    path_unacquire(&path, LK_EXCLUSIVE);
+    /* Reset our path */
+    path_add_root(&path, tree, LK_EXCLUSIVE);
+    ret = btnode_bulkinsert(&path, &keyvalues, &len, BULK_MAX);
+  }
+
+  path_unacquire(&path, LK_EXCLUSIVE);
+
+  return 0;
+}
+
+/* Node of a level being bulk loaded, and the largest key under it */
+typedef struct btload
+{
+  diskptr_t bl_ptr;
+  uint64_t bl_max;
+} btload;
+
+/*
+ * Pack the nodes of LEVEL, COUNT of them, under new inner nodes taking up to
+ * FANOUT children each. Nodes are sized evenly so the last one is not left
+ * nearly empty. Overwrites LEVEL with the new level and returns its size.
+ */
+static size_t
+btnode_load_inner(btree_t tree, btload* level, size_t count, size_t fanout)
+{
+  size_t nnodes = (count + fanout - 1) / fanout;
+  size_t off = 0;
+  size_t num;
+  btnode node;
+
+  for (size_t i = 0; i < nnodes; i++) {
+    num = count / nnodes + (i < count % nnodes);
+    btnode_create(&node, tree, BT_INNER, (i > 0) ? &level[i - 1].bl_ptr : NULL);
+    for (size_t j = 0; j < num; j++) {
+      memcpy(&node.n_ch[j], &level[off + j].bl_ptr, sizeof(diskptr_t));
+      if (j < num - 1) {
+        node.n_keys[j] = level[off + j].bl_max;
+      }
+    }
+    node.n_len = num - 1;
+    btnode_dir_build(&node);
+
+    level[i].bl_ptr = node.n_ptr;
+    level[i].bl_max = level[off + num - 1].bl_max;
+    off += num;
+
+    btnode_dirty(&node);
+    btnode_unlock(&node, LK_EXCLUSIVE);
+  }
+
+  return nnodes;
+}
+
+/*
+ * Build the tree bottom up from sorted, unique KEYVALUES. Leaves are packed
+ * FILL percent full straight from the input and every inner level is built
+ * from the one below, so nothing is ever searched or split. The tree has to
+ * be empty, returns -1 otherwise.
+ */
+int
+btree_bulkload(void* treep, kvp* keyvalues, size_t len, int fill)
+{
+  btree_t tree = (btree_t)treep;
+  btepoch_guard guard(tree);
+
+  size_t per, lper, nnodes, num, off;
+  btnode_t root;
+  btload* level;
+  btleaf leaf;
+  btnode node;
+  bpath path;
+
+  if (fill <= 0 || fill > 100) {
+    return -1;
+  }
+
+  /* Keys per node, a full node is split on the next insert */
+  per = std::max((size_t)2, (size_t)(tree->tr_max_keys - 1) * fill / 100);
+  lper = std::max((size_t)2,
+                  (btenc_cap(tree, BT_ENC_WIDE) - 1) * fill / 100);
+
+  path_add_root(&path, tree, LK_EXCLUSIVE);
+  root = path_getcur(&path);
+  if (!BT_ISLEAF(root) || root->n_len != 0) {
+    path_unacquire(&path, LK_EXCLUSIVE);
+    return -1;
+  }
+
+  if (len == 0) {
+    path_unacquire(&path, LK_EXCLUSIVE);
+    return 0;
+  }
+
+  nnodes = (len + lper - 1) / lper;
+  level = (btload*)malloc(nnodes * sizeof(btload));
+  if (level == NULL) {
+    path_unacquire(&path, LK_EXCLUSIVE);
+    return -1;
+  }
+
+  off = 0;
+  for (size_t i = 0; i < nnodes; i++) {
+    num = len / nnodes + (i < len % nnodes);
+    btnode_create(&node, tree, BT_LEAF, (i > 0) ? &level[i - 1].bl_ptr : NULL);
+    node.n_len = num;
+    btleaf_open(&leaf, &node);
+    for (size_t j = 0; j < num; j++) {
+      btleaf_set(&leaf, j, keyvalues[off + j].key, &keyvalues[off + j].data);
+    }
+
+    level[i].bl_ptr = node.n_ptr;
+    level[i].bl_max = keyvalues[off + num - 1].key;
+    off += num;
+
+    btnode_dirty(&node);
+    btnode_unlock(&node, LK_EXCLUSIVE);
+  }
+
+  while (nnodes > 1) {
+    nnodes = btnode_load_inner(tree, level, nnodes, per + 1);
+  }
+
+  /* Nothing could reach the new nodes until now */
+  btree_setroot(tree, level[0].bl_ptr);
+  free(level);
+
+  btnode_unlock(root, LK_EXCLUSIVE);
+  bclean(root->n_bp);
+  btree_retire(tree, root->n_ptr);
+
+  return 0;
+}
+
+/*
+ * Write every chain of TREE to a new delta log and point the root at it, for
+ * the checkpoint about to be taken. Nothing is written if the chains did not
+ * change and the root still points at the last log.
+ */
+static void
+btdelta_persist(btree_t tree)
+{
+  std::vector<btdeltarec> recs;
+  btdeltashard* shard;
+  struct buf* bp;
+  btnode_t root;
+  diskptr_t log;
+  bpath path;
+  size_t len;
+  bool stale;
+
+  path_add_root(&path, tree, LK_EXCLUSIVE);
+  root = path_getcur(&path);
+
+  /* Roots that replaced the last checkpoint's may not carry its log */
+  stale = !BT_ISCOW(root) &&
+          (root->n_hdr.hdr_deltas != tree->tr_delta_log.offset ||
+           root->n_hdr.hdr_ndeltas != tree->tr_delta_len);
+  if (!tree->tr_delta_dirty.exchange(false) && !stale) {
+    path_unacquire(&path, LK_EXCLUSIVE);
+    return;
+  }
+
+  if (BT_ISCOW(root)) {
+    path_cow(&path);
+  }
+
+  for (int i = 0; i < BT_DELTA_SHARDS; i++) {
+    shard = &tree->tr_deltas[i];
+    std::shared_lock<std::shared_mutex> guard(shard->s_lk);
+    for (auto& it : shard->s_chains) {
+      for (int d = 0; d < it.second.c_len; d++) {
+        recs.push_back({ it.first, it.second.c_deltas[d] });
+      }
+    }
+  }
+
+  log = {};
+  if (!recs.empty()) {
+    len = recs.size() * sizeof(btdeltarec);
+    log = allocate_blk(len);
+    bp = getblk(log.offset, log.size * PBLKSZ, LK_EXCLUSIVE);
+    memcpy(bp->bp_data, recs.data(), len);
+    bawrite(bp);
+    buf_unlock(bp, LK_EXCLUSIVE);
+    tree->tr_logged.fetch_add(len, std::memory_order_relaxed);
+  }
+
+  /* The last checkpoint still points at the old log */
+  if (tree->tr_delta_log.size > 0) {
+    btree_retire(tree, tree->tr_delta_log);
+  }
+  tree->tr_delta_log = log;
+  tree->tr_delta_len = recs.size();
+  root->n_hdr.hdr_deltas = log.offset;
+  root->n_hdr.hdr_ndeltas = recs.size();
+  btnode_dirty(root);
+  path_unacquire(&path, LK_EXCLUSIVE);
+}
+
+/* Rebuild the chains of a tree opened at a checkpoint root */
+static void
+btdelta_load(btree_t tree)
+{
+  btdeltashard* shard;
+  btdeltarec* recs;
+  btchain* chain;
+  struct buf* bp;
+  btnode root, leaf;
+  btleaf lf;
+  size_t len;
+
+  btnode_init(&root, tree, tree->tr_ptr, LK_SHARED);
+  tree->tr_delta_log.offset = root.n_hdr.hdr_deltas;
+  tree->tr_delta_len = root.n_hdr.hdr_ndeltas;
+  btnode_unlock(&root, LK_SHARED);
+  if (tree->tr_delta_len == 0) {
+    return;
+  }
+
+  len = tree->tr_delta_len * sizeof(btdeltarec);
+  tree->tr_delta_log.size = (len + PBLKSZ - 1) / PBLKSZ;
+  bp = getblk(tree->tr_delta_log.offset,
+              tree->tr_delta_log.size * PBLKSZ,
+              LK_SHARED);
+  recs = (btdeltarec*)bp->bp_data;
+
+  /* Records of a chain are next to each other, oldest first */
+  for (size_t i = 0; i < tree->tr_delta_len; i++) {
+    shard = btdelta_shard(tree, recs[i].dr_leaf);
+    if (i == 0 || recs[i].dr_leaf != recs[i - 1].dr_leaf) {
+      if (i > 0) {
+        btnode_unlock(&leaf, LK_SHARED);
+      }
+      btnode_init(&leaf,
+                  tree,
+                  { recs[i].dr_leaf, tree->tr_nodesz / PBLKSZ, 0, 0 },
+                  LK_SHARED);
+      btleaf_open(&lf, &leaf);
+      chain = btdelta_new(tree, shard, recs[i].dr_leaf);
+    }
+
+    btdelta_append(
+      tree, chain, &lf, recs[i].dr_delta.d_key, recs[i].dr_delta.d_data);
+  }
+  btnode_unlock(&leaf, LK_SHARED);
+  buf_unlock(bp, LK_SHARED);
+}
+
+int
+btree_init(void* tree_ptr, diskptr_t ptr, size_t value_size)
+{
+  btree_t tree = (btree_t)tree_ptr;
+  size_t nodesz = ptr.size * PBLKSZ;
+
+  assert(value_size <= BT_MAX_VALUE_SIZE);
+
+  /* Nodes are as large as the root */
+  if (nodesz < BT_MIN_NODESZ || nodesz > BLKSZ || (nodesz & (nodesz - 1))) {
+    return -1;
+  }
+
+  tree->tr_ptr = ptr;
+  tree->tr_vs = value_size;
+  tree->tr_flags = 0;
+  tree->tr_nodesz = nodesz;
+  tree->tr_max_keys = bt_inner_keys(nodesz);
+  tree->tr_split_keys = tree->tr_max_keys / 2;
+  tree->tr_min_keys = tree->tr_max_keys * BT_MIN_FILL / 100;
+  /* Wide leaves hold the fewest entries, merged leaves fit in any encoding */
+  tree->tr_min_leaf_keys = btenc_cap(tree, BT_ENC_WIDE) * BT_MIN_FILL / 100;
+  tree->tr_copied.store(0);
+  bufobj_init(&tree->tr_bo);
+  for (int i = 0; i < BT_DELTA_SHARDS; i++) {
+    tree->tr_deltas[i].s_chains.clear();
+    tree->tr_deltas[i].s_count.store(0);
+  }
+  tree->tr_nchains.store(0);
+  tree->tr_delta_dirty.store(false);
+  tree->tr_logged.store(0);
+  /* Checkpoint roots start the tree in the epoch after theirs */
+  tree->tr_epoch.store(ptr.epoch + 1);
+  for (int i = 0; i < BT_EPOCH_SLOTS; i++) {
+    tree->tr_slots[i].s_epoch.store(0);
+  }
+  tree->tr_retired.clear();
+  tree->tr_snapshots.clear();
+  tree->tr_freed.store(0);
+#ifdef LEAF_COMPRESSION
+  tree->tr_flags |= BT_TREE_COMPRESS;
+#endif
+  tree->tr_seq.store(0);
+  btdelta_load(tree);
+
+  return 0;
+}
+
+int
+btree_insert(void* treep, uint64_t key, void* value)
+{
+  btree_t tree = (btree_t)treep;
+  btepoch_guard guard(tree);
+
+  int ret;
+  bpath path;
+  btnode_t node;
+#ifdef DEBUG
+  printf("[Insert] %lu\n", key);
+#endif
+
+  node = btnode_find_leaf_optimistic(&path, tree, key);
+  if (node != NULL && btleaf_safe_insert(node, key)) {
+    ret = btnode_insert(&path, key, value);
+    path_unacquire(&path, LK_EXCLUSIVE);
+    return (ret);
+  }
+
+  /* Checkpointed leaves take a delta instead of a copy of their path */
+  if (node != NULL && btdelta_add(node, key, value)) {
+    path_unacquire(&path, LK_EXCLUSIVE);
+    return 0;
+  }
+
+  /* Leaf may split or need a COW, retry holding every unsafe node */
+  if (node != NULL) {
+    path_unacquire(&path, LK_EXCLUSIVE);
   }
 
-  if (num_to_move > 0) {
-    memmove(&node->n_ch[idx + 2],
-            &node->n_ch[idx + 1],
-            num_to_move * BT_MAX_VALUE_SIZE);
+  do {
+    path_add_root(&path, tree, LK_EXCLUSIVE);
+    btnode_find_child(&path, key, LK_EXCLUSIVE, BT_OP_INSERT);
+
+    ret = btnode_insert(&path, key, value);
+
+    path_unacquire(&path, LK_EXCLUSIVE);
+  } while (ret == BT_RESTART);
+
+  return (ret);
+}
+
+int
+btree_greater_equal(void* treep, uint64_t* key, void* value)
+{
+  btree_t tree = (btree_t)treep;
+  btepoch_guard guard(tree);
+  uint64_t possible_key = *key;
+  int error;
+
+  error = btnode_find_ge(tree, &possible_key, value, LK_SHARED);
+  if (error) {
+    return error;
   }
 
+  *key = possible_key;
+
+  return 0;
+}
+
+int
+btree_find(void* treep, uint64_t key, void* value)
+{
+  btree_t tree = (btree_t)treep;
+  btepoch_guard guard(tree);
+  uint64_t possible_key = key;
+  int error;
 #ifdef DEBUG
-  printf("[Insert] %lu at %d in node %lu\n", key, idx, node->n_ptr.offset);
+  printf("[Find] %lu\n", key);
 #endif
 
-  node->n_keys[idx] = key;
-  memcpy(&node->n_ch[idx + 1], value, BT_VALSZ(node));
-  node->n_len += 1;
+  error = btnode_find_ge(tree, &possible_key, value, LK_SHARED);
+  if (error) {
+    return (error);
+  }
+
+  if (possible_key != key) {
+    return (-1);
+  }
 
-  bdirty(node->n_bp);
+  return 0;
 }
 
-static void
-btnode_leaf_update(btnode_t node, int idx, void* value)
+/* Key of a multifind and the slot its answer goes to */
+typedef struct btmulti
 {
-  assert(BT_ISLEAF(node));
-  assert(!BT_ISCOW(node));
-  memcpy(&node->n_ch[idx + 1], value, BT_VALSZ(node));
-  bdirty(node->n_bp);
+  uint64_t m_key;
+  size_t m_slot;
+} btmulti;
+
+static bool
+btmulti_order(const btmulti& a, const btmulti& b)
+{
+  return a.m_key < b.m_key;
 }
 
+/*
+ * Answer the sorted KEYS from *FROM on with one optimistic path. The path only
+ * climbs as far as the first node whose bound covers the next key, so keys
+ * under the same leaf share everything but the search of the leaf. Moves
+ * *FROM past what was answered, returns BT_RESTART if writers kept getting in
+ * the way.
+ */
 static int
-btnode_insert(bpath_t path, uint64_t key, void* value)
+btree_multifind_optimistic(btree_t tree,
+                           btepoch_guard* guard,
+                           btmulti* keys,
+                           size_t* from,
+                           size_t n,
+                           unsigned char* values,
+                           int* errors)
 {
+  uint64_t bounds[BT_MAX_PATH_SIZE];
+  size_t i = *from;
+  size_t leaves = 0;
+  size_t first;
+  uint64_t v, found;
+  btnode_t node;
+  btleaf leaf;
+  bpath path;
+  bool have;
   int idx;
 
-  btnode_find_child(path, key, LK_EXCLUSIVE);
-  btnode_t node = path_getcur(path);
-  idx = binary_search(node->n_keys, node->n_len, key);
+  path.p_len = 0;
+  for (int r = 0; r < BT_OPTIMISTIC_RETRIES && i < n;) {
+    if (path.p_len == 0) {
+      if (path_root_versioned(&path, tree) == NULL) {
+        r += 1;
+        continue;
+      }
+      bounds[0] = UINT64_MAX;
+    }
 
-  /*
-   * If node is COW'd this means the entire path leading
-   * to this node must be COW'd
-   * */
-  if (BT_ISCOW(node)) {
-    path_cow(path);
+    while (path.p_cur > 0 && keys[i].m_key > bounds[path.p_cur]) {
+      path.p_len -= 1;
+      path.p_cur -= 1;
+    }
+
+    node = path_seek_versioned(&path, keys[i].m_key, bounds);
+    if (node == NULL) {
+      path.p_len = 0;
+      r += 1;
+      continue;
+    }
+
+    v = path.p_versions[path.p_cur];
+    btleaf_open(&leaf, node);
+    for (first = i; i < n && keys[i].m_key <= bounds[path.p_cur]; i++) {
+      void* value = &values[keys[i].m_slot * BT_VALSZ(node)];
+      idx = btleaf_search(&leaf, keys[i].m_key);
+      have = (idx < leaf.l_len);
+      if (have) {
+        found = btleaf_key(&leaf, idx);
+        btval_copy(value, btleaf_val(&leaf, idx), leaf.l_stride);
+      }
+      have = btdelta_ge(node, keys[i].m_key, &found, have, value) || have;
+      errors[keys[i].m_slot] = (have && found == keys[i].m_key) ? 0 : -1;
+    }
+
+    /* Answer the keys of this leaf again from the root */
+    if (!btnode_validate(node, v)) {
+      i = first;
+      path.p_len = 0;
+      r += 1;
+      continue;
+    }
+    *from = i;
+    r = 0;
+
+    if (++leaves % BT_REPIN_LEAVES == 0) {
+      guard->repin();
+      path.p_len = 0;
+    }
   }
 
-  /* Update over insert */
-  if (node->n_keys[idx] == key) {
-    btnode_leaf_update(node, idx, value);
-  } else {
-    btnode_leaf_insert(node, idx, key, value);
-    if (node->n_len == BT_MAX_KEYS) {
-      btnode_split(path);
+  return (i < n) ? BT_RESTART : 0;
+}
+
+/*
+ * Find the N KEYS, in any order. The value of KEYS[i] goes to slot i of
+ * VALUES and ERRORS[i] is 0 if it was found, -1 otherwise. Keys are sorted
+ * and answered leaf by leaf, so a batch costs one descent plus one search per
+ * key. Returns -1 only if it could not sort the keys.
+ */
+int
+btree_multifind(void* treep,
+                uint64_t* keys,
+                size_t n,
+                void* values,
+                int* errors)
+{
+  btree_t tree = (btree_t)treep;
+  btepoch_guard guard(tree);
+  unsigned char* vals = (unsigned char*)values;
+  size_t from = 0;
+  size_t slot;
+  uint64_t found;
+  btmulti* sorted;
+  int error;
+
+  sorted = (btmulti*)malloc(n * sizeof(btmulti));
+  if (sorted == NULL) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    sorted[i].m_key = keys[i];
+    sorted[i].m_slot = i;
+  }
+  std::sort(sorted, sorted + n, btmulti_order);
+
+#ifdef OPTIMISTIC_READS
+  btree_multifind_optimistic(tree, &guard, sorted, &from, n, vals, errors);
+#endif
+
+  /* Whatever writers kept us from answering is looked up one by one */
+  for (size_t i = from; i < n; i++) {
+    if ((i - from + 1) % BT_REPIN_LEAVES == 0) {
+      guard.repin();
     }
+    slot = sorted[i].m_slot;
+    found = sorted[i].m_key;
+    error = btnode_find_ge(tree, &found, &vals[slot * tree->tr_vs], LK_SHARED);
+    errors[slot] = (error == 0 && found == sorted[i].m_key) ? 0 : -1;
   }
 
+  free(sorted);
   return 0;
 }
+
+/* Lookups btree_find_async keeps in flight at most */
+#define BT_ASYNC_DEPTH (64)
+/* A lookup that is waiting on the read of its next node */
+#define BT_ASYNC_WAIT (2)
+
+/*
+ * A lookup of btree_find_async, a lock free descent that can stop before any
+ * node while the read of that node is in flight.
+ */
+typedef struct btasync
+{
+  uint64_t a_key;
+  size_t a_slot;
+  bpath a_path;
+  /* Node to visit next, the child A_CIDX of the current node of the path */
+  diskptr_t a_next;
+  int a_cidx;
+  /* Handle of the read of A_NEXT, if it was started, see bread_async */
+  uint64_t a_ready;
+  bool a_issued;
+  int a_retries;
+  bool a_busy;
+} btasync;
+
 static void
-btnode_leaf_delete(btnode_t node, int idx, void* value)
+btasync_start(btree_t tree, btasync* op, uint64_t key, size_t slot)
 {
-  assert(BT_ISLEAF(node));
-  int num_to_move = node->n_len - idx;
+  op->a_key = key;
+  op->a_slot = slot;
+  op->a_path.p_len = 0;
+  op->a_next = btree_getroot(tree);
+  op->a_issued = false;
+  op->a_retries = 0;
+  op->a_busy = true;
+}
 
-  if (value != NULL)
-    memcpy(value, &node->n_ch[idx + 1], BT_VALSZ(node));
+/*
+ * Step OP down the tree until it needs a node that is not in memory. Returns
+ * 0 once the key was answered, BT_ASYNC_WAIT if it waits on a read that is
+ * done at A_READY, and BT_RESTART if writers kept getting in the way.
+ */
+static int
+btasync_run(btree_t tree, btasync* op, unsigned char* values, int* errors)
+{
+  void* value = &values[op->a_slot * tree->tr_vs];
+  bpath_t path = &op->a_path;
+  uint64_t v, found;
+  btnode_t node;
+  btleaf leaf;
+  size_t len;
+  bool have;
+  int idx;
 
-  if (num_to_move > 0) {
-    memmove(&node->n_keys[idx],
-            &node->n_keys[idx + 1],
-            num_to_move * sizeof(uint64_t));
+  for (;;) {
+    /* The pointer was validated, or is the root */
+    if (!op->a_issued) {
+      op->a_ready = bread_async(op->a_next.offset, tree->tr_nodesz);
+      op->a_issued = true;
+    }
+
+    if (!buf_ready(op->a_ready)) {
+      return BT_ASYNC_WAIT;
+    }
+
+    op->a_issued = false;
+    node = (path->p_len == 0) ? path_root_versioned(path, tree)
+                              : path_go_versioned(path, op->a_cidx);
+    if (node != NULL && BT_ISINNER(node)) {
+      len = std::min((size_t)node->n_len, (size_t)BT_MAXKEYS(node));
+      op->a_cidx = btnode_child_index(node, len, op->a_key);
+      op->a_next = *(diskptr_t*)&node->n_ch[op->a_cidx];
+      /* A torn pointer would read a stray block into the cache */
+      if (btnode_validate(node, path->p_versions[path->p_cur])) {
+        continue;
+      }
+    } else if (node != NULL) {
+      v = path->p_versions[path->p_cur];
+      btleaf_open(&leaf, node);
+      idx = btleaf_search(&leaf, op->a_key);
+      have = (idx < leaf.l_len);
+      if (have) {
+        found = btleaf_key(&leaf, idx);
+        btval_copy(value, btleaf_val(&leaf, idx), leaf.l_stride);
+      }
+      have = btdelta_ge(node, op->a_key, &found, have, value) || have;
+      if (btnode_validate(node, v)) {
+        errors[op->a_slot] = (have && found == op->a_key) ? 0 : -1;
+        return 0;
+      }
+    }
+
+    /* Start over from the root */
+    if (++op->a_retries == BT_OPTIMISTIC_RETRIES) {
+      return BT_RESTART;
+    }
+    path->p_len = 0;
+    op->a_next = btree_getroot(tree);
   }
+}
 
-  if (num_to_move > 0) {
-    memmove(&node->n_ch[idx + 1],
-            &node->n_ch[idx + 2],
-            num_to_move * BT_MAX_VALUE_SIZE);
+/*
+ * Find the N KEYS like btree_multifind, but as DEPTH lookups interleaved on
+ * the calling thread. A lookup that needs a node that is not in memory starts
+ * its read and lets the others run, so the reads of up to DEPTH lookups are in
+ * flight at once. Returns -1 only if it could not allocate the lookups.
+ */
+int
+btree_find_async(void* treep,
+                 uint64_t* keys,
+                 size_t n,
+                 void* values,
+                 int* errors,
+                 int depth)
+{
+  btree_t tree = (btree_t)treep;
+  btepoch_guard guard(tree);
+  unsigned char* vals = (unsigned char*)values;
+  size_t next = 0;
+  size_t active = 0;
+  size_t answered = 0;
+  uint64_t found, wake;
+  bool progress;
+  btasync* ops;
+  btasync* op;
+  int error;
+
+  depth = std::max(1, std::min(depth, BT_ASYNC_DEPTH));
+  ops = (btasync*)malloc(depth * sizeof(btasync));
+  if (ops == NULL) {
+    return -1;
   }
-  node->n_len -= 1;
+
+  for (int d = 0; d < depth; d++) {
+    ops[d].a_busy = false;
+  }
+
+  while (next < n || active > 0) {
+    wake = UINT64_MAX;
+    progress = false;
+    for (int d = 0; d < depth; d++) {
+      op = &ops[d];
+      if (!op->a_busy) {
+        if (next == n) {
+          continue;
+        }
+        btasync_start(tree, op, keys[next], next);
+        next += 1;
+        active += 1;
+      }
+
+#ifdef OPTIMISTIC_READS
+      error = btasync_run(tree, op, vals, errors);
+#else
+      error = BT_RESTART;
+#endif
+      if (error == BT_ASYNC_WAIT) {
+        wake = std::min(wake, op->a_ready);
+        continue;
+      }
+
+      /* Writers kept getting in the way, look it up the blocking way */
+      if (error == BT_RESTART) {
+        found = op->a_key;
+        error = btnode_find_ge(
+          tree, &found, &vals[op->a_slot * tree->tr_vs], LK_SHARED);
+        errors[op->a_slot] = (error == 0 && found == op->a_key) ? 0 : -1;
+      }
+
+      op->a_busy = false;
+      active -= 1;
+      progress = true;
+
+      /* Lookups in flight start over from the root under the new pins */
+      if (++answered % BT_REPIN_LEAVES == 0) {
+        guard.repin();
+        for (int o = 0; o < depth; o++) {
+          if (ops[o].a_busy) {
+            btasync_start(tree, &ops[o], ops[o].a_key, ops[o].a_slot);
+          }
+        }
+      }
+    }
+
+    /* Every lookup waits on a read, sleep until the first one is done */
+    if (!progress && active > 0) {
+      buf_wait(wake);
+    }
+  }
+
+  free(ops);
+  return 0;
+}
+
+/*
+ * Checkpoints sort their dirty nodes by block and mark them COW a run at a
+ * time. With writers each run is queued as soon as it is marked, so runs are
+ * written while the next ones are still being marked.
+ */
+#define BT_CHECKPOINT_RUN (64)
+
+/* Nodes of a checkpoint marked COW, waiting for a writer */
+typedef struct btflushrun
+{
+  struct buf** r_bufs;
+  size_t r_count;
+  /* Runs of the checkpoint not written yet, protected by p_lk */
+  size_t* r_pending;
+} btflushrun;
+
+/* Started by the first checkpoint, the writers live as long as the process */
+typedef struct btflushpool
+{
+  std::mutex p_lk;
+  /* A run was queued or writers were turned on */
+  std::condition_variable p_work;
+  /* A run was written */
+  std::condition_variable p_done;
+  std::deque<btflushrun> p_runs;
+  std::atomic<uint64_t> p_written[BT_CHECKPOINT_WORKERS];
+} btflushpool;
+
+static btflushpool* btflush_pool;
+static std::once_flag btflush_once;
+/* Writers taking runs, -1 until set with btree_checkpoint_workers */
+static std::atomic<int> btflush_active(-1);
+
+static int
+btflush_workers()
+{
+  int active = btflush_active.load(std::memory_order_relaxed);
+
+  if (active >= 0) {
+    return active;
+  }
+
+  if (dev_active()) {
+    return BT_CHECKPOINT_WORKERS;
+  }
+
+#ifdef DISK_LATENCY
+  return BT_CHECKPOINT_WORKERS;
+#else
+  /* Writes cost nothing without a device, writers only add */
+  return 0;
+#endif
 }
 
+/* The device works on the whole run at once */
 static void
-btnode_inner_collapse(bpath_t path)
+btflush_write(btflushrun* run)
 {
-  diskptr_t* ptr;
+  bawrite_batch(run->r_bufs, run->r_count);
+}
 
-  btnode_t node = path_getcur(path);
-  btnode_t parent = path_parent(path);
+/* RUN was taken off the queue and written */
+static void
+btflush_done(btflushpool* pool, btflushrun* run)
+{
+  {
+    std::lock_guard<std::mutex> lk(pool->p_lk);
+    *run->r_pending -= 1;
+  }
+  pool->p_done.notify_all();
+}
 
-  /* We are the root, and if we've gotten to this point that means
-   * We collapsed the last child into the parent so the parent need
-   * to become a leaf again */
-  if (parent == NULL) {
-    /* Ensure we are a leaf now */
-    node->n_type = BT_LEAF;
-    return;
+static void
+btflush_worker(int id)
+{
+  btflushpool* pool = btflush_pool;
+  btflushrun run;
+
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lk(pool->p_lk);
+      while (pool->p_runs.empty() || id >= btflush_workers()) {
+        pool->p_work.wait(lk);
+      }
+      run = pool->p_runs.front();
+      pool->p_runs.pop_front();
+    }
+
+    btflush_write(&run);
+    pool->p_written[id].fetch_add(1, std::memory_order_relaxed);
+    btflush_done(pool, &run);
   }
+}
 
-  if (node->n_len == 0) {
-    return;
+static void
+btflush_start()
+{
+  /* Never freed, writers may still be waiting on it at exit */
+  btflush_pool = new btflushpool();
+  for (int i = 0; i < BT_CHECKPOINT_WORKERS; i++) {
+    btflush_pool->p_written[i].store(0);
+    std::thread(btflush_worker, i).detach();
   }
+}
 
-  /* Find our index */
-  int idx;
-  for (idx = 0; idx < parent->n_len + 1; idx++) {
-    ptr = (diskptr_t*)&parent->n_ch[idx];
-    if (memcmp(ptr, &node->n_ptr, sizeof(diskptr_t)) == 0)
-      break;
+void
+btree_checkpoint_workers(int count)
+{
+  std::call_once(btflush_once, btflush_start);
+  {
+    std::lock_guard<std::mutex> lk(btflush_pool->p_lk);
+    btflush_active.store(std::min(count, BT_CHECKPOINT_WORKERS));
   }
+  btflush_pool->p_work.notify_all();
+}
 
-  assert(memcmp(ptr, &node->n_ptr, sizeof(diskptr_t)) == 0);
-  int num_to_move = parent->n_len - idx;
-  memmove(&parent->n_keys[idx],
-          &parent->n_keys[idx + 1],
-          (num_to_move) * sizeof(uint64_t));
-  memmove(&parent->n_ch[idx],
-          &parent->n_ch[idx + 1],
-          num_to_move * BT_MAX_VALUE_SIZE);
+uint64_t
+btree_checkpoint_runs(int worker)
+{
+  std::call_once(btflush_once, btflush_start);
+  return btflush_pool->p_written[worker].load();
+}
 
-  parent->n_len -= 1;
-  if (parent->n_len == 0) {
-    path_backtrack(path);
-    btnode_inner_collapse(path);
+static bool
+btree_flush_order(struct buf* a, struct buf* b)
+{
+  return a->bp_lblkno < b->bp_lblkno;
+}
+
+/*
+ * Mark the COUNT dirty nodes of TREE in DS COW. Dead nodes are dropped, the
+ * ones left to write are moved to the front. Returns how many there are.
+ */
+static size_t
+btree_flush_mark(btree_t tree, struct buf** ds, size_t count)
+{
+  size_t live = 0;
+  btnode node;
+
+  /* Nodes evicted since they were dirtied are read back all at once */
+  for (size_t i = 0; i < count; i++) {
+    if (ds[i]->bp_data == NULL) {
+      bread_async(ds[i]->bp_lblkno, ds[i]->bp_size);
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    getblk(ds[i]->bp_lblkno, ds[i]->bp_size, 0);
+    btnode_wrap_bp(&node, tree, ds[i]);
+    btnode_mark_cow(&node);
+
+    /* Node is dead - clean up */
+    if (node.n_len == 0) {
+      bclean(ds[i]);
+      continue;
+    }
+
+    ds[live] = ds[i];
+    live += 1;
   }
+
+  return live;
 }
 
-static int
-btnode_delete(bpath_t path, uint64_t key, void* value)
+diskptr_t
+btree_checkpoint(void* treep)
 {
-  btnode_t node;
-  int idx;
+  btree_t tree = (btree_t)treep;
+  size_t size, end, count;
+  size_t pending = 0;
+  btflushpool* pool;
+  btflushrun run;
+  struct buf** ds;
+  uint64_t epoch;
+  diskptr ptr;
+  bool queue;
+
+  /* Chains are part of the checkpoint, the root has to point at them */
+  btdelta_persist(tree);
+
+  /*
+   * Start the next epoch before draining the queue, anything retired in this
+   * one was cleaned and is off the queue once it is drained.
+   */
+  epoch = tree->tr_epoch.fetch_add(1);
+  ds = get_dirty_set(&tree->tr_bo, &size);
+  ptr = btree_getroot(tree);
+  ptr.epoch = epoch;
+
+#ifdef DEBUG
+  printf("[Checkpoint]\n");
+#endif
+
+  std::call_once(btflush_once, btflush_start);
+  pool = btflush_pool;
+  queue = (btflush_workers() > 0);
+
+  std::sort(ds, ds + size, btree_flush_order);
+
+  for (size_t first = 0; first < size; first = end) {
+    end = std::min(size, first + BT_CHECKPOINT_RUN);
+    count = btree_flush_mark(tree, &ds[first], end - first);
+    run = { &ds[first], count, &pending };
+    if (!queue) {
+      btflush_write(&run);
+      continue;
+    }
+
+    {
+      std::lock_guard<std::mutex> lk(pool->p_lk);
+      pool->p_runs.push_back(run);
+      pending += 1;
+    }
+    pool->p_work.notify_one();
+  }
+
+  /*
+   * Write what the writers have not picked up yet ourselves, then wait for
+   * the rest. Barrier, every node is on disk before the root is handed out.
+   */
+  std::unique_lock<std::mutex> lk(pool->p_lk);
+  while (pending > 0) {
+    if (pool->p_runs.empty()) {
+      pool->p_done.wait(lk);
+      continue;
+    }
 
-  node = btnode_find_child(path, key, LK_EXCLUSIVE);
-  idx = binary_search(node->n_keys, node->n_len, key);
-  if (node->n_keys[idx] != key) {
-    return -1;
+    run = pool->p_runs.front();
+    pool->p_runs.pop_front();
+    lk.unlock();
+    btflush_write(&run);
+    btflush_done(pool, &run);
+    lk.lock();
   }
+  lk.unlock();
 
-  btnode_leaf_delete(node, idx, value);
-  btnode_dirty(node);
+  free(ds);
 
-  /* Delete the node from the parent */
-  if (node->n_len == 0) {
-    btnode_inner_collapse(path);
-  }
+  /* The nodes have to be durable before anything can point at the root */
+  buf_sync();
 
-  return 0;
+  /* This checkpoint is on disk, the blocks only the last one had can go */
+  btree_reclaim(tree);
+
+  return (ptr);
 }
 
-static inline void
-btnode_mark_cow(btnode_t node)
+void
+btree_snapshot_hold(void* treep, diskptr_t root)
 {
-  node->n_hdr.hdr_flags = BT_COW;
+  btree_t tree = (btree_t)treep;
+
+  std::lock_guard<std::mutex> guard(tree->tr_retire_lk);
+  tree->tr_snapshots.insert(root.epoch);
+}
+
+void
+btree_snapshot_release(void* treep, diskptr_t root)
+{
+  btree_t tree = (btree_t)treep;
+
+  std::lock_guard<std::mutex> guard(tree->tr_retire_lk);
+  auto iter = tree->tr_snapshots.find(root.epoch);
+  if (iter != tree->tr_snapshots.end()) {
+    tree->tr_snapshots.erase(iter);
+  }
 }
 
+/*
+ * Copy out every key of leaf NODE and its chain in
+ * [*key_low, key_max) into results, moving key_low past what was copied.
+ * Returns 1 if the query is done, 0 if it continues in the next leaf.
+ * Running off the end of a leaf says nothing about the next one, its
+ * separator in the parent can be above the largest key left in the leaf.
+ */
 static int
-btnode_leaf_bulkinsert(btnode_t node,
-                       kvp* keyvalues,
-                       size_t* len,
-                       int64_t max_key)
+btnode_leaf_range(btnode_t node,
+                  uint64_t* key_low,
+                  uint64_t key_max,
+                  kvp* results,
+                  int* cur_res_idx,
+                  size_t results_max)
 {
-  assert(BT_ISLEAF(node));
-  assert(!BT_ISCOW(node));
-  int keys_i = 0;
-  int node_i = 0;
-  int inserted = 0;
+  btchain chain;
+  btleaf leaf;
+  uint64_t key;
+  bool chained, have;
+  void* value;
+  int idx, next;
+
+  btleaf_open(&leaf, node);
+  chained = btdelta_copy(node, &chain);
+  idx = btleaf_search(&leaf, *key_low);
   for (;;) {
-    if (node->n_len == BT_MAX_KEYS)
-      break;
-    /* No more keys! */
-    if (node_i >= BT_MAX_KEYS)
-      break;
+    have = (idx < leaf.l_len);
+    if (have) {
+      key = btleaf_key(&leaf, idx);
+      value = btleaf_val(&leaf, idx);
+    }
 
-    /* No more keys! */
-    if (*len == 0)
-      break;
+    /* Records win over the leaf */
+    next = chained ? btdelta_next(&chain, *key_low) : -1;
+    if (next >= 0 && (!have || chain.c_deltas[next].d_key <= key)) {
+      key = chain.c_deltas[next].d_key;
+      value = chain.c_deltas[next].d_data;
+      have = true;
+    }
 
-    /* Cannot insert more into this node */
-    if (keyvalues[keys_i].key > max_key)
-      break;
+    if (!have) {
+      return 0;
+    }
 
-    if (keyvalues[keys_i].key == node->n_keys[node_i]) {
-      btnode_leaf_update(node, node_i, &keyvalues[keys_i].data);
-      keys_i += 1;
-      inserted += 1;
-      *len -= 1;
-      continue;
+    if (*cur_res_idx == results_max || key >= key_max) {
+      return 1;
     }
 
-    if (keyvalues[keys_i].key < node->n_keys[node_i]) {
-      btnode_leaf_insert(
-        node, node_i, keyvalues[keys_i].key, &keyvalues[keys_i].data);
-      keys_i += 1;
-      inserted += 1;
-      *len -= 1;
-      continue;
+    /* Found a key */
+    results[*cur_res_idx].key = key;
+    btval_copy(&results[*cur_res_idx].data, value, leaf.l_stride);
+    *cur_res_idx += 1;
+    /*
+     * Update our key low to the current key we just added + 1, so we
+     * can traverse forward
+     */
+    *key_low = key + 1;
+    while (idx < leaf.l_len && btleaf_key(&leaf, idx) < *key_low) {
+      idx += 1;
     }
+  }
+}
 
-    /* Last element */
-    if (node_i == node->n_len) {
-      btnode_leaf_insert(
-        node, node_i, keyvalues[keys_i].key, &keyvalues[keys_i].data);
-      keys_i += 1;
-      inserted += 1;
-      *len -= 1;
+/*
+ * Optimistic range scan, every leaf is validated after its keys are copied
+ * out and the scan steps to the next leaf through the versioned path. Returns
+ * BT_RESTART if writers kept getting in the way, results copied out of
+ * validated leaves are kept.
+ */
+static int
+btree_rangequery_optimistic(btree_t tree,
+                            btepoch_guard* guard,
+                            uint64_t* key_low,
+                            uint64_t key_max,
+                            kvp* results,
+                            int* cur_res_idx,
+                            size_t results_max)
+{
+  btnode_t leaf;
+  bpath path;
+  uint64_t leaf_key_low;
+  int leaf_res_idx, done, error;
+  size_t leaves = 0;
+
+  for (int i = 0; i < BT_OPTIMISTIC_RETRIES;) {
+    leaf = path_find_leaf_versioned(&path, tree, *key_low);
+    if (leaf == NULL) {
+      i += 1;
       continue;
     }
 
-    node_i += 1;
+    for (;;) {
+      leaf_res_idx = *cur_res_idx;
+      leaf_key_low = *key_low;
+      done = btnode_leaf_range(leaf,
+                               key_low,
+                               key_max,
+                               results,
+                               cur_res_idx,
+                               results_max);
+      if (!btnode_validate(leaf, path.p_versions[path.p_cur])) {
+        /* Leaf changed under us, throw away what we copied out of it */
+        *cur_res_idx = leaf_res_idx;
+        *key_low = leaf_key_low;
+        i += 1;
+        break;
+      }
+
+      if (done) {
+        return 0;
+      }
+
+      /* The path is not ours anymore, look the next leaf up again */
+      if (++leaves % BT_REPIN_LEAVES == 0) {
+        guard->repin();
+        break;
+      }
+
+      error = path_next_leaf_versioned(&path);
+      if (error == BT_RESTART) {
+        i += 1;
+        break;
+      }
+
+      if (error) {
+        return 0;
+      }
+
+      leaf = path_getcur(&path);
+    }
   }
 
-  return inserted;
+  return BT_RESTART;
 }
 
+/*
+ * Btree rangequery gives all results such that
+ * low_key <= result < key_max
+ *
+ * The query descends once to the leaf holding key_low and then walks the
+ * leaves in order, stepping through the parents kept on the path.
+ */
 int
-btree_delete(void* treep, uint64_t key, void* value)
+btree_rangequery(void* treep,
+                 uint64_t key_low,
+                 uint64_t key_max,
+                 kvp* results,
+                 size_t results_max)
 {
   btree_t tree = (btree_t)treep;
+  btepoch_guard guard(tree);
 
-  int ret;
   bpath path;
-  path.p_len = 0;
-  path_add(&path, tree, tree->tr_ptr, INDEX_NULL, LK_EXCLUSIVE);
+  btnode_t node;
+  int cur_res_idx = 0;
+  size_t leaves = 0;
 
-  ret = btnode_delete(&path, key, value);
+  if (results_max == 0) {
+    return 0;
+  }
 
-  path_unacquire(&path, LK_EXCLUSIVE);
+#ifdef OPTIMISTIC_READS
+  if (btree_rangequery_optimistic(tree,
+                                  &guard,
+                                  &key_low,
+                                  key_max,
+                                  results,
+                                  &cur_res_idx,
+                                  results_max) != BT_RESTART) {
+    return cur_res_idx;
+  }
+#endif
 
-  return ret;
+  path_add_root(&path, tree, LK_SHARED);
+  node = btnode_find_child(&path, key_low, LK_SHARED, BT_OP_SCAN);
+  while (node != NULL) {
+    if (btnode_leaf_range(node,
+                          &key_low,
+                          key_max,
+                          results,
+                          &cur_res_idx,
+                          results_max)) {
+      path_unacquire(&path, LK_SHARED);
+      break;
+    }
+
+    /* Only locked nodes are in use, the pins can move */
+    if (++leaves % BT_REPIN_LEAVES == 0) {
+      guard.repin();
+    }
+    node = path_next_leaf(&path, LK_SHARED);
+  }
+
+  return cur_res_idx;
 }
 
-#define BULK_DONE (0)
-#define BULK_SPLIT (1)
-#define BULK_CONTINUE (2)
-#define BULK_MAX ((uint64_t)(-1))
+/*
+ * Iterator over a key range handing out keys one leaf at a time. Between
+ * batches it holds no locks and no pins, only the optimistic path to the
+ * leaf the next batch starts in, so a scan costs one descent. The path is
+ * dropped if a checkpoint started a new epoch, which may free its nodes, or
+ * if the cache is bounded and may evict them.
+ */
+#define BT_ITER_BATCH (BT_MAX_KEYS)
 
-int
-btnode_bulkinsert(bpath_t path, kvp** keyvalues, size_t* len, uint64_t max_key)
+typedef struct btree_iter
 {
-  int idx;
-  btnode_t next;
-  kvp* kvs = *keyvalues;
-  int inserted;
+  btree_t it_tree;
+  uint64_t it_key_low;
+  uint64_t it_key_max;
+  bool it_done;
+  /* Epoch the path below was taken in, it is dropped once that one ends */
+  uint64_t it_epoch;
+  /* Path to the leaf holding it_key_low, empty if it has to be looked up */
+  bpath it_path;
+  kvp it_batch[BT_ITER_BATCH];
+} btree_iter;
+
+typedef btree_iter* btree_iter_t;
 
-  btnode_t cur = path_getcur(path);
-  if (*len == 0)
-    return BULK_DONE;
-
-  /* If we are at a leaf the remaining keys can go here */
-  if (BT_ISLEAF(cur)) {
+/*
+ * Fill the batch from the leaf the path is at, stepping over leaves with
+ * nothing left in range. Returns BT_RESTART if writers kept getting in the
+ * way.
+ */
+static int
+btree_iter_fill_optimistic(btree_iter_t it, int* n)
+{
+  bpath_t path = &it->it_path;
+  btnode_t leaf;
+  uint64_t key_low;
+  int retries = 0;
+  int done, error;
+
+  while (retries < BT_OPTIMISTIC_RETRIES) {
+    if (path->p_len == 0 &&
+        path_find_leaf_versioned(path, it->it_tree, it->it_key_low) == NULL) {
+      path->p_len = 0;
+      retries += 1;
+      continue;
+    }
 
-    /* Function will update len for us and tell us by how much
-     * through the returned inserted variable */
-    if (BT_ISCOW(cur)) {
-      path_cow(path);
+    leaf = path_getcur(path);
+    key_low = it->it_key_low;
+    done = btnode_leaf_range(leaf,
+                             &it->it_key_low,
+                             it->it_key_max,
+                             it->it_batch,
+                             n,
+                             BT_ITER_BATCH);
+    if (!btnode_validate(leaf, path->p_versions[path->p_cur])) {
+      *n = 0;
+      it->it_key_low = key_low;
+      path->p_len = 0;
+      retries += 1;
+      continue;
     }
 
-    inserted = btnode_leaf_bulkinsert(cur, kvs, len, max_key);
-    /* Update our pointer to further along the list */
-    *keyvalues = &kvs[inserted];
+    /* A full batch stops short of the end of the range */
+    if (done) {
+      it->it_done = (*n < BT_ITER_BATCH);
+      return 0;
+    }
 
-    if (cur->n_len == BT_MAX_KEYS) {
-      btnode_split(path);
-      return BULK_SPLIT;
+    error = path_next_leaf_versioned(path);
+    if (error == -1) {
+      it->it_done = true;
+      return 0;
     }
 
-    return BULK_CONTINUE;
-  }
+    if (error == BT_RESTART) {
+      path->p_len = 0;
+      retries += 1;
+    }
 
-  next = btnode_go_deeper(path, kvs[0].key, LK_EXCLUSIVE);
-  cur = path_parent(path);
-  /* What is our index */
-  idx = path_getindex(path);
-  /* It is the last child */
-  if (idx != cur->n_len) {
-    /* Change our max key */
-    max_key = path_parent(path)->n_keys[idx];
+    if (*n > 0) {
+      return 0;
+    }
   }
 
-  return btnode_bulkinsert(path, keyvalues, len, max_key);
+  return BT_RESTART;
 }
 
-/* Assume keyvalues list is sorted */
-int
-btree_bulkinsert(void* treep, kvp* keyvalues, size_t len)
+static void
+btree_iter_fill_locked(btree_iter_t it, int* n)
 {
-  btree_t tree = (btree_t)treep;
-
-  int ret;
+  btnode_t node;
   bpath path;
-  path.p_len = 0;
-  kvp* kvs = keyvalues;
 
-  path_add(&path, tree, tree->tr_ptr, INDEX_NULL, LK_EXCLUSIVE);
-  ret = btnode_bulkinsert(&path, &keyvalues, &len, BULK_MAX);
-  while (ret != BULK_DONE) {
-    /* We got some amount of keys done */
-    path_unacquire(&path, LK_EXCLUSIVE);
-    /* Reset our path */
-    path.p_len = 0;
-    path_add(&path, tree, tree->tr_ptr, INDEX_NULL, LK_EXCLUSIVE);
-    ret = btnode_bulkinsert(&path, &keyvalues, &len, BULK_MAX);
+  path_add_root(&path, it->it_tree, LK_SHARED);
+  node = btnode_find_child(&path, it->it_key_low, LK_SHARED, BT_OP_SCAN);
+  while (node != NULL) {
+    if (btnode_leaf_range(node,
+                          &it->it_key_low,
+                          it->it_key_max,
+                          it->it_batch,
+                          n,
+                          BT_ITER_BATCH)) {
+      it->it_done = (*n < BT_ITER_BATCH);
+      break;
+    }
+
+    if (*n > 0) {
+      break;
+    }
+
+    node = path_next_leaf(&path, LK_SHARED);
   }
 
-  path_unacquire(&path, LK_EXCLUSIVE);
+  if (node == NULL) {
+    it->it_done = true;
+  } else {
+    path_unacquire(&path, LK_SHARED);
+  }
 
-  return 0;
+  /* We do not keep locks between batches, look the leaf up next time */
+  it->it_path.p_len = 0;
 }
 
-int
-btree_init(void* tree_ptr, diskptr_t ptr, size_t value_size)
+/* Iterate over keys such that key_low <= key < key_max, NULL on error */
+void*
+btree_iter_open(void* treep, uint64_t key_low, uint64_t key_max)
 {
-  btree_t tree = (btree_t)tree_ptr;
-
-  assert(value_size <= BT_MAX_VALUE_SIZE);
+  btree_iter_t it = (btree_iter_t)malloc(sizeof(btree_iter));
+  if (it == NULL) {
+    return NULL;
+  }
 
-  tree->tr_ptr = ptr;
-  tree->tr_vs = value_size;
+  it->it_tree = (btree_t)treep;
+  it->it_epoch = 0;
+  it->it_path.p_len = 0;
+  btree_iter_seek(it, key_low);
+  it->it_key_max = key_max;
 
-  return 0;
+  return it;
 }
 
+/*
+ * Hand out the next batch of keys in order. BATCH points into the iterator
+ * and is good until the next call. Returns the size of the batch, 0 once the
+ * range is exhausted.
+ */
 int
-btree_insert(void* treep, uint64_t key, void* value)
+btree_iter_next(void* iterp, kvp** batch)
 {
-  btree_t tree = (btree_t)treep;
+  btree_iter_t it = (btree_iter_t)iterp;
+  uint64_t epoch;
+  int n = 0;
 
-  int ret;
-  bpath path;
-  path.p_len = 0;
-#ifdef DEBUG
-  printf("[Insert] %lu\n", key);
-#endif
-
-  path_add(&path, tree, tree->tr_ptr, INDEX_NULL, LK_EXCLUSIVE);
+  *batch = it->it_batch;
+  if (it->it_done || it->it_key_low >= it->it_key_max) {
+    return 0;
+  }
 
-  ret = btnode_insert(&path, key, value);
+  /* Nodes on the path may have been reclaimed or evicted in between */
+  btepoch_guard guard(it->it_tree);
+  epoch = it->it_tree->tr_epoch.load();
+  if (epoch != it->it_epoch || buf_get_capacity() > 0) {
+    it->it_path.p_len = 0;
+    it->it_epoch = epoch;
+  }
 
-  path_unacquire(&path, LK_EXCLUSIVE);
+#ifdef OPTIMISTIC_READS
+  if (btree_iter_fill_optimistic(it, &n) != BT_RESTART) {
+    return n;
+  }
+#endif
 
-  return (ret);
+  btree_iter_fill_locked(it, &n);
+  return n;
 }
 
+/* Continue the iteration from KEY, which may be behind the current position */
 int
-btree_greater_equal(void* treep, uint64_t* key, void* value)
+btree_iter_seek(void* iterp, uint64_t key)
 {
-  btree_t tree = (btree_t)treep;
-  uint64_t possible_key = *key;
-  int error;
-
-  error = btnode_find_ge(tree, &possible_key, value, LK_SHARED);
-  if (error) {
-    return error;
-  }
+  btree_iter_t it = (btree_iter_t)iterp;
 
-  *key = possible_key;
+  it->it_key_low = key;
+  it->it_done = false;
+  it->it_path.p_len = 0;
 
   return 0;
 }
 
-int
-btree_find(void* treep, uint64_t key, void* value)
+void
+btree_iter_close(void* iterp)
 {
-  btree_t tree = (btree_t)treep;
-  uint64_t possible_key = key;
-  int error;
-#ifdef DEBUG
-  printf("[Find] %lu\n", key);
-#endif
-
-  error = btnode_find_ge(tree, &possible_key, value, LK_SHARED);
-  if (error) {
-    return (error);
-  }
-
-  if (possible_key != key) {
-    return (-1);
-  }
-
-  return 0;
+  free(iterp);
 }
 
-diskptr_t
-btree_checkpoint(void* treep)
+static void
+btnode_stats(btree_t tree, diskptr_t ptr, int height, btstats* stats)
 {
-  btree_t tree = (btree_t)treep;
-  size_t size;
-  struct buf** ds = get_dirty_set(&size);
   btnode node;
-  diskptr ptr = tree->tr_ptr;
-
-#ifdef DEBUG
-  printf("[Checkpoint]\n");
-#endif
-
-  for (size_t i = 0; i < size; i++) {
-    /* Wrap our node */
-    btnode_wrap_bp(&node, tree, ds[i]);
 
-    /* Node is dead - clean up */
-    if (node.n_len == 0) {
-      bclean(ds[i]);
+  btnode_init(&node, tree, ptr, LK_SHARED);
+  stats->st_height = std::max(stats->st_height, height);
+  if (BT_ISLEAF(&node)) {
+    stats->st_leaves += 1;
+    stats->st_keys += node.n_len;
+  } else {
+    stats->st_inner += 1;
+    for (int i = 0; i <= node.n_len; i++) {
+      btnode_stats(tree, *(diskptr_t*)&node.n_ch[i], height + 1, stats);
     }
-
-    btnode_mark_cow(&node);
-    bawrite(ds[i]);
   }
-
-  /* TODO: Barrier writes or wait for all buffers to flush on the new root node
-   */
-  free(ds);
-  return (ptr);
+  btnode_unlock(&node, LK_SHARED);
 }
 
-/*
- * Btree rangequery gives all results such that
- * low_key <= result < key_max
- */
-int
-btree_rangequery(void* treep,
-                 uint64_t key_low,
-                 uint64_t key_max,
-                 kvp* results,
-                 size_t results_max)
+/* Walk every node of the tree, meant for trees that are not being written */
+void
+btree_stats(void* treep, btstats* stats)
 {
   btree_t tree = (btree_t)treep;
+  btepoch_guard guard(tree);
 
-  int idx;
-  bpath path;
-  btnode_t node;
-  int cur_res_idx = 0;
-
-  for (;;) {
-
-    /* Start querying */
-    if (cur_res_idx == results_max)
-      return cur_res_idx;
-
-    path.p_len = 0;
-    path_add(&path, tree, tree->tr_ptr, INDEX_NULL, LK_SHARED);
-
-    node = btnode_find_child(&path, key_low, LK_SHARED);
-
-    idx = binary_search(node->n_keys, node->n_len, key_low);
-    /* Did not find the minimum key at all */
-    if (idx == node->n_len) {
-      path_unacquire(&path, LK_SHARED);
-      return cur_res_idx;
-    }
-
-    while (idx < node->n_len) {
-      /* Found a key */
-      if (node->n_keys[idx] >= key_max) {
-        path_unacquire(&path, LK_SHARED);
-        return cur_res_idx;
-      }
-
-      if (node->n_keys[idx] >= key_low) {
-        results[cur_res_idx].key = node->n_keys[idx];
-        memcpy(&results[cur_res_idx].data, &node->n_ch[idx + 1], tree->tr_vs);
-        cur_res_idx += 1;
-        /*
-         * Update our key low to the current key we just added + 1, so we
-         * can traverse forward
-         */
-        key_low = node->n_keys[idx] + 1;
-      }
-
-      idx += 1;
-    }
-
-    path_unacquire(&path, LK_SHARED);
-  }
-
-  return 0;
+  memset(stats, 0, sizeof(*stats));
+  btnode_stats(tree, btree_getroot(tree), 1, stats);
 }
 
 static size_t
@@ -909,11 +3772,17 @@ struct vtreeops btreeops = { .vtree_init = &btree_init,
 
                              .vtree_insert = &btree_insert,
                              .vtree_bulkinsert = &btree_bulkinsert,
+                             .vtree_bulkload = &btree_bulkload,
                              .vtree_delete = &btree_delete,
 
                              .vtree_find = &btree_find,
                              .vtree_ge = &btree_greater_equal,
+                             .vtree_multifind = &btree_multifind,
                              .vtree_rangequery = &btree_rangequery,
+                             .vtree_iter_open = &btree_iter_open,
+                             .vtree_iter_next = &btree_iter_next,
+                             .vtree_iter_seek = &btree_iter_seek,
+                             .vtree_iter_close = &btree_iter_close,
 
                              .vtree_checkpoint = &btree_checkpoint,
                              .vtree_getkeysize = &btree_getkeysize };
@@ -9,18 +9,36 @@
  * The general design is such that it uses the underlying buffer cache to keep
  * track of nodes (meaning no volatile in memory pointers to other children).
  * Each operation keeps a path of nodes access, locking respectively as
- * it traverses the tree.
+ * it traverses the tree. Locks are crabbed, once a node on the path can take
+ * the operation without splitting, collapsing or being COW'd every lock above
+ * it is dropped. Writers first try an optimistic descent holding shared locks
+ * and only lock the leaf exclusively.
  *
  * Having the buffer cache keep track of memory makes the implementation
  * cleaner and easier
  */
 
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
 #include <sys/types.h>
+#include <unordered_map>
+#include <vector>
 
 #include "buf.h"
+#include "search.h"
 #include "vtree.h"
 
+/*
+ * Size of the largest node, and the default. A tree takes the size of its
+ * nodes from the root it is created with (see btree_init), any power of two
+ * from BT_MIN_NODESZ up to BLKSZ. Small nodes copy less on COW, large nodes
+ * make for fewer, larger writes.
+ */
 #define BLKSZ (64 * 1024)
+#define BT_MIN_NODESZ (4 * 1024)
 #define BT_MAX_KEY_SIZE (8)
 #define BT_MAX_HDR_SIZE (64)
 #define BT_MAX_PATH_SIZE (10)
@@ -28,17 +46,82 @@
 #define BT_LEAF (0)
 #define BT_INNER (1)
 
-/* The number of keys is
- * (BLKSZ - BT_MAX_HDR_SIZE - BT_MAX_VALUE_SIZE) /
- *  (BT_MAX_KEY_SIZE + BT_MAX_VALUE_SIZE)
+/*
+ * Inner nodes keep a two level directory (see search.h) in front of their
+ * keys, so the first probes of a descent hit the same few cache lines.
+ */
+#define BT_DIR_SIZE (56)
+#define BT_DIR_BYTES ((DIR_FANOUT + BT_DIR_SIZE) * BT_MAX_KEY_SIZE)
+
+/*
+ * Keys in an inner node of NODESZ bytes, rounded down to split evenly. Inner
+ * nodes hold full keys and BT_MAX_VALUE_SIZE children, one more than keys.
+ */
+constexpr size_t
+bt_inner_keys(size_t nodesz)
+{
+  return ((nodesz - BT_MAX_HDR_SIZE - BT_DIR_BYTES - BT_MAX_VALUE_SIZE) /
+          (BT_MAX_KEY_SIZE + BT_MAX_VALUE_SIZE)) &
+         ~(size_t)1;
+}
+
+/*
+ * Entries in a leaf of NODESZ bytes. Leaves pack keys of WIDTH bytes (see
+ * BT_ENC_WIDE) and values of the size of their tree, VS, over everything past
+ * the header, so small values get more entries.
+ */
+constexpr size_t
+bt_leaf_keys(size_t nodesz, size_t width, size_t vs)
+{
+  /* Leave room to align the values behind the keys */
+  return (nodesz - BT_MAX_HDR_SIZE - sizeof(uint64_t)) / (width + vs);
+}
+
+/* Bounds over every node size, the tree keeps the ones for its own */
+#define BT_MAX_KEYS ((int)bt_inner_keys(BLKSZ))
+#define SPLIT_KEYS (BT_MAX_KEYS / 2)
+
+/* Percent of a node btree_bulkload fills, leaves room for later inserts */
+#define BT_BULKLOAD_FILL (90)
+
+/*
+ * Percent of a node below which deletes borrow keys from a sibling or merge
+ * with it. Has to stay under half so two merged nodes fit in one.
  */
+#define BT_MIN_FILL (25)
+#define BT_MIN_KEYS (BT_MAX_KEYS * BT_MIN_FILL / 100)
 
-#define BT_MAX_KEYS (1636)
-#define SPLIT_KEYS (818)
+#define BT_MAXKEYS(node) ((node)->n_tree->tr_max_keys)
+#define BT_SPLITKEYS(node) ((node)->n_tree->tr_split_keys)
+/* Leaves hold more entries than inner nodes, they underflow at their own */
+#define BT_MINKEYS(node)                                                       \
+  (BT_ISLEAF(node) ? (node)->n_tree->tr_min_leaf_keys                          \
+                   : (node)->n_tree->tr_min_keys)
+#define BT_NODESZ(node) ((node)->n_tree->tr_nodesz)
 
 #define BT_COW (1)
 #define BT_FRESHCOPY (2)
 
+/* Leaf key encodings, full keys or deltas from the leaf's base key */
+#define BT_ENC_WIDE (0)
+#define BT_ENC_D32 (1)
+#define BT_ENC_D16 (2)
+
+/* Tree flags */
+#define BT_TREE_COMPRESS (0x1)
+/*
+ * Inserts into checkpointed leaves are kept as delta records chained to the
+ * leaf instead of copying its path. A chain is folded into a copy of the leaf
+ * once it reaches BT_DELTA_MAX records or anything else has to copy the leaf.
+ * Chains outlive checkpoints, each checkpoint writes all of them to a log its
+ * root points at (hdr_deltas).
+ */
+#define BT_TREE_DELTA (0x2)
+
+#define BT_DELTA_MAX (16)
+/* Chains are kept in shards by the block of their leaf */
+#define BT_DELTA_SHARDS (64)
+
 #define BT_ISLEAF(node) ((node)->n_type == BT_LEAF)
 #define BT_ISINNER(node) ((node)->n_type == BT_INNER)
 #define BT_VALSZ(node) ((node)->n_tree->tr_vs)
@@ -52,6 +135,18 @@ typedef struct btnodehdr
   uint32_t hdr_len;
   uint8_t hdr_type;
   uint8_t hdr_flags;
+  uint8_t hdr_enc;
+  /*
+   * Bumped when a writer locks the node and again when it unlocks it, so it
+   * is odd while the node is being modified. Lets readers validate what they
+   * read without taking the lock.
+   */
+  uint64_t hdr_version;
+  /* Encoded leaves store their keys as deltas from this one */
+  uint64_t hdr_base;
+  /* Only in checkpoint roots, the block and length of their delta log */
+  uint64_t hdr_deltas;
+  uint64_t hdr_ndeltas;
 } btnodehdr;
 
 typedef btnodehdr* btnodehdr_t;
@@ -62,10 +157,20 @@ typedef struct child_cont
   unsigned char vdata[BT_MAX_VALUE_SIZE];
 } ct;
 
-/* Data representing the on disk btree node */
+/*
+ * Data representing the on disk btree node. Only inner nodes use this
+ * layout, leaves lay their keys and values over everything past the header.
+ * It is the layout of a BLKSZ node, smaller nodes keep their children right
+ * behind the tr_max_keys keys they have room for (see n_ch).
+ */
 typedef struct btdata
 {
   btnodehdr bt_hdr;
+
+  /* Only maintained for inner nodes */
+  alignas(64) uint64_t bt_dir_top[DIR_FANOUT];
+  uint64_t bt_dir[BT_DIR_SIZE];
+
   uint64_t bt_keys[BT_MAX_KEYS];
 
   /* Make sure to add one child for inner nodes */
@@ -74,6 +179,84 @@ typedef struct btdata
 
 typedef btdata* btdata_t;
 
+static_assert(sizeof(btdata) <= BLKSZ, "btree node larger than a block");
+static_assert(BT_DIR_SIZE * DIR_STRIDE >= BT_MAX_KEYS &&
+                DIR_FANOUT * DIR_FANOUT * DIR_STRIDE >= BT_MAX_KEYS,
+              "directory does not cover a full node");
+static_assert(2 * BT_MIN_KEYS < BT_MAX_KEYS, "merged nodes do not fit a node");
+static_assert(2 * (bt_inner_keys(BT_MIN_NODESZ) * BT_MIN_FILL / 100) <
+                bt_inner_keys(BT_MIN_NODESZ),
+              "merged nodes do not fit the smallest node");
+static_assert(sizeof(btnodehdr) <= BT_MAX_HDR_SIZE, "btree header too large");
+static_assert(offsetof(btdata, bt_dir_top) == BT_MAX_HDR_SIZE,
+              "leaves are not packed right behind the header");
+static_assert(bt_leaf_keys(BT_MIN_NODESZ, BT_MAX_KEY_SIZE, BT_MAX_VALUE_SIZE) >=
+                bt_inner_keys(BT_MIN_NODESZ),
+              "leaves hold less than inner nodes");
+
+/* Insert or update of a key of a checkpointed leaf */
+typedef struct btdelta
+{
+  uint64_t d_key;
+  unsigned char d_data[BT_MAX_VALUE_SIZE];
+} btdelta;
+
+/* Deltas of one leaf, oldest first */
+typedef struct btchain
+{
+  btdelta c_deltas[BT_DELTA_MAX];
+  int c_len;
+  /* Records for keys the leaf does not hold yet */
+  int c_inserts;
+} btchain;
+
+/* Record of a delta log, see hdr_deltas */
+typedef struct btdeltarec
+{
+  /* Block of the leaf the record is chained to */
+  uint64_t dr_leaf;
+  btdelta dr_delta;
+} btdeltarec;
+
+/* Chains of the leaves whose blocks hash to the shard */
+typedef struct btdeltashard
+{
+  std::shared_mutex s_lk;
+  std::unordered_map<uint64_t, btchain> s_chains;
+  /* Readers skip the lock while the shard is empty */
+  std::atomic<size_t> s_count;
+} btdeltashard;
+
+/*
+ * Every checkpoint starts a new epoch, and nodes carry the epoch they were
+ * allocated in. A node taken out of the tree by a COW or a merge is retired
+ * in the current epoch, and its block is freed once a checkpoint after it is
+ * on disk and no reader or held snapshot from its epoch is left. Readers take
+ * one of BT_EPOCH_SLOTS slots for as long as they can reach nodes.
+ */
+#define BT_EPOCH_SLOTS (64)
+
+/*
+ * Readers share a slot once all are taken, the slot keeps the epoch of the
+ * first one. The count of readers in it sits above BT_SLOT_SHIFT.
+ */
+#define BT_SLOT_SHIFT (48)
+#define BT_SLOT_READER (1ULL << BT_SLOT_SHIFT)
+#define BT_SLOT_EPOCH(word) ((word) & (BT_SLOT_READER - 1))
+
+typedef struct btslot
+{
+  /* Epoch of the readers plus one and their count, zero while free */
+  alignas(64) std::atomic<uint64_t> s_epoch;
+} btslot;
+
+/* Block taken out of the tree in epoch r_epoch */
+typedef struct btretired
+{
+  diskptr_t r_ptr;
+  uint64_t r_epoch;
+} btretired;
+
 struct btree;
 typedef btree* btree_t;
 
@@ -84,29 +267,83 @@ typedef struct btnode
   btdata_t n_data;
   btree_t n_tree;
   diskptr_t n_ptr;
+  /* Children of an inner node, where they start depends on the node size */
+  ct* n_children;
 #define n_id n_bp->bp_lblkno
 #define n_hdr n_data->bt_hdr
 #define n_keys n_data->bt_keys
-#define n_ch n_data->bt_children
+#define n_dir n_data->bt_dir
+#define n_dir_top n_data->bt_dir_top
+#define n_ch n_children
 #define n_len n_data->bt_hdr.hdr_len
 #define n_flags n_data->bt_hdr.hdr_flag
 #define n_type n_data->bt_hdr.hdr_type
+#define n_version n_data->bt_hdr.hdr_version
+#define n_enc n_data->bt_hdr.hdr_enc
+#define n_base n_data->bt_hdr.hdr_base
 } btnode;
 
 typedef btnode* btnode_t;
 
+/* Shape of a tree, see btree_stats */
+typedef struct btstats
+{
+  size_t st_inner;
+  size_t st_leaves;
+  size_t st_keys;
+  int st_height;
+} btstats;
+
 typedef struct btree
 {
   diskptr_t tr_ptr;
   size_t tr_vs;
+  uint32_t tr_flags;
+  /* Node geometry, derived from the size of the root in btree_init */
+  size_t tr_nodesz;
+  int tr_max_keys;
+  int tr_split_keys;
+  int tr_min_keys;
+  int tr_min_leaf_keys;
+  /* Bytes copied to COW nodes, for benchmarks */
+  std::atomic<uint64_t> tr_copied;
+  /* Nodes dirtied since the last checkpoint */
+  struct bufobj tr_bo;
+  /* Delta chains by the block of their leaf, see BT_TREE_DELTA */
+  btdeltashard tr_deltas[BT_DELTA_SHARDS];
+  std::atomic<size_t> tr_nchains;
+  /* Chains changed since the last checkpoint wrote them out */
+  std::atomic<bool> tr_delta_dirty;
+  /* Delta log of the last checkpoint and the records in it */
+  diskptr_t tr_delta_log;
+  uint64_t tr_delta_len;
+  /* Bytes of delta logs written out by checkpoints, for benchmarks */
+  std::atomic<uint64_t> tr_logged;
+  /* Current epoch, see BT_EPOCH_SLOTS */
+  std::atomic<uint64_t> tr_epoch;
+  btslot tr_slots[BT_EPOCH_SLOTS];
+  /* Retired blocks and the epochs of held snapshots */
+  std::mutex tr_retire_lk;
+  std::vector<btretired> tr_retired;
+  std::multiset<uint64_t> tr_snapshots;
+  /* Blocks freed so far, for benchmarks */
+  std::atomic<uint64_t> tr_freed;
+  /*
+   * Sequence count for tr_ptr, odd while the root is being swapped. The root
+   * only changes while its buffer is held exclusively (COW or root split).
+   */
+  std::atomic<uint64_t> tr_seq;
 } btree;
 
+/* PTR is the root, the tree takes the size of its nodes from it */
 int
 btree_init(void* tree, diskptr_t ptr, size_t value_size);
 int
 btree_insert(void* tree, uint64_t key, void* value);
 int
 btree_bulkinsert(void* tree, kvp* keyvalues, size_t len);
+int
+btree_bulkload(void* tree, kvp* keyvalues, size_t len, int fill);
 
 int
 btree_delete(void* tree, uint64_t key, void* value);
@@ -115,6 +352,21 @@ int
 btree_find(void* tree, uint64_t key, void* value);
 int
 btree_greater_equal(void* tree, uint64_t* key, void* value);
+/* Find N keys at once, see vtree_multifind_t */
+int
+btree_multifind(void* tree,
+                uint64_t* keys,
+                size_t n,
+                void* values,
+                int* errors);
+/* Same, with up to DEPTH lookups waiting on reads at once */
+int
+btree_find_async(void* tree,
+                 uint64_t* keys,
+                 size_t n,
+                 void* values,
+                 int* errors,
+                 int depth);
 
 int
 btree_rangequery(void* tree,
@@ -123,8 +375,44 @@ btree_rangequery(void* tree,
                  kvp* results,
                  size_t results_max);
 
+void*
+btree_iter_open(void* tree, uint64_t key_low, uint64_t key_max);
+int
+btree_iter_next(void* iter, kvp** batch);
+int
+btree_iter_seek(void* iter, uint64_t key);
+void
+btree_iter_close(void* iter);
+
+/*
+ * Checkpoints mark their nodes COW in disk order and hand them, in runs, to
+ * writer threads shared by every tree.
+ */
+#define BT_CHECKPOINT_WORKERS (4)
+
+/* Roots handed out by checkpoints carry the epoch of the checkpoint */
 diskptr_t
 btree_checkpoint(void* tree);
+/*
+ * Let COUNT writers take runs, 0 has checkpoints write everything themselves
+ * and -1 picks a count for the backing store, the default
+ */
+void
+btree_checkpoint_workers(int count);
+/* Runs of nodes checkpoint writer WORKER wrote out, for tests */
+uint64_t
+btree_checkpoint_runs(int worker);
+/*
+ * Keep the blocks of the checkpoint ROOT from being freed until it is
+ * released, has to be held before the next checkpoint.
+ */
+void
+btree_snapshot_hold(void* tree, diskptr_t root);
+void
+btree_snapshot_release(void* tree, diskptr_t root);
+
+void
+btree_stats(void* tree, btstats* stats);
 
 extern struct vtreeops btreeops;
 
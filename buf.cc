@@ -1,25 +1,78 @@
 #include "buf.h"
+#include "alloc.h"
+#include "bufpolicy.h"
+#include "dev.h"
 #include "options.h"
 
 #include "pthread.h"
 
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <list>
-#include <set>
+#include <mutex>
+#include <shared_mutex>
+#include <string.h>
+#include <strings.h>
 #include <thread>
 #include <unordered_map>
 
-std::mutex buffer_cache_lk;
-std::unordered_map<uint64_t, struct buf*> buffer_cache;
+#define BUF_SHARD_BITS (6)
+#define BUF_SHARDS (1 << BUF_SHARD_BITS)
+/* Threads that can hold pins at once, see buf_enter */
+#define BUF_SLOTS (64)
 
-std::mutex dirty_lk;
-std::set<struct buf*> dirty_set;
+/*
+ * Buffers by block, split into shards that each have their own lock. Lookups
+ * of buffers that are in the cache only take their shard shared, so readers
+ * on different threads do not serialize on the cache.
+ *
+ * Every shard holds at most its share of the capacity of the cache in memory,
+ * see buf_evict. Evicted blocks are kept on the simulated device of their
+ * shard until the next getblk reads them back, or on the block device if one
+ * is open, see dev.h.
+ */
+struct buf_shard
+{
+  alignas(64) std::shared_mutex bs_lk;
+  std::unordered_map<uint64_t, struct buf*> bs_bufs;
+  /* Buffers with their data in memory, in the state of the policy */
+  void* bs_policy;
+  size_t bs_count;
+  size_t bs_bytes;
+  /* Epoch the last eviction started, see getblk */
+  uint64_t bs_evicted;
+  /* Blocks written out on eviction, without a block device */
+  std::unordered_map<uint64_t, void*> bs_disk;
+  std::atomic<uint64_t> bs_hits;
+  std::atomic<uint64_t> bs_misses;
+  std::atomic<uint64_t> bs_evictions;
+  std::atomic<uint64_t> bs_writebacks;
+};
 
-std::atomic<uint64_t> pblkno;
+static struct buf_shard buffer_cache[BUF_SHARDS];
+static const buf_policy* buf_policy_cur = &BUF_POLICY;
 
-static int acquires = 0;
-static int releases = 0;
+/* Nodes are several blocks apart, mix the bits before picking a shard */
+static struct buf_shard*
+buf_shard_of(uint64_t lblkno)
+{
+  uint64_t hash = lblkno * 0x9E3779B97F4A7C15ULL;
+
+  return &buffer_cache[hash >> (64 - BUF_SHARD_BITS)];
+}
+
+/*
+ * Lock counts for check_locks. Every lock would bump the same two cache
+ * lines from every thread, so they are only kept in DEBUG builds.
+ */
+static std::atomic<int> acquires = 0;
+static std::atomic<int> releases = 0;
+#ifdef DEBUG
+#define BUF_COUNT(counter) ((counter) += 1)
+#else
+#define BUF_COUNT(counter)
+#endif
 
 void
 reset_lock_nums()
@@ -31,25 +84,44 @@ reset_lock_nums()
 void
 free_buffer(struct buf* bp)
 {
-  free(bp->bp_data);
+  dev_buf_free(bp->bp_data, bp->bp_size);
   delete bp;
 }
 
 void
 reset_buf_cache()
 {
-  for (auto it : buffer_cache) {
-    free_buffer(it.second);
+  for (auto& shard : buffer_cache) {
+    for (auto it : shard.bs_bufs) {
+      free_buffer(it.second);
+    }
+    for (auto it : shard.bs_disk) {
+      free(it.second);
+    }
+    if (shard.bs_policy != NULL) {
+      buf_policy_cur->po_destroy(shard.bs_policy);
+      shard.bs_policy = NULL;
+    }
+    shard.bs_bufs.clear();
+    shard.bs_disk.clear();
+    shard.bs_count = 0;
+    shard.bs_bytes = 0;
+    shard.bs_hits = 0;
+    shard.bs_misses = 0;
+    shard.bs_evictions = 0;
+    shard.bs_writebacks = 0;
   }
 
-  buffer_cache.erase(buffer_cache.begin(), buffer_cache.end());
-  pblkno = 0;
+  if (dev_active()) {
+    dev_reset();
+  }
+  alloc_reset();
 }
 
 void
 locks_print()
 {
-  printf("A (%d), R(%d)\n", acquires, releases);
+  printf("A (%d), R(%d)\n", acquires.load(), releases.load());
 }
 
 bool
@@ -104,6 +176,14 @@ public:
     return 1;
   }
 
+  /* Start over empty, holding up to CAPACITY keys */
+  void resize(int capacity)
+  {
+    m_list.clear();
+    m_cache.clear();
+    m_capacity = capacity;
+  }
+
   std::atomic<uint64_t> hits;
   std::atomic<uint64_t> misses;
 
@@ -113,8 +193,124 @@ private:
   std::unordered_map<int, std::list<uint64_t>::iterator> m_cache;
 };
 
+/* The simulated device, the LRU and the reads in flight */
+static std::mutex lru_lk;
 static LRUCache lru;
 
+/* Latency is simulated while set, see buf_set_latency */
+#ifdef DISK_LATENCY
+static std::atomic<bool> latency = true;
+#else
+static std::atomic<bool> latency = false;
+#endif
+
+/* Reads started by bread_async, by block, and when they are done */
+static std::unordered_map<uint64_t, uint64_t> inflight;
+
+static uint64_t
+buf_now()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::high_resolution_clock::now().time_since_epoch())
+    .count();
+}
+
+static uint64_t
+buf_read_ns(size_t size)
+{
+  return ((double)size / THROUGHPUT) * NS;
+}
+
+void
+buf_set_latency(size_t capacity)
+{
+  std::lock_guard<std::mutex> guard(lru_lk);
+  /* Reads and writes of a block device take as long as they take */
+  latency = (capacity > 0) && !dev_active();
+  lru.resize(capacity);
+  inflight.clear();
+}
+
+static uint64_t
+buf_prefetch(uint64_t lblkno, size_t size);
+
+/*
+ * Start reading the block without waiting for it. Returns 0 if it is already
+ * in memory, else when the read is done, see buf_wait. A getblk before then
+ * waits out the rest of it. Reads of the block device are handed back as the
+ * buffer they go into instead.
+ */
+uint64_t
+bread_async(uint64_t lblkno, size_t size)
+{
+  if (dev_active()) {
+    return buf_prefetch(lblkno, size);
+  }
+
+  std::lock_guard<std::mutex> guard(lru_lk);
+  uint64_t ready;
+
+  if (!latency) {
+    return 0;
+  }
+
+  /* Done reads are dropped, the block may be out of the LRU by now */
+  auto iter = inflight.find(lblkno);
+  if (iter != inflight.end()) {
+    if (iter->second > buf_now()) {
+      return iter->second;
+    }
+    inflight.erase(iter);
+  }
+
+  if (!lru.access(lblkno)) {
+    return 0;
+  }
+
+  ready = buf_now() + buf_read_ns(size);
+  inflight.insert({ lblkno, ready });
+  return ready;
+}
+
+/*
+ * Wait until READY, a time bread_async handed out. On the block device wait
+ * for any read to be done, whichever was first is not known.
+ */
+void
+buf_wait(uint64_t ready)
+{
+  uint64_t now;
+
+  if (dev_active()) {
+    dev_poll(true);
+    return;
+  }
+
+  now = buf_now();
+  if (ready > now) {
+    sleep_ns(ready - now);
+  }
+}
+
+bool
+buf_ready(uint64_t ready)
+{
+  struct buf* bp = (struct buf*)ready;
+
+  if (!dev_active()) {
+    return ready <= buf_now();
+  }
+
+  if (ready == 0) {
+    return true;
+  }
+
+  if (bp->bp_filling.load(std::memory_order_acquire)) {
+    dev_poll(false);
+  }
+  return !bp->bp_filling.load(std::memory_order_acquire);
+}
+
 void
 print_buf_stats()
 {
@@ -126,19 +322,468 @@ print_buf_stats()
   printf("Misses: %lu\n", m);
   auto percentage = (int)(((double)h / (double)(h + m)) * 100);
   printf("Percentage: %d\n", percentage);
+
+  struct bufstats stats;
+  buf_stats(&stats);
+  printf("Buffer Cache Stats (%s)\n", buf_policy_cur->po_name);
+  printf("==================\n");
+  printf("Hits: %lu\n", stats.bs_hits);
+  printf("Misses: %lu\n", stats.bs_misses);
+  printf("Evictions: %lu\n", stats.bs_evictions);
+  printf("Writebacks: %lu\n", stats.bs_writebacks);
+  printf("Resident: %lu\n", buf_resident());
+
+  if (!dev_active()) {
+    return;
+  }
+
+  struct devstats dev;
+  dev_stats(&dev);
+  printf("Device Stats\n");
+  printf("============\n");
+  printf("Reads: %lu (%lu bytes, %lu ns avg)\n",
+         dev.ds_reads,
+         dev.ds_read_bytes,
+         dev.ds_reads ? dev.ds_read_ns / dev.ds_reads : 0);
+  printf("Writes: %lu (%lu bytes, %lu ns avg)\n",
+         dev.ds_writes,
+         dev.ds_write_bytes,
+         dev.ds_writes ? dev.ds_write_ns / dev.ds_writes : 0);
+  printf("Syncs: %lu (%lu ns avg)\n",
+         dev.ds_syncs,
+         dev.ds_syncs ? dev.ds_sync_ns / dev.ds_syncs : 0);
+}
+
+void
+buf_stats(struct bufstats* stats)
+{
+  memset(stats, 0, sizeof(*stats));
+  for (auto& shard : buffer_cache) {
+    stats->bs_hits += shard.bs_hits.load(std::memory_order_relaxed);
+    stats->bs_misses += shard.bs_misses.load(std::memory_order_relaxed);
+    stats->bs_evictions += shard.bs_evictions.load(std::memory_order_relaxed);
+    stats->bs_writebacks +=
+      shard.bs_writebacks.load(std::memory_order_relaxed);
+  }
+}
+
+/* Owners outlive reset_buf_cache, start them over with the cache */
+void
+bufobj_init(struct bufobj* bo)
+{
+  std::lock_guard<std::mutex> guard(bo->bo_lk);
+  bo->bo_dirty.clear();
+}
+
+/*
+ * Pins of the buffers threads got from getblk. A buffer is stamped with the
+ * epoch it was last looked up in, and is only evicted once every pin is
+ * newer, so no thread can still use it without holding its lock.
+ */
+typedef struct buf_slot
+{
+  /* Pinned epoch + 1 and the threads sharing it, 0 while the slot is free */
+  alignas(64) std::atomic<uint64_t> s_epoch;
+} buf_slot;
+
+/* Threads share a slot once all are taken, counted above the epoch */
+#define BUF_SLOT_PIN (1ULL << 48)
+#define BUF_SLOT_EPOCH(word) ((word) & (BUF_SLOT_PIN - 1))
+
+static buf_slot buf_slots[BUF_SLOTS];
+static std::atomic<uint64_t> buf_epoch;
+static std::atomic<size_t> buf_capacity = BUF_CAPACITY;
+
+int
+buf_enter()
+{
+  static std::atomic<int> nthreads;
+  thread_local int hint = nthreads.fetch_add(1) % BUF_SLOTS;
+  std::atomic<uint64_t>* slot;
+  uint64_t word, pinned;
+  int i = hint;
+
+  for (int n = 0; n < BUF_SLOTS; n++, i = (i + 1) % BUF_SLOTS) {
+    word = 0;
+    pinned = BUF_SLOT_PIN | (buf_epoch.load() + 1);
+    if (buf_slots[i].s_epoch.compare_exchange_strong(word, pinned)) {
+      return i;
+    }
+  }
+
+  /* Joining an older pin only keeps more buffers in memory */
+  slot = &buf_slots[hint].s_epoch;
+  word = slot->load();
+  do {
+    if (word == 0) {
+      pinned = BUF_SLOT_PIN | (buf_epoch.load() + 1);
+    } else {
+      assert(word < UINT64_MAX - BUF_SLOT_PIN);
+      pinned = word + BUF_SLOT_PIN;
+    }
+  } while (!slot->compare_exchange_weak(word, pinned));
+
+  return hint;
 }
 
+void
+buf_exit(int slot)
+{
+  std::atomic<uint64_t>* word = &buf_slots[slot].s_epoch;
+  uint64_t cur, next;
+
+  cur = word->load();
+  do {
+    next = (cur < 2 * BUF_SLOT_PIN) ? 0 : cur - BUF_SLOT_PIN;
+  } while (!word->compare_exchange_weak(cur, next));
+}
+
+void
+buf_set_capacity(size_t bytes)
+{
+  buf_capacity.store(bytes, std::memory_order_relaxed);
+}
+
+void
+buf_set_policy(const struct buf_policy* policy)
+{
+  for (auto& shard : buffer_cache) {
+    assert(shard.bs_count == 0);
+    if (shard.bs_policy != NULL) {
+      buf_policy_cur->po_destroy(shard.bs_policy);
+      shard.bs_policy = NULL;
+    }
+  }
+
+  buf_policy_cur = policy;
+}
+
+int
+buf_set_device(const char* path, int flags)
+{
+  for (auto& shard : buffer_cache) {
+    for (auto it : shard.bs_bufs) {
+      assert(!it.second->bp_dirty);
+      free_buffer(it.second);
+    }
+    for (auto it : shard.bs_disk) {
+      free(it.second);
+    }
+    if (shard.bs_policy != NULL) {
+      buf_policy_cur->po_destroy(shard.bs_policy);
+      shard.bs_policy = NULL;
+    }
+    shard.bs_bufs.clear();
+    shard.bs_disk.clear();
+    shard.bs_count = 0;
+    shard.bs_bytes = 0;
+  }
+
+  dev_close();
+  buf_set_latency(0);
+  if (path == NULL) {
+    return 0;
+  }
+
+  return dev_open(path, flags);
+}
+
+void
+buf_set_prio(struct buf* bp)
+{
+  if (!bp->bp_prio.load(std::memory_order_relaxed)) {
+    bp->bp_prio.store(true, std::memory_order_relaxed);
+  }
+}
+
+size_t
+buf_get_capacity()
+{
+  return buf_capacity.load(std::memory_order_relaxed);
+}
+
+size_t
+buf_resident()
+{
+  size_t bytes = 0;
+
+  for (auto& shard : buffer_cache) {
+    std::shared_lock<std::shared_mutex> guard(shard.bs_lk);
+    bytes += shard.bs_bytes;
+  }
+
+  return bytes;
+}
+
+/* Oldest epoch a thread may have looked a buffer up in */
+static uint64_t
+buf_min_pinned()
+{
+  uint64_t min = buf_epoch.load();
+  uint64_t epoch;
+
+  for (int i = 0; i < BUF_SLOTS; i++) {
+    epoch = BUF_SLOT_EPOCH(buf_slots[i].s_epoch.load());
+    if (epoch != 0 && epoch - 1 < min) {
+      min = epoch - 1;
+    }
+  }
+
+  return min;
+}
+
+/*
+ * Stamps only move forward, lookups of older pins may race with ours. Only
+ * HITs count as references, the lookup that reads a buffer in does not.
+ */
+static void
+buf_touch(struct buf* bp, uint64_t epoch, bool hit)
+{
+  uint64_t stamp = bp->bp_epoch.load(std::memory_order_relaxed);
+  uint8_t ref = bp->bp_prio.load(std::memory_order_relaxed) ? 2 : 1;
+
+  while (stamp < epoch &&
+         !bp->bp_epoch.compare_exchange_weak(
+           stamp, epoch, std::memory_order_relaxed)) {
+  }
+
+  if (hit && bp->bp_ref.load(std::memory_order_relaxed) < ref) {
+    bp->bp_ref.store(ref, std::memory_order_relaxed);
+  }
+}
+
+/*
+ * Bring the data of BP into memory, from the simulated device if it was
+ * written out. Returns true if it still has to be read from the block device,
+ * see buf_fill.
+ */
+static bool
+buf_load(struct buf_shard* shard, struct buf* bp)
+{
+  /* Keep node layouts cache line aligned, and fit for O_DIRECT */
+  bp->bp_data = dev_buf_alloc(bp->bp_size);
+  if (shard->bs_policy == NULL) {
+    shard->bs_policy = buf_policy_cur->po_create();
+  }
+  buf_policy_cur->po_insert(shard->bs_policy, bp);
+  shard->bs_count += 1;
+  shard->bs_bytes += bp->bp_size;
+
+  if (dev_active()) {
+    return true;
+  }
+
+  auto image = shard->bs_disk.find(bp->bp_lblkno);
+  if (image != shard->bs_disk.end()) {
+    memcpy(bp->bp_data, image->second, bp->bp_size);
+  } else {
+    bzero(bp->bp_data, bp->bp_size);
+  }
+
+  return false;
+}
+
+/*
+ * An evicted buffer may still be on its way to the block device, its lock is
+ * held until buf_writeback is done with it
+ */
+static void
+buf_victim_wait(struct buf* bp)
+{
+  bp->bp_lk.lock_shared();
+  bp->bp_lk.unlock_shared();
+}
+
+/* Read BP in from the block device without holding its shard */
+static void
+buf_fill(struct buf* bp)
+{
+  int error;
+
+  buf_victim_wait(bp);
+  error = dev_read(bp->bp_lblkno, bp->bp_data, bp->bp_size);
+  assert(error == 0);
+  bp->bp_filling.store(false, std::memory_order_release);
+}
+
+/* Reads may be on the ring, keep reaping it until ours is done */
+static void
+buf_fill_wait(struct buf* bp)
+{
+  while (bp->bp_filling.load(std::memory_order_acquire)) {
+    dev_poll(true);
+  }
+}
+
+/* Hand BP back from the policy, its data is about to leave memory */
+static void
+buf_unlink(struct buf_shard* shard, struct buf* bp, bool evicted)
+{
+  buf_policy_cur->po_remove(shard->bs_policy, bp, evicted);
+  shard->bs_count -= 1;
+  shard->bs_bytes -= bp->bp_size;
+}
+
+/*
+ * Write BP to the simulated device, returns how long that takes. The block
+ * device already has every clean buffer, dirty ones go through
+ * buf_writeback.
+ */
+static uint64_t
+buf_store(struct buf_shard* shard, struct buf* bp)
+{
+  if (dev_active()) {
+    return 0;
+  }
+
+  void*& image = shard->bs_disk[bp->bp_lblkno];
+
+  if (image == NULL) {
+    image = malloc(bp->bp_size);
+  }
+  memcpy(image, bp->bp_data, bp->bp_size);
+
+  if (!bp->bp_dirty.load(std::memory_order_acquire)) {
+    return 0;
+  }
+
+  shard->bs_writebacks.fetch_add(1, std::memory_order_relaxed);
+  return latency ? buf_read_ns(bp->bp_size) : 0;
+}
+
+/* Dirty buffer evicted to the block device, see buf_writeback */
+typedef struct buf_victim
+{
+  struct buf* v_bp;
+  uint64_t v_lblkno;
+  void* v_data;
+} buf_victim;
+
+/*
+ * Evict buffers of SHARD, which we hold exclusively, until it is down to
+ * LIMIT bytes. Victims come from the policy, which skips the ones that were
+ * hit lately. Of those we skip buffers that are locked, pinned or still being
+ * read in, and dirty buffers that are off their queue, which their owner is
+ * writing out. Evicted buffers are written to the device, dirty ones bound
+ * for the block device are left in VICTIMS for buf_writeback instead. Queued
+ * buffers leave their struct behind for their owner, getblk reads them back
+ * when it writes them out. Returns how long the writes take.
+ */
+static uint64_t
+buf_evict(struct buf_shard* shard,
+          size_t limit,
+          std::vector<buf_victim>* victims)
+{
+  uint64_t wait = 0;
+  uint64_t min;
+  struct buf* bp;
+  size_t tries;
+
+  shard->bs_evicted = buf_epoch.fetch_add(1) + 1;
+  min = buf_min_pinned();
+  for (tries = 0; shard->bs_bytes > limit && tries < 2 * shard->bs_count;
+       tries++) {
+    bp = buf_policy_cur->po_victim(shard->bs_policy);
+    if (bp == NULL) {
+      break;
+    }
+
+    if (bp->bp_epoch.load(std::memory_order_relaxed) >= min ||
+        bp->bp_filling.load(std::memory_order_acquire) ||
+        !bp->bp_lk.try_lock()) {
+      continue;
+    }
+
+    if (!bp->bp_queued && bp->bp_dirty.load(std::memory_order_acquire)) {
+      bp->bp_lk.unlock();
+      continue;
+    }
+
+    /* Out of the cache now, locked until the device has it */
+    if (dev_active() && bp->bp_dirty.load(std::memory_order_acquire)) {
+      buf_unlink(shard, bp, true);
+      shard->bs_evictions.fetch_add(1, std::memory_order_relaxed);
+      victims->push_back({ bp, bp->bp_lblkno, bp->bp_data });
+      bp->bp_data = NULL;
+      continue;
+    }
+
+    wait += buf_store(shard, bp);
+    buf_unlink(shard, bp, true);
+    shard->bs_evictions.fetch_add(1, std::memory_order_relaxed);
+    dev_buf_free(bp->bp_data, bp->bp_size);
+    bp->bp_data = NULL;
+    bp->bp_lk.unlock();
+
+    if (!bp->bp_queued) {
+      shard->bs_bufs.erase(bp->bp_lblkno);
+      delete bp;
+    }
+  }
+
+  return wait;
+}
+
+/*
+ * Write the VICTIMS of SHARD to the block device. The shard is not held, a
+ * miss on a victim waits for its lock and reads it back once it is written.
+ * Dirty victims are always queued, their structs stay behind for the owner.
+ */
+static void
+buf_writeback(struct buf_shard* shard, std::vector<buf_victim>* victims)
+{
+  std::vector<struct devwrite> writes;
+  int error;
+
+  if (victims->empty()) {
+    return;
+  }
+
+  for (auto& victim : *victims) {
+    writes.push_back(
+      { victim.v_lblkno, victim.v_data, victim.v_bp->bp_size });
+  }
+  error = dev_writev(writes.data(), writes.size());
+  assert(error == 0);
+
+  shard->bs_writebacks.fetch_add(victims->size(), std::memory_order_relaxed);
+  for (auto& victim : *victims) {
+    dev_buf_free(victim.v_data, victim.v_bp->bp_size);
+    victim.v_bp->bp_lk.unlock();
+  }
+}
+
+/*
+ * Drain the dirty queue of BO. Buffers written out since they were queued are
+ * still on it and are dropped here. Dirty buffers may have been evicted since,
+ * getblk reads them back. They stay in memory until written out or cleaned.
+ */
 struct buf**
-get_dirty_set(size_t* size)
+get_dirty_set(struct bufobj* bo, size_t* size)
 {
-  *size = dirty_set.size();
-  struct buf** ds =
-    (struct buf**)malloc(sizeof(struct buf*) * dirty_set.size());
+  std::vector<struct buf*> queue;
+  std::unique_lock<std::mutex> guard(bo->bo_lk);
+  struct buf_shard* shard;
+
+  queue.swap(bo->bo_dirty);
+  guard.unlock();
+
+  struct buf** ds = (struct buf**)malloc(sizeof(struct buf*) * queue.size());
   int i = 0;
-  for (const auto bp : dirty_set) {
-    ds[i] = bp;
-    i += 1;
+  for (const auto bp : queue) {
+    /* Only queued buffers are safe from eviction, look at them in the shard */
+    shard = buf_shard_of(bp->bp_lblkno);
+    std::lock_guard<std::shared_mutex> lock(shard->bs_lk);
+    bp->bp_queued = false;
+    if (bp->bp_dirty.load(std::memory_order_acquire)) {
+      ds[i] = bp;
+      i += 1;
+    } else if (bp->bp_data == NULL) {
+      shard->bs_bufs.erase(bp->bp_lblkno);
+      delete bp;
+    }
   }
+  *size = i;
 
   return ds;
 }
@@ -147,50 +792,192 @@ static struct buf*
 create_buf(uint64_t lblkno, size_t size)
 {
   struct buf* bp = new buf{};
-  bp->bp_data = malloc(size);
-  bzero(bp->bp_data, size);
+  bp->bp_data = NULL;
   bp->bp_lblkno = lblkno;
+  bp->bp_size = size;
 
   return bp;
 }
 
+/*
+ * How long a read of the block still takes on the simulated device, 0 if it
+ * is in memory
+ */
+static uint64_t
+buf_read_wait(uint64_t lblkno, size_t size)
+{
+  std::lock_guard<std::mutex> guard(lru_lk);
+  uint64_t ready, now;
+
+  auto started = inflight.find(lblkno);
+  if (started != inflight.end()) {
+    ready = started->second;
+    inflight.erase(started);
+    now = buf_now();
+    return (ready > now) ? ready - now : 0;
+  }
+
+  return lru.access(lblkno) ? buf_read_ns(size) : 0;
+}
+
+/*
+ * Start reading the block from the block device into its buffer, the thread
+ * waiting on it reaps the read. The buffer is stamped with the current epoch,
+ * a caller that holds a pin can keep looking at it until the read is done.
+ */
+static uint64_t
+buf_prefetch(uint64_t lblkno, size_t size)
+{
+  struct buf_shard* shard = buf_shard_of(lblkno);
+  size_t limit = buf_capacity.load(std::memory_order_relaxed) / BUF_SHARDS;
+  uint64_t epoch = buf_epoch.load();
+  std::vector<buf_victim> victims;
+  struct buf* bp = NULL;
+  bool fill = false;
+
+  {
+    std::shared_lock<std::shared_mutex> guard(shard->bs_lk);
+    auto iter = shard->bs_bufs.find(lblkno);
+    if (iter != shard->bs_bufs.end() && iter->second->bp_data != NULL) {
+      bp = iter->second;
+      buf_touch(bp, epoch, false);
+    }
+  }
+
+  if (bp == NULL) {
+    std::lock_guard<std::shared_mutex> guard(shard->bs_lk);
+    auto iter = shard->bs_bufs.find(lblkno);
+    if (iter == shard->bs_bufs.end()) {
+      bp = create_buf(lblkno, size);
+      shard->bs_bufs.insert({ lblkno, bp });
+    } else {
+      bp = iter->second;
+    }
+
+    if (bp->bp_data == NULL) {
+      fill = buf_load(shard, bp);
+      bp->bp_filling.store(fill, std::memory_order_relaxed);
+      shard->bs_misses.fetch_add(1, std::memory_order_relaxed);
+    }
+    buf_touch(bp, epoch, false);
+
+    if (limit > 0 && shard->bs_bytes > limit) {
+      buf_evict(shard, limit, &victims);
+    }
+  }
+
+  buf_writeback(shard, &victims);
+
+  if (fill) {
+    buf_victim_wait(bp);
+    dev_read_start(lblkno, bp->bp_data, bp->bp_size, &bp->bp_filling);
+  }
+
+  return bp->bp_filling.load(std::memory_order_acquire) ? (uint64_t)bp : 0;
+}
+
 struct buf*
 getblk(uint64_t lblkno, size_t size, int lk_flags)
 {
-  std::lock_guard<std::mutex> guard(buffer_cache_lk);
-  /* Check if we miss on the cache */
-#ifdef DISK_LATENCY
-  if (lru.access(lblkno)) {
-    double sleeptime = ((double)size) / THROUGHPUT;
-    sleeptime = sleeptime * NS;
-    sleep_ns(sleeptime);
+  struct buf_shard* shard = buf_shard_of(lblkno);
+  size_t limit = buf_capacity.load(std::memory_order_relaxed) / BUF_SHARDS;
+  /* Without a bound nothing is evicted, callers are safe without a pin */
+  int slot = (limit > 0) ? buf_enter() : -1;
+  uint64_t epoch = buf_epoch.load();
+  struct buf* bp = NULL;
+  std::vector<buf_victim> victims;
+  uint64_t wait = 0;
+  bool evict = false;
+  bool fill = false;
+
+  /* Reads do not hold any lock of the cache while they take */
+  if (latency.load(std::memory_order_relaxed)) {
+    wait = buf_read_wait(lblkno, size);
+    if (wait > 0) {
+      sleep_ns(wait);
+    }
+  }
+
+  {
+    std::shared_lock<std::shared_mutex> guard(shard->bs_lk);
+    auto iter = shard->bs_bufs.find(lblkno);
+    if (iter != shard->bs_bufs.end() && iter->second->bp_data != NULL) {
+      bp = iter->second;
+      buf_touch(bp, epoch, true);
+      shard->bs_hits.fetch_add(1, std::memory_order_relaxed);
+      /* What was pinned at the last eviction may have been let go since */
+      evict = limit > 0 && shard->bs_bytes > limit &&
+              buf_min_pinned() >= shard->bs_evicted;
+    }
+  }
+
+  /* Another thread may have read it in since we looked */
+  wait = 0;
+  if (bp == NULL || evict) {
+    std::lock_guard<std::shared_mutex> guard(shard->bs_lk);
+    if (bp == NULL) {
+      auto iter = shard->bs_bufs.find(lblkno);
+      if (iter == shard->bs_bufs.end()) {
+        bp = create_buf(lblkno, size);
+        shard->bs_bufs.insert({ lblkno, bp });
+      } else {
+        bp = iter->second;
+      }
+
+      if (bp->bp_data == NULL) {
+        fill = buf_load(shard, bp);
+        bp->bp_filling.store(fill, std::memory_order_relaxed);
+        shard->bs_misses.fetch_add(1, std::memory_order_relaxed);
+        buf_touch(bp, epoch, false);
+      } else {
+        shard->bs_hits.fetch_add(1, std::memory_order_relaxed);
+        buf_touch(bp, epoch, true);
+      }
+    }
+
+    if (limit > 0 && shard->bs_bytes > limit) {
+      wait = buf_evict(shard, limit, &victims);
+    }
+  }
+
+  buf_writeback(shard, &victims);
+
+  if (wait > 0) {
+    sleep_ns(wait);
   }
-#endif
 
-  auto iter = buffer_cache.find(lblkno);
-  if (iter == buffer_cache.end()) {
-    struct buf* bp = create_buf(lblkno, size);
-    buffer_cache.insert({ lblkno, bp });
-    buf_lock(bp, lk_flags);
+  /* Whoever missed reads the block in, everyone else waits for it */
+  if (fill) {
+    buf_fill(bp);
+  } else {
+    buf_fill_wait(bp);
+  }
 
-    return bp;
+  /*
+   * Buffers are never freed while in use, so drop the shard lock before
+   * waiting on the buffer. Holding it would deadlock against a thread that
+   * holds this buffer and needs another one. Our pin keeps it from being
+   * evicted until we hold it.
+   */
+  buf_lock(bp, lk_flags);
+  if (slot >= 0) {
+    buf_exit(slot);
   }
 
-  buf_lock(iter->second, lk_flags);
-  return iter->second;
+  return bp;
 }
 
 void
 buf_lock(struct buf* bp, int flags)
 {
   if (flags == LK_EXCLUSIVE) {
-    acquires += 1;
+    BUF_COUNT(acquires);
     bp->bp_lk.lock();
     return;
   }
 
   if (flags == LK_SHARED) {
-    acquires += 1;
+    BUF_COUNT(acquires);
     bp->bp_lk.lock_shared();
     return;
   }
@@ -200,36 +987,98 @@ void
 buf_unlock(struct buf* bp, int flags)
 {
   if (flags == LK_EXCLUSIVE) {
-    releases += 1;
+    BUF_COUNT(releases);
     bp->bp_lk.unlock();
   }
 
   if (flags == LK_SHARED) {
-    releases += 1;
+    BUF_COUNT(releases);
     bp->bp_lk.unlock_shared();
   }
 }
 
+/* Already dirty buffers are already queued, only the first dirty locks */
 void
-bdirty(struct buf* bp)
+bdirty(struct buf* bp, struct bufobj* bo)
 {
-  std::lock_guard<std::mutex> guard(dirty_lk);
-  dirty_set.insert(bp);
+  if (bp->bp_dirty.load(std::memory_order_relaxed)) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(bo->bo_lk);
+  bp->bp_dirty.store(true, std::memory_order_release);
+  if (!bp->bp_queued) {
+    bp->bp_queued = true;
+    bo->bo_dirty.push_back(bp);
+  }
 }
 
+/*
+ * Write the buffer out, it is on the device once this returns. The buffer
+ * stays queued until its owner drains the queue.
+ */
 void
 bawrite(struct buf* bp)
 {
-  std::lock_guard<std::mutex> guard(dirty_lk);
-  auto it = dirty_set.find(bp);
-  if (it != dirty_set.end())
-    dirty_set.erase(it);
+  int error;
+
+  if (dev_active()) {
+    error = dev_write(bp->bp_lblkno, bp->bp_data, bp->bp_size);
+    assert(error == 0);
+  } else if (latency) {
+    sleep_ns(buf_read_ns(bp->bp_size));
+  }
+  bp->bp_dirty.store(false, std::memory_order_release);
+}
+
+/*
+ * Make every bawrite that returned durable. Writes to the simulated device
+ * already are.
+ */
+void
+buf_sync()
+{
+  int error;
+
+  if (dev_active()) {
+    error = dev_sync();
+    assert(error == 0);
+  }
+}
+
+/*
+ * Write out the N buffers like bawrite, all at once. On the block device they
+ * are submitted together, so it works on all of them in parallel.
+ */
+void
+bawrite_batch(struct buf** bps, size_t n)
+{
+  std::vector<struct devwrite> writes(n);
+  int error;
+
+  if (!dev_active()) {
+    for (size_t i = 0; i < n; i++) {
+      bawrite(bps[i]);
+    }
+    return;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    writes[i] = { bps[i]->bp_lblkno, bps[i]->bp_data, bps[i]->bp_size };
+  }
+  error = dev_writev(writes.data(), n);
+  assert(error == 0);
+
+  for (size_t i = 0; i < n; i++) {
+    bps[i]->bp_dirty.store(false, std::memory_order_release);
+  }
 }
 
+/* Drop the changes of a buffer that is never going to be written */
 void
 bclean(struct buf* bp)
 {
-  bawrite(bp);
+  bp->bp_dirty.store(false, std::memory_order_release);
 }
 
 diskptr_t
@@ -238,8 +1087,70 @@ allocate_blk(size_t size)
   diskptr_t ptr;
   size = ((size + (PBLKSZ - 1)) / PBLKSZ);
   ptr.size = size;
-  auto off = pblkno.fetch_add(size);
-  ptr.offset = off;
+  ptr.offset = alloc_blocks(size, ALLOC_NOHINT);
+  ptr.epoch = 0;
+  return ptr;
+}
+
+/* Place the block right behind NEAR if there is room, for sequential scans */
+diskptr_t
+allocate_blk_near(size_t size, diskptr_t near)
+{
+  diskptr_t ptr;
+  size = ((size + (PBLKSZ - 1)) / PBLKSZ);
+  ptr.size = size;
+  ptr.offset = alloc_blocks(size, near.offset + near.size);
   ptr.epoch = 0;
   return ptr;
 }
+
+/*
+ * Give the block back and drop its buffer. Nobody may hold the buffer or be
+ * able to reach it anymore, and it has to be off the dirty queue of its owner.
+ */
+void
+free_blk(diskptr_t ptr)
+{
+  struct buf* bp = NULL;
+
+  {
+    struct buf_shard* shard = buf_shard_of(ptr.offset);
+    std::lock_guard<std::shared_mutex> guard(shard->bs_lk);
+    auto iter = shard->bs_bufs.find(ptr.offset);
+    if (iter != shard->bs_bufs.end()) {
+      bp = iter->second;
+      /* Unless a prefetch of it is still going */
+      buf_fill_wait(bp);
+      if (bp->bp_data != NULL) {
+        buf_unlink(shard, bp, false);
+      }
+      shard->bs_bufs.erase(iter);
+    }
+
+    auto image = shard->bs_disk.find(ptr.offset);
+    if (image != shard->bs_disk.end()) {
+      free(image->second);
+      shard->bs_disk.erase(image);
+    }
+  }
+
+  if (bp != NULL) {
+    free_buffer(bp);
+  }
+
+  if (dev_active()) {
+    dev_trim(ptr.offset, ptr.size * PBLKSZ);
+  }
+  alloc_free(ptr.offset, ptr.size);
+}
+
+void
+buf_usage(size_t* nbufs, uint64_t* nblks)
+{
+  *nbufs = 0;
+  for (auto& shard : buffer_cache) {
+    std::shared_lock<std::shared_mutex> guard(shard.bs_lk);
+    *nbufs += shard.bs_bufs.size();
+  }
+  *nblks = alloc_size();
+}
@@ -7,8 +7,11 @@
  * as to be able to test tree data structures that use its API in the kernel
  * but in userspace
  */
+#include <atomic>
+#include <mutex>
 #include <shared_mutex>
 #include <sys/types.h>
+#include <vector>
 
 #define DPTR_COW (0x1)
 #define DPTR_RDX_LEAF (0x2)
@@ -20,6 +23,8 @@
 
 const uint64_t PBLKSZ = 4 * 1024;
 
+struct buf_policy;
+
 /* On disk pointer */
 typedef struct diskptr
 {
@@ -29,12 +34,38 @@ typedef struct diskptr
   uint16_t flags;
 } diskptr_t;
 
+/*
+ * Owner of a set of buffers, like the bufobj of a vnode. Every owner queues
+ * its own dirty buffers, so syncing one never looks at those of another.
+ */
+struct bufobj
+{
+  std::mutex bo_lk;
+  std::vector<struct buf*> bo_dirty;
+};
+
 /* Main buf struct */
 struct buf
 {
   void* bp_data;
   size_t bp_lblkno;
+  size_t bp_size;
   std::shared_mutex bp_lk;
+  /* Dirtied since it was last written out */
+  std::atomic<bool> bp_dirty;
+  /* On the dirty queue of its owner, set under its bo_lk */
+  std::atomic<bool> bp_queued;
+  /* Last epoch it was looked up in */
+  std::atomic<uint64_t> bp_epoch;
+  /* Hits the replacement policy has not seen yet, see bufpolicy.h */
+  std::atomic<uint8_t> bp_ref;
+  std::atomic<bool> bp_prio;
+  /* Being read in from the block device, see getblk */
+  std::atomic<bool> bp_filling;
+  /* Place with the replacement policy of its shard */
+  struct buf* bp_next;
+  struct buf* bp_prev;
+  uint8_t bp_queue;
 };
 
 struct buf*
@@ -44,13 +75,93 @@ buf_lock(struct buf* bp, int flags);
 void
 buf_unlock(struct buf* bp, int flags);
 void
-bdirty(struct buf* bp);
+bdirty(struct buf* bp, struct bufobj* bo);
 void
 bawrite(struct buf* bp);
 void
+bawrite_batch(struct buf** bps, size_t n);
+void
 bclean(struct buf* bp);
+/* Everything bawrite wrote so far survives a crash once this returns */
+void
+buf_sync();
 struct buf**
-get_dirty_set(size_t* size);
+get_dirty_set(struct bufobj* bo, size_t* size);
+void
+bufobj_init(struct bufobj* bo);
+
+/*
+ * Reads a thread starts without waiting on them, so it can keep several in
+ * flight. Returns a handle of the read, 0 if the block is already in memory.
+ * Simulated reads hand out when they are done in ns, buf_wait on the earliest
+ * of several waits for the first of them. On the block device buf_wait
+ * returns once any read is done.
+ */
+uint64_t
+bread_async(uint64_t lblkno, size_t size);
+void
+buf_wait(uint64_t ready);
+bool
+buf_ready(uint64_t ready);
+
+/*
+ * Simulate device latency for blocks that are not among the CAPACITY most
+ * recently used ones, 0 turns it off. DISK_LATENCY turns it on from the start
+ * with LRU_CAPACITY.
+ */
+void
+buf_set_latency(size_t capacity);
+
+/*
+ * Buffers a thread got from getblk stay in memory while it holds their lock,
+ * or until it drops the pin it took before looking them up. Pins are slots,
+ * any thread can drop one.
+ */
+int
+buf_enter();
+void
+buf_exit(int slot);
+
+/*
+ * Bytes of buffers kept in memory, 0 for no bound. Starts out as
+ * BUF_CAPACITY, only change it while no thread is in getblk.
+ */
+void
+buf_set_capacity(size_t bytes);
+size_t
+buf_get_capacity();
+size_t
+buf_resident();
+
+/*
+ * Replacement policy of the cache, BUF_POLICY to start with. Only change it
+ * on an empty cache, right after reset_buf_cache.
+ */
+void
+buf_set_policy(const struct buf_policy* policy);
+/*
+ * Keep blocks on the block device at PATH, opened with the DEV_ flags of
+ * dev.h, or in memory again with NULL. Buffers in memory are dropped and
+ * have to be written out first, trees are opened again from their last
+ * checkpoint. Returns -1 if the device cannot be opened.
+ */
+int
+buf_set_device(const char* path, int flags);
+/* Hint that BP is worth more than other buffers, like an inner node */
+void
+buf_set_prio(struct buf* bp);
+
+struct bufstats
+{
+  uint64_t bs_hits;
+  uint64_t bs_misses;
+  uint64_t bs_evictions;
+  uint64_t bs_writebacks;
+};
+
+/* Counters since the last reset_buf_cache */
+void
+buf_stats(struct bufstats* stats);
 
 void
 reset_buf_cache();
@@ -61,8 +172,16 @@ check_locks();
 void
 locks_print();
 
+/* Blocks come from the extent allocator, see alloc.h */
 diskptr_t
 allocate_blk(size_t size);
+diskptr_t
+allocate_blk_near(size_t size, diskptr_t near);
+void
+free_blk(diskptr_t ptr);
+/* Buffers in the cache and blocks of the device, for benchmarks */
+void
+buf_usage(size_t* nbufs, uint64_t* nblks);
 
 void
 print_buf_stats();
@@ -0,0 +1,227 @@
+#include "bufpolicy.h"
+
+#include <list>
+#include <unordered_map>
+
+/* Lists a buffer can be on */
+#define BUF_Q_NONE (0)
+#define BUF_Q_CLOCK (1)
+#define BUF_Q_IN (2)
+
+/* Circular list of buffers through bp_next, the head is the oldest one */
+typedef struct buf_list
+{
+  struct buf* l_head;
+  size_t l_count;
+} buf_list;
+
+static void
+list_push(buf_list* list, struct buf* bp, uint8_t queue)
+{
+  struct buf* head = list->l_head;
+
+  if (head == NULL) {
+    bp->bp_next = bp;
+    bp->bp_prev = bp;
+    list->l_head = bp;
+  } else {
+    bp->bp_next = head;
+    bp->bp_prev = head->bp_prev;
+    head->bp_prev->bp_next = bp;
+    head->bp_prev = bp;
+  }
+
+  bp->bp_queue = queue;
+  list->l_count += 1;
+}
+
+static void
+list_remove(buf_list* list, struct buf* bp)
+{
+  if (bp->bp_next == bp) {
+    list->l_head = NULL;
+  } else {
+    bp->bp_prev->bp_next = bp->bp_next;
+    bp->bp_next->bp_prev = bp->bp_prev;
+    if (list->l_head == bp) {
+      list->l_head = bp->bp_next;
+    }
+  }
+
+  bp->bp_queue = BUF_Q_NONE;
+  list->l_count -= 1;
+}
+
+/*
+ * One step of the hand of a CLOCK, returns the buffer under it if it was not
+ * hit since the hand last passed it, NULL otherwise.
+ */
+static struct buf*
+list_tick(buf_list* list)
+{
+  struct buf* bp = list->l_head;
+  uint8_t ref = bp->bp_ref.load(std::memory_order_relaxed);
+
+  list->l_head = bp->bp_next;
+  if (ref == 0) {
+    return bp;
+  }
+
+  /* Hits racing with us may raise it again, which only costs them a pass */
+  bp->bp_ref.store(ref - 1, std::memory_order_relaxed);
+  return NULL;
+}
+
+/* Every hit can keep a buffer for up to two passes, give up after that */
+static struct buf*
+list_sweep(buf_list* list)
+{
+  struct buf* bp;
+
+  for (size_t i = 0; list->l_head != NULL && i <= 2 * list->l_count; i++) {
+    bp = list_tick(list);
+    if (bp != NULL) {
+      return bp;
+    }
+  }
+
+  return list->l_head;
+}
+
+static void*
+clock_create()
+{
+  return new buf_list{};
+}
+
+static void
+clock_destroy(void* state)
+{
+  delete (buf_list*)state;
+}
+
+/* New buffers get one pass of the hand */
+static void
+clock_insert(void* state, struct buf* bp)
+{
+  bp->bp_ref.store(1, std::memory_order_relaxed);
+  list_push((buf_list*)state, bp, BUF_Q_CLOCK);
+}
+
+static void
+clock_remove(void* state, struct buf* bp, bool evicted)
+{
+  list_remove((buf_list*)state, bp);
+}
+
+static struct buf*
+clock_victim(void* state)
+{
+  return list_sweep((buf_list*)state);
+}
+
+const buf_policy buf_clock = {
+  "CLOCK", clock_create, clock_destroy, clock_insert, clock_remove, clock_victim,
+};
+
+/* Share of the buffers probation holds before it gives up victims */
+#define BUF_2Q_IN (4)
+/* Evicted probation buffers remembered, as a share of the buffers */
+#define BUF_2Q_OUT (2)
+
+typedef struct buf_2qstate
+{
+  buf_list q_in;
+  buf_list q_main;
+  /* Blocks evicted from probation, oldest first */
+  std::list<uint64_t> q_out;
+  std::unordered_map<uint64_t, std::list<uint64_t>::iterator> q_outmap;
+} buf_2qstate;
+
+static void*
+twoq_create()
+{
+  return new buf_2qstate{};
+}
+
+static void
+twoq_destroy(void* state)
+{
+  delete (buf_2qstate*)state;
+}
+
+/* Buffers evicted from probation not long ago were not part of a scan */
+static void
+twoq_insert(void* state, struct buf* bp)
+{
+  buf_2qstate* q = (buf_2qstate*)state;
+
+  bp->bp_ref.store(0, std::memory_order_relaxed);
+  auto out = q->q_outmap.find(bp->bp_lblkno);
+  if (out != q->q_outmap.end()) {
+    q->q_out.erase(out->second);
+    q->q_outmap.erase(out);
+    list_push(&q->q_main, bp, BUF_Q_CLOCK);
+    return;
+  }
+
+  list_push(&q->q_in, bp, BUF_Q_IN);
+}
+
+static void
+twoq_remove(void* state, struct buf* bp, bool evicted)
+{
+  buf_2qstate* q = (buf_2qstate*)state;
+  size_t limit;
+
+  if (bp->bp_queue == BUF_Q_CLOCK) {
+    list_remove(&q->q_main, bp);
+    return;
+  }
+
+  list_remove(&q->q_in, bp);
+  if (!evicted) {
+    return;
+  }
+
+  q->q_out.push_back(bp->bp_lblkno);
+  q->q_outmap[bp->bp_lblkno] = std::prev(q->q_out.end());
+  limit = (q->q_in.l_count + q->q_main.l_count) / BUF_2Q_OUT + 1;
+  while (q->q_out.size() > limit) {
+    q->q_outmap.erase(q->q_out.front());
+    q->q_out.pop_front();
+  }
+}
+
+/*
+ * Probation gives up its oldest buffer once it holds more than its share,
+ * unless that buffer was hit or marked since it came in, then it moves on to
+ * the main CLOCK.
+ */
+static struct buf*
+twoq_victim(void* state)
+{
+  buf_2qstate* q = (buf_2qstate*)state;
+  size_t total = q->q_in.l_count + q->q_main.l_count;
+  struct buf* bp;
+
+  while (q->q_in.l_count > 0 &&
+         (q->q_in.l_count > total / BUF_2Q_IN || q->q_main.l_count == 0)) {
+    bp = q->q_in.l_head;
+    if (bp->bp_ref.load(std::memory_order_relaxed) == 0 &&
+        !bp->bp_prio.load(std::memory_order_relaxed)) {
+      q->q_in.l_head = bp->bp_next;
+      return bp;
+    }
+
+    list_remove(&q->q_in, bp);
+    bp->bp_ref.store(0, std::memory_order_relaxed);
+    list_push(&q->q_main, bp, BUF_Q_CLOCK);
+  }
+
+  return list_sweep(&q->q_main);
+}
+
+const buf_policy buf_2q = {
+  "2Q", twoq_create, twoq_destroy, twoq_insert, twoq_remove, twoq_victim,
+};
@@ -0,0 +1,43 @@
+#ifndef _BUFPOLICY_H_
+#define _BUFPOLICY_H_
+/*
+ * Replacement policies of the buffer cache
+ *
+ * Every shard of the cache keeps the buffers it has in memory in the state of
+ * a policy, and asks it for victims once it is over its share of the
+ * capacity. Calls hold the shard exclusively. A hit only raises bp_ref of its
+ * buffer, which readers do under the shared lock, so policies look at
+ * references when they pick victims, the way CLOCK does, and a hit never
+ * moves a buffer between lists.
+ *
+ * Hits on buffers marked with buf_set_prio, like inner nodes of trees, count
+ * twice.
+ */
+#include "buf.h"
+
+typedef struct buf_policy
+{
+  const char* po_name;
+  void* (*po_create)();
+  void (*po_destroy)(void* state);
+  /* BP was read into memory */
+  void (*po_insert)(void* state, struct buf* bp);
+  /* BP leaves memory, EVICTED if it was picked by po_victim */
+  void (*po_remove)(void* state, struct buf* bp, bool evicted);
+  /*
+   * Next buffer to evict, NULL if there are none. A victim that cannot go yet
+   * stays with the policy, the next call moves on to another one.
+   */
+  struct buf* (*po_victim)(void* state);
+} buf_policy;
+
+/* Second chance over every buffer in memory */
+extern const buf_policy buf_clock;
+/*
+ * 2Q, buffers start on a probation FIFO and only move on to the main CLOCK
+ * when they are hit again, or were evicted from probation a short while ago.
+ * Scans go through probation without pushing out the main CLOCK.
+ */
+extern const buf_policy buf_2q;
+
+#endif
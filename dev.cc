@@ -0,0 +1,685 @@
+#include "dev.h"
+#include "buf.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <memory>
+#include <mutex>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+/* Zeros written at once where the device cannot drop blocks */
+#define DEV_ZEROSZ (64 * 1024)
+
+static int dev_fd = -1;
+static bool dev_blk;
+/* Bytes up to the end of the last block written, the rest reads as zeros */
+static std::atomic<uint64_t> dev_end;
+
+static std::atomic<uint64_t> dev_reads;
+static std::atomic<uint64_t> dev_writes;
+static std::atomic<uint64_t> dev_read_bytes;
+static std::atomic<uint64_t> dev_write_bytes;
+static std::atomic<uint64_t> dev_syncs;
+static std::atomic<uint64_t> dev_read_ns;
+static std::atomic<uint64_t> dev_write_ns;
+static std::atomic<uint64_t> dev_sync_ns;
+
+static uint64_t
+dev_now()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch())
+    .count();
+}
+
+/* An I/O submitted to the ring, the user data of its entries */
+typedef struct dev_op
+{
+  bool op_write;
+  void* op_data;
+  size_t op_size;
+  uint64_t op_start;
+  std::atomic<bool>* op_busy;
+  std::atomic<int>* op_error;
+} dev_op;
+
+/* The queues of an io_uring as mapped from the kernel */
+typedef struct dev_ring
+{
+  int r_fd;
+  unsigned r_entries;
+  unsigned* r_sq_head;
+  unsigned* r_sq_tail;
+  unsigned* r_sq_mask;
+  unsigned* r_sq_array;
+  struct io_uring_sqe* r_sqes;
+  unsigned* r_cq_head;
+  unsigned* r_cq_tail;
+  unsigned* r_cq_mask;
+  struct io_uring_cqe* r_cqes;
+  void* r_sq_ptr;
+  size_t r_sq_len;
+  void* r_cq_ptr;
+  size_t r_cq_len;
+  size_t r_sqes_len;
+  /* Queued but not submitted yet, and submitted but not reaped yet */
+  unsigned r_pending;
+  unsigned r_inflight;
+} dev_ring;
+
+static std::mutex dev_ring_lk;
+static dev_ring ring = { -1 };
+
+/* Registered buffers, carved out by size and never given back to the OS */
+static std::mutex dev_arena_lk;
+static char* dev_arena;
+static size_t dev_arena_used;
+static std::unordered_map<size_t, std::vector<void*>> dev_arena_free;
+
+static int
+ring_setup(unsigned entries, struct io_uring_params* params)
+{
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+ring_enter(unsigned submit, unsigned wait)
+{
+  return syscall(__NR_io_uring_enter,
+                 ring.r_fd,
+                 submit,
+                 wait,
+                 (wait > 0) ? IORING_ENTER_GETEVENTS : 0,
+                 NULL,
+                 0);
+}
+
+static bool
+ring_fixed(const void* data, size_t size)
+{
+  return dev_arena != NULL && (const char*)data >= dev_arena &&
+         (const char*)data + size <= dev_arena + DEV_FIXED;
+}
+
+/* Returns -1 if the kernel has no io_uring for us */
+static int
+ring_open()
+{
+  struct io_uring_params params;
+  struct iovec arena;
+  char* sq;
+  char* cq;
+
+  memset(&params, 0, sizeof(params));
+  ring.r_fd = ring_setup(DEV_RING, &params);
+  if (ring.r_fd < 0) {
+    return -1;
+  }
+
+  ring.r_entries = params.sq_entries;
+  ring.r_sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring.r_cq_len =
+    params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring.r_sq_len = std::max(ring.r_sq_len, ring.r_cq_len);
+    ring.r_cq_len = ring.r_sq_len;
+  }
+  ring.r_sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring.r_sq_ptr = mmap(NULL,
+                       ring.r_sq_len,
+                       PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE,
+                       ring.r_fd,
+                       IORING_OFF_SQ_RING);
+  ring.r_cq_ptr = ring.r_sq_ptr;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) &&
+      ring.r_sq_ptr != MAP_FAILED) {
+    ring.r_cq_ptr = mmap(NULL,
+                         ring.r_cq_len,
+                         PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE,
+                         ring.r_fd,
+                         IORING_OFF_CQ_RING);
+  }
+  ring.r_sqes = (struct io_uring_sqe*)mmap(NULL,
+                                           ring.r_sqes_len,
+                                           PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE,
+                                           ring.r_fd,
+                                           IORING_OFF_SQES);
+  if (ring.r_sq_ptr == MAP_FAILED || ring.r_cq_ptr == MAP_FAILED ||
+      ring.r_sqes == MAP_FAILED) {
+    close(ring.r_fd);
+    ring.r_fd = -1;
+    return -1;
+  }
+
+  sq = (char*)ring.r_sq_ptr;
+  ring.r_sq_head = (unsigned*)(sq + params.sq_off.head);
+  ring.r_sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  ring.r_sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+  ring.r_sq_array = (unsigned*)(sq + params.sq_off.array);
+  cq = (char*)ring.r_cq_ptr;
+  ring.r_cq_head = (unsigned*)(cq + params.cq_off.head);
+  ring.r_cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  ring.r_cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+  ring.r_cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  ring.r_pending = 0;
+  ring.r_inflight = 0;
+
+  /* Without the arena buffers are pinned on every I/O, which still works */
+  dev_arena = (char*)mmap(NULL,
+                          DEV_FIXED,
+                          PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                          -1,
+                          0);
+  if (dev_arena == MAP_FAILED) {
+    dev_arena = NULL;
+    return 0;
+  }
+
+  arena.iov_base = dev_arena;
+  arena.iov_len = DEV_FIXED;
+  if (syscall(__NR_io_uring_register,
+              ring.r_fd,
+              IORING_REGISTER_BUFFERS,
+              &arena,
+              1) < 0) {
+    munmap(dev_arena, DEV_FIXED);
+    dev_arena = NULL;
+  }
+  dev_arena_used = 0;
+
+  return 0;
+}
+
+/* Complete every entry of the completion queue, under the ring lock */
+static void
+ring_reap()
+{
+  unsigned head = *ring.r_cq_head;
+  unsigned tail = __atomic_load_n(ring.r_cq_tail, __ATOMIC_ACQUIRE);
+  struct io_uring_cqe* cqe;
+  dev_op* op;
+
+  for (; head != tail; head++) {
+    cqe = &ring.r_cqes[head & *ring.r_cq_mask];
+    op = (dev_op*)cqe->user_data;
+    if (op->op_write) {
+      if (cqe->res != (int)op->op_size) {
+        op->op_error->store(-1, std::memory_order_relaxed);
+      }
+      dev_writes.fetch_add(1, std::memory_order_relaxed);
+      dev_write_bytes.fetch_add(op->op_size, std::memory_order_relaxed);
+      dev_write_ns.fetch_add(dev_now() - op->op_start,
+                             std::memory_order_relaxed);
+    } else {
+      assert(cqe->res >= 0);
+      /* Short files end in zeros */
+      if ((size_t)cqe->res < op->op_size) {
+        bzero((char*)op->op_data + cqe->res, op->op_size - cqe->res);
+      }
+      dev_reads.fetch_add(1, std::memory_order_relaxed);
+      dev_read_bytes.fetch_add(op->op_size, std::memory_order_relaxed);
+      dev_read_ns.fetch_add(dev_now() - op->op_start,
+                            std::memory_order_relaxed);
+    }
+
+    op->op_busy->store(false, std::memory_order_release);
+    ring.r_inflight -= 1;
+    delete op;
+  }
+
+  __atomic_store_n(ring.r_cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Submit what is queued and wait for up to WAIT completions */
+static void
+ring_submit(unsigned wait)
+{
+  int n;
+
+  wait = std::min(wait, ring.r_pending + ring.r_inflight);
+  if (ring.r_pending == 0 && wait == 0) {
+    ring_reap();
+    return;
+  }
+
+  n = ring_enter(ring.r_pending, wait);
+  assert(n >= 0 || errno == EINTR);
+  if (n > 0) {
+    ring.r_pending -= n;
+    ring.r_inflight += n;
+  }
+  ring_reap();
+}
+
+/*
+ * Queue OP on the ring, under the ring lock. Never more than the submission
+ * queue holds are in flight, so the completion queue, twice as large, never
+ * overflows.
+ */
+static void
+ring_queue(dev_op* op, uint64_t off)
+{
+  struct io_uring_sqe* sqe;
+  unsigned tail, idx;
+  bool fixed = ring_fixed(op->op_data, op->op_size);
+
+  while (ring.r_pending + ring.r_inflight >= ring.r_entries) {
+    ring_submit(1);
+  }
+
+  tail = *ring.r_sq_tail;
+  idx = tail & *ring.r_sq_mask;
+  sqe = &ring.r_sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  if (op->op_write) {
+    sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+  } else {
+    sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  }
+  sqe->fd = dev_fd;
+  sqe->addr = (uint64_t)op->op_data;
+  sqe->len = op->op_size;
+  sqe->off = off;
+  sqe->buf_index = 0;
+  sqe->user_data = (uint64_t)op;
+  ring.r_sq_array[idx] = idx;
+  __atomic_store_n(ring.r_sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring.r_pending += 1;
+  op->op_start = dev_now();
+}
+
+static void
+ring_close()
+{
+  if (ring.r_fd < 0) {
+    return;
+  }
+
+  while (ring.r_pending + ring.r_inflight > 0) {
+    ring_submit(1);
+  }
+
+  if (dev_arena != NULL) {
+    munmap(dev_arena, DEV_FIXED);
+    dev_arena = NULL;
+    dev_arena_free.clear();
+  }
+  munmap(ring.r_sqes, ring.r_sqes_len);
+  if (ring.r_cq_ptr != ring.r_sq_ptr) {
+    munmap(ring.r_cq_ptr, ring.r_cq_len);
+  }
+  munmap(ring.r_sq_ptr, ring.r_sq_len);
+  close(ring.r_fd);
+  ring.r_fd = -1;
+}
+
+int
+dev_open(const char* path, int flags)
+{
+  int oflags = O_RDWR | O_CREAT;
+  struct stat st;
+  uint64_t size;
+  int fd;
+
+  if (flags & DEV_DIRECT) {
+    oflags |= O_DIRECT;
+  }
+
+  fd = open(path, oflags, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &size) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  dev_close();
+  dev_fd = fd;
+  dev_blk = S_ISBLK(st.st_mode);
+  if (!(flags & DEV_SYNC)) {
+    ring_open();
+  }
+  if (!dev_blk) {
+    size = st.st_size;
+  }
+  dev_end = (size + PBLKSZ - 1) & ~(PBLKSZ - 1);
+  if (flags & DEV_TRUNCATE) {
+    dev_reset();
+  }
+  dev_reads = 0;
+  dev_writes = 0;
+  dev_read_bytes = 0;
+  dev_write_bytes = 0;
+  dev_syncs = 0;
+  dev_read_ns = 0;
+  dev_write_ns = 0;
+  dev_sync_ns = 0;
+
+  return 0;
+}
+
+void
+dev_close()
+{
+  ring_close();
+  if (dev_fd >= 0) {
+    close(dev_fd);
+    dev_fd = -1;
+  }
+}
+
+bool
+dev_active()
+{
+  return dev_fd >= 0;
+}
+
+int
+dev_read(uint64_t blkno, void* data, size_t size)
+{
+  uint64_t off = blkno * PBLKSZ;
+  uint64_t start;
+  size_t done;
+  ssize_t n;
+
+  /* Never written, no need to ask the device */
+  if (off >= dev_end.load(std::memory_order_relaxed)) {
+    bzero(data, size);
+    return 0;
+  }
+
+  start = dev_now();
+  for (done = 0; done < size; done += n) {
+    n = pread(dev_fd, (char*)data + done, size - done, off + done);
+    if (n < 0 && errno == EINTR) {
+      n = 0;
+      continue;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    /* Short files end in zeros */
+    if (n == 0) {
+      bzero((char*)data + done, size - done);
+      break;
+    }
+  }
+
+  dev_reads.fetch_add(1, std::memory_order_relaxed);
+  dev_read_bytes.fetch_add(size, std::memory_order_relaxed);
+  dev_read_ns.fetch_add(dev_now() - start, std::memory_order_relaxed);
+  return 0;
+}
+
+int
+dev_write(uint64_t blkno, const void* data, size_t size)
+{
+  uint64_t off = blkno * PBLKSZ;
+  uint64_t end = off + size;
+  uint64_t start, cur;
+  size_t done;
+  ssize_t n;
+
+  start = dev_now();
+  for (done = 0; done < size; done += n) {
+    n = pwrite(dev_fd, (const char*)data + done, size - done, off + done);
+    if (n < 0 && errno == EINTR) {
+      n = 0;
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+  }
+
+  cur = dev_end.load(std::memory_order_relaxed);
+  while (cur < end && !dev_end.compare_exchange_weak(cur, end)) {
+  }
+
+  dev_writes.fetch_add(1, std::memory_order_relaxed);
+  dev_write_bytes.fetch_add(size, std::memory_order_relaxed);
+  dev_write_ns.fetch_add(dev_now() - start, std::memory_order_relaxed);
+  return 0;
+}
+
+/* Only the data has to be on the device, not file times */
+int
+dev_sync()
+{
+  uint64_t start;
+
+  start = dev_now();
+  if (fdatasync(dev_fd) < 0) {
+    return -1;
+  }
+
+  dev_syncs.fetch_add(1, std::memory_order_relaxed);
+  dev_sync_ns.fetch_add(dev_now() - start, std::memory_order_relaxed);
+  return 0;
+}
+
+void
+dev_read_start(uint64_t blkno,
+               void* data,
+               size_t size,
+               std::atomic<bool>* busy)
+{
+  uint64_t off = blkno * PBLKSZ;
+  int error;
+
+  if (ring.r_fd < 0 || off >= dev_end.load(std::memory_order_relaxed)) {
+    error = dev_read(blkno, data, size);
+    assert(error == 0);
+    busy->store(false, std::memory_order_release);
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(dev_ring_lk);
+  ring_queue(new dev_op{ false, data, size, 0, busy, NULL }, off);
+  /* Nobody might wait for it, get it going right away */
+  ring_submit(0);
+}
+
+/* Reads of other threads may be done with pread, give them time instead */
+void
+dev_poll(bool wait)
+{
+  std::unique_lock<std::mutex> guard(dev_ring_lk);
+
+  if (ring.r_fd >= 0 && ring.r_pending + ring.r_inflight > 0) {
+    ring_submit(wait ? 1 : 0);
+    return;
+  }
+
+  guard.unlock();
+  if (wait) {
+    std::this_thread::yield();
+  }
+}
+
+int
+dev_writev(const struct devwrite* writes, size_t n)
+{
+  std::unique_ptr<std::atomic<bool>[]> busy;
+  std::atomic<int> error = 0;
+  uint64_t end = 0, cur;
+
+  if (ring.r_fd < 0) {
+    for (size_t i = 0; i < n; i++) {
+      if (dev_write(writes[i].dw_blkno, writes[i].dw_data, writes[i].dw_size)) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  busy.reset(new std::atomic<bool>[n]);
+  {
+    std::lock_guard<std::mutex> guard(dev_ring_lk);
+    for (size_t i = 0; i < n; i++) {
+      busy[i].store(true, std::memory_order_relaxed);
+      ring_queue(new dev_op{ true,
+                             (void*)writes[i].dw_data,
+                             writes[i].dw_size,
+                             0,
+                             &busy[i],
+                             &error },
+                 writes[i].dw_blkno * PBLKSZ);
+      end = std::max(end, writes[i].dw_blkno * PBLKSZ + writes[i].dw_size);
+    }
+    ring_submit(0);
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    while (busy[i].load(std::memory_order_acquire)) {
+      dev_poll(true);
+    }
+  }
+
+  cur = dev_end.load(std::memory_order_relaxed);
+  while (cur < end && !dev_end.compare_exchange_weak(cur, end)) {
+  }
+
+  return error.load();
+}
+
+/* The arena only comes and goes with the device, while the cache is empty */
+void*
+dev_buf_alloc(size_t size)
+{
+  void* data;
+
+  if (dev_arena == NULL) {
+    return aligned_alloc(PBLKSZ, size);
+  }
+
+  std::lock_guard<std::mutex> guard(dev_arena_lk);
+  auto& freed = dev_arena_free[size];
+  if (!freed.empty()) {
+    data = freed.back();
+    freed.pop_back();
+    return data;
+  }
+
+  if (dev_arena_used + size > DEV_FIXED) {
+    return aligned_alloc(PBLKSZ, size);
+  }
+
+  data = dev_arena + dev_arena_used;
+  dev_arena_used += size;
+  return data;
+}
+
+void
+dev_buf_free(void* data, size_t size)
+{
+  if (!ring_fixed(data, size)) {
+    free(data);
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(dev_arena_lk);
+  dev_arena_free[size].push_back(data);
+}
+
+/* Zero [OFF, OFF + SIZE), writing zeros if the device cannot drop them */
+static void
+dev_zero(uint64_t off, uint64_t size)
+{
+  uint64_t range[2] = { off, size };
+  size_t len;
+  void* zeros;
+  int error;
+
+  if (size == 0) {
+    return;
+  }
+
+  if (dev_blk) {
+    error = ioctl(dev_fd, BLKZEROOUT, range);
+  } else {
+    error =
+      fallocate(dev_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, size);
+  }
+  if (error == 0) {
+    return;
+  }
+
+  len = std::min(size, (uint64_t)DEV_ZEROSZ);
+  zeros = aligned_alloc(PBLKSZ, len);
+  bzero(zeros, len);
+  for (; size > 0; off += len, size -= len) {
+    len = std::min(size, (uint64_t)DEV_ZEROSZ);
+    if (pwrite(dev_fd, zeros, len, off) != (ssize_t)len) {
+      break;
+    }
+  }
+  free(zeros);
+}
+
+void
+dev_trim(uint64_t blkno, size_t size)
+{
+  uint64_t off = blkno * PBLKSZ;
+  uint64_t end = dev_end.load(std::memory_order_relaxed);
+
+  if (off < end) {
+    dev_zero(off, std::min((uint64_t)size, end - off));
+  }
+}
+
+/*
+ * Blocks below the end may be read before they are written again, what
+ * cannot be cut off has to be zeroed
+ */
+void
+dev_reset()
+{
+  uint64_t end = dev_end.exchange(0);
+
+  if (dev_blk || ftruncate(dev_fd, 0) < 0) {
+    dev_zero(0, end);
+  }
+}
+
+void
+dev_stats(struct devstats* stats)
+{
+  stats->ds_reads = dev_reads.load(std::memory_order_relaxed);
+  stats->ds_writes = dev_writes.load(std::memory_order_relaxed);
+  stats->ds_read_bytes = dev_read_bytes.load(std::memory_order_relaxed);
+  stats->ds_write_bytes = dev_write_bytes.load(std::memory_order_relaxed);
+  stats->ds_syncs = dev_syncs.load(std::memory_order_relaxed);
+  stats->ds_read_ns = dev_read_ns.load(std::memory_order_relaxed);
+  stats->ds_write_ns = dev_write_ns.load(std::memory_order_relaxed);
+  stats->ds_sync_ns = dev_sync_ns.load(std::memory_order_relaxed);
+  stats->ds_engine = (ring.r_fd >= 0) ? "io_uring" : "sync";
+}
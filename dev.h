@@ -0,0 +1,114 @@
+#ifndef _DEV_H_
+#define _DEV_H_
+/*
+ * Block device
+ *
+ * With a device open the buffer cache keeps blocks on it instead of in
+ * memory, block N at byte N * PBLKSZ of a regular file or raw block device.
+ * Reads and writes go straight to it with pread and pwrite and are timed, in
+ * place of the latency simulated with DISK_LATENCY.
+ *
+ * Opened with DEV_DIRECT the page cache is bypassed, the data of every I/O
+ * then has to be PBLKSZ aligned and a multiple of PBLKSZ long, which buffers
+ * always are.
+ *
+ * Blocks past the last one written and blocks that were trimmed read as
+ * zeros, without any I/O for the former. There is a single device, it is only
+ * opened and closed while the cache is empty.
+ *
+ * Reads started with dev_read_start and batches of writes go through an
+ * io_uring, shared by every thread under a lock. Buffers allocated with
+ * dev_buf_alloc come from an arena registered with the ring, so I/O on them
+ * skips pinning their pages. Where io_uring is missing, or with DEV_SYNC,
+ * both are done with pread and pwrite on the calling thread.
+ */
+#include <atomic>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Bypass the page cache */
+#define DEV_DIRECT (0x1)
+/* Start out empty instead of with the blocks on the device */
+#define DEV_TRUNCATE (0x2)
+/* No io_uring, every I/O is a pread or pwrite */
+#define DEV_SYNC (0x4)
+
+/* Entries of the submission queue, reads and writes in flight at most */
+#define DEV_RING (256)
+/* Bytes of the arena of registered buffers */
+#define DEV_FIXED (64UL * 1024 * 1024)
+
+/* Returns -1 if PATH cannot be opened with FLAGS */
+int
+dev_open(const char* path, int flags);
+void
+dev_close();
+bool
+dev_active();
+
+/* Returns -1 on I/O errors */
+int
+dev_read(uint64_t blkno, void* data, size_t size);
+int
+dev_write(uint64_t blkno, const void* data, size_t size);
+/* What was written survives a crash once this returns 0 */
+int
+dev_sync();
+
+/*
+ * Start reading the block, BUSY is cleared once it is in DATA. Someone has to
+ * call dev_poll until then.
+ */
+void
+dev_read_start(uint64_t blkno,
+               void* data,
+               size_t size,
+               std::atomic<bool>* busy);
+/* Reap I/O that is done, if WAIT until some is if any is in flight */
+void
+dev_poll(bool wait);
+
+struct devwrite
+{
+  uint64_t dw_blkno;
+  const void* dw_data;
+  size_t dw_size;
+};
+
+/* Write N blocks at once, returns -1 if any of them could not be written */
+int
+dev_writev(const struct devwrite* writes, size_t n);
+
+/* Data of buffers, from the registered arena while it has room */
+void*
+dev_buf_alloc(size_t size);
+void
+dev_buf_free(void* data, size_t size);
+
+/* The blocks are free, they read as zeros until written again */
+void
+dev_trim(uint64_t blkno, size_t size);
+/* Drop every block, the device starts out empty again */
+void
+dev_reset();
+
+struct devstats
+{
+  uint64_t ds_reads;
+  uint64_t ds_writes;
+  uint64_t ds_read_bytes;
+  uint64_t ds_write_bytes;
+  uint64_t ds_syncs;
+  /* Time spent in reads, writes and syncs */
+  uint64_t ds_read_ns;
+  uint64_t ds_write_ns;
+  uint64_t ds_sync_ns;
+  /* "io_uring" or "sync" */
+  const char* ds_engine;
+};
+
+/* Counters since the device was opened */
+void
+dev_stats(struct devstats* stats);
+
+#endif
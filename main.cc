@@ -1,13 +1,22 @@
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
 #include <map>
 #include <random>
 #include <stdio.h>
 #include <string.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
+#include "alloc.h"
 #include "btree.h"
 #include "buf.h"
+#include "bufpolicy.h"
+#include "dev.h"
+#include "options.h"
 #include "rdtsc.h"
+#include "search.h"
 #include "vtree.h"
 
 #define MAX_KEYS (1000000)
@@ -70,6 +79,20 @@ public:
   double num = 0;
 };
 
+static void
+print_tree_stats(const char* when, btree* tree)
+{
+  btstats stats;
+
+  btree_stats(tree, &stats);
+  printf("[%s] Inner: %lu, Leaves: %lu, Height: %d, Keys per leaf: %f\n",
+         when,
+         stats.st_inner,
+         stats.st_leaves,
+         stats.st_height,
+         (double)stats.st_keys / stats.st_leaves);
+}
+
 void
 general()
 {
@@ -80,6 +103,7 @@ general()
 
   btree tree, oldtree;
   bool oldready = false;
+  diskptr_t snap;
 
   int error;
 
@@ -151,10 +175,15 @@ general()
     /* Checkpoint but not on the empty tree */
     if ((i != 0) && ((i % 10000) == 0)) {
       start = rdtscp();
-      btree_checkpoint(&tree);
+      snap = btree_checkpoint(&tree);
       stop = rdtscp();
       checkpoints.add(stop - start);
-      btree_init(&oldtree, tree.tr_ptr, sizeof(ptr));
+      /* Keep the last checkpoint around to read it */
+      if (oldready) {
+        btree_snapshot_release(&tree, oldtree.tr_ptr);
+      }
+      btree_snapshot_hold(&tree, snap);
+      btree_init(&oldtree, snap, sizeof(ptr));
       oldready = true;
     }
     if ((i % 100000) == 0) {
@@ -176,9 +205,16 @@ general()
   }
 
   printf("Deleting keys...\n");
+  print_tree_stats("Before deletes", &tree);
+  size_t ndeletes = 0;
   while (!keys.empty()) {
     auto it = keys.begin();
 
+    /* Leave a tenth of the tree to see how full it stays */
+    if (ndeletes == MAX_KEYS - MAX_KEYS / 10) {
+      print_tree_stats("After deletes", &tree);
+    }
+
     start = rdtscp();
 
     btree_delete(&tree, it->first, &check);
@@ -193,6 +229,15 @@ general()
     assert(error != 0);
     keys.erase(it);
 
+    /* Rebalancing has to COW siblings that belong to a checkpoint */
+    ndeletes += 1;
+    if ((ndeletes % 10000) == 0) {
+      start = rdtscp();
+      btree_checkpoint(&tree);
+      stop = rdtscp();
+      checkpoints.add(stop - start);
+    }
+
     int checkkey = 0;
     for (auto t : keys) {
       start = rdtscp();
@@ -329,6 +374,20 @@ bulkinsert()
     checkpoints.add(stop - start);
   }
 
+  /* Scan the whole tree, walking every leaf off a single descent */
+  auto scan = Stat("FullScan");
+  std::vector<kvp> all(keys.size() + 1);
+  start = rdtscp();
+  size_t nscan = btree_rangequery(&tree, 0, UINT64_MAX, all.data(), all.size());
+  stop = rdtscp();
+  scan.add(stop - start);
+  assert(nscan == keys.size());
+  auto sit = keys.begin();
+  for (size_t i = 0; i < nscan; i++, sit++) {
+    assert(all[i].key == sit->first);
+    assert(memcmp(&all[i].data, &sit->second, sizeof(diskptr_t)) == 0);
+  }
+
   ptr = allocate_blk(BLKSZ);
   error = btree_init(&tree, ptr, sizeof(ptr));
   if (error) {
@@ -340,6 +399,7 @@ bulkinsert()
   inserts.print_stat();
   bulkinserts.print_stat();
   rangeq.print_stat();
+  scan.print_stat();
   deletes.print_stat();
   finds.print_stat();
   checkpoints.print_stat();
@@ -347,80 +407,2012 @@ bulkinsert()
   return 0;
 }
 
+#define BULKLOAD_KEYS (1000000)
+
+/* Build the same tree from sorted input by bulk inserting and bulk loading */
 int
-vtree_test()
+bulkload()
 {
   keys = {};
-  diskptr_t value;
   diskptr_t check;
   uint64_t start, stop;
-  btree tree, oldtree;
-  bool oldready = false;
+  btree tree, loaded;
   int error;
 
   printf("Calculating clock speed\n");
   FREQ = get_clock_speed_sleep();
-  printf("WAL SIZE %lu\n", VTREE_MAXWAL);
 
-  auto inserts = Stat("Inserts");
-  auto deletes = Stat("Deletes");
-  auto finds = Stat("Finds");
-  auto checkpoints = Stat("Checkpoints");
+  auto bulkinserts = Stat("BulkInsert");
+  auto bulkloads = Stat("BulkLoad");
+  auto inserts = Stat("InsertsAfterLoad");
+
+  std::vector<kvp> kvs;
+  for (int i = 0; i < BULKLOAD_KEYS; i++) {
+    kvs.push_back(generate_kvp());
+  }
+  std::sort(kvs.begin(), kvs.end(), sort_by_key);
+
+  error = btree_init(&tree, allocate_blk(BLKSZ), sizeof(diskptr_t));
+  assert(error == 0);
+  start = rdtscp();
+  btree_bulkinsert(&tree, kvs.data(), kvs.size());
+  stop = rdtscp();
+  bulkinserts.add(stop - start);
+
+  struct vtree vtree = vtree_create(&loaded, &btreeops, 0);
+  error = VTREE_INIT(&vtree, allocate_blk(BLKSZ), sizeof(diskptr_t));
+  assert(error == 0);
+  start = rdtscp();
+  error = vtree_bulkload(&vtree, kvs.data(), kvs.size(), BT_BULKLOAD_FILL);
+  stop = rdtscp();
+  bulkloads.add(stop - start);
+  assert(error == 0);
+
+  /* Only an empty tree can be loaded */
+  assert(vtree_bulkload(&vtree, kvs.data(), kvs.size(), BT_BULKLOAD_FILL) ==
+         -1);
+
+  for (auto kv : kvs) {
+    error = btree_find(&loaded, kv.key, &check);
+    assert(error == 0);
+    assert(memcmp(&check, &kv.data, sizeof(diskptr_t)) == 0);
+  }
+
+  /* The loaded tree has to keep working as a normal tree */
+  for (int i = 0; i < BULK_KEYS_NUM; i++) {
+    kvp kv = generate_kvp();
+    start = rdtscp();
+    error = btree_insert(&loaded, kv.key, &kv.data);
+    stop = rdtscp();
+    inserts.add(stop - start);
+    assert(error == 0);
+  }
+
+  void* iter = vtree_iter_open(&vtree, 0, UINT64_MAX);
+  auto it = keys.begin();
+  kvp* batch;
+  int n;
+  while ((n = vtree_iter_next(&vtree, iter, &batch)) > 0) {
+    for (int i = 0; i < n; i++, it++) {
+      assert(batch[i].key == it->first);
+      assert(memcmp(&batch[i].data, &it->second, sizeof(diskptr_t)) == 0);
+    }
+  }
+  assert(it == keys.end());
+  vtree_iter_close(&vtree, iter);
+  vtree_destroy(&vtree);
+
+  printf("Operation Stats in microseconds\n");
+  bulkinserts.print_stat();
+  bulkloads.print_stat();
+  inserts.print_stat();
+
+  return 0;
+}
+
+#define COMPRESS_KEYS (500000)
+#define COMPRESS_CLUSTERS (64)
+
+/*
+ * Keys that come in dense runs, like block numbers or sequence numbers, with
+ * small values, which is where leaves gain the most from delta encoding.
+ * Fills a compressed and a plain tree with the same keys and compares them.
+ */
+int
+compression()
+{
+  uint64_t value, check;
+  uint64_t start, stop;
+  btree trees[2];
+  int error;
+
+  printf("Calculating clock speed\n");
+  FREQ = get_clock_speed_sleep();
+
+  Stat inserts[2] = { Stat("InsertsCompressed"), Stat("InsertsPlain") };
+  Stat finds[2] = { Stat("FindsCompressed"), Stat("FindsPlain") };
+
+  std::map<uint64_t, uint64_t> clustered;
+  std::vector<kvp> kvs;
+  std::vector<uint64_t> bases;
+  for (int i = 0; i < COMPRESS_CLUSTERS; i++) {
+    bases.push_back(generate_unique_key() >> 1);
+  }
+
+  while (kvs.size() < COMPRESS_KEYS) {
+    kvp kv;
+    kv.key = bases[generate_unique_key() % COMPRESS_CLUSTERS] +
+             generate_unique_key() % (COMPRESS_KEYS * 4);
+    if (clustered.count(kv.key)) {
+      continue;
+    }
+
+    value = generate_unique_key();
+    memcpy(&kv.data, &value, sizeof(value));
+    clustered[kv.key] = value;
+    kvs.push_back(kv);
+  }
+
+  for (int t = 0; t < 2; t++) {
+    error = btree_init(&trees[t], allocate_blk(BLKSZ), sizeof(uint64_t));
+    assert(error == 0);
+  }
+  trees[1].tr_flags &= ~BT_TREE_COMPRESS;
+
+  for (int t = 0; t < 2; t++) {
+    for (auto kv : kvs) {
+      start = rdtscp();
+      error = btree_insert(&trees[t], kv.key, &kv.data);
+      stop = rdtscp();
+      inserts[t].add(stop - start);
+      assert(error == 0);
+    }
+  }
+
+  for (int t = 0; t < 2; t++) {
+    for (auto kv : kvs) {
+      start = rdtscp();
+      error = btree_find(&trees[t], kv.key, &check);
+      stop = rdtscp();
+      finds[t].add(stop - start);
+      assert(error == 0);
+      assert(memcmp(&check, &kv.data, sizeof(check)) == 0);
+    }
+  }
+
+  print_tree_stats("Compressed", &trees[0]);
+  print_tree_stats("Plain", &trees[1]);
+
+  /* Deletes take leaves through rebalancing, across checkpoints */
+  for (int i = 0; i < COMPRESS_KEYS / 2; i++) {
+    error = btree_delete(&trees[0], kvs[i].key, &check);
+    assert(error == 0);
+    assert(memcmp(&check, &kvs[i].data, sizeof(check)) == 0);
+    clustered.erase(kvs[i].key);
+    if (i % 50000 == 0) {
+      btree_checkpoint(&trees[0]);
+    }
+  }
+
+  void* iter = btree_iter_open(&trees[0], 0, UINT64_MAX);
+  auto it = clustered.begin();
+  kvp* batch;
+  int n;
+  while ((n = btree_iter_next(iter, &batch)) > 0) {
+    for (int i = 0; i < n; i++, it++) {
+      assert(batch[i].key == it->first);
+      assert(memcmp(&batch[i].data, &it->second, sizeof(uint64_t)) == 0);
+    }
+  }
+  assert(it == clustered.end());
+  btree_iter_close(iter);
+
+  print_tree_stats("Compressed after deletes", &trees[0]);
+
+  printf("Operation Stats in microseconds\n");
+  for (int t = 0; t < 2; t++) {
+    inserts[t].print_stat();
+    finds[t].print_stat();
+  }
+
+  return 0;
+}
+
+#define DIRTY_KEYS (10000)
+
+/*
+ * Checkpoints only take the dirty nodes of their own tree. Nodes of another
+ * tree they took would be marked COW and copied on their next write.
+ */
+int
+dirty_tracking()
+{
+  diskptr_t check;
+  btree trees[2];
+  int error;
 
   keys = {};
-  diskptr_t ptr = allocate_blk(BLKSZ);
+  std::vector<kvp> kvs;
+  for (int i = 0; i < 2 * DIRTY_KEYS; i++) {
+    kvs.push_back(generate_kvp());
+  }
 
-  struct vtree vtree = vtree_create(&tree, &btreeops, VTREE_WITHWAL);
+  for (int t = 0; t < 2; t++) {
+    error = btree_init(&trees[t], allocate_blk(BLKSZ), sizeof(diskptr_t));
+    assert(error == 0);
+    for (int i = 0; i < DIRTY_KEYS; i++) {
+      error = btree_insert(&trees[t], kvs[i].key, &kvs[i].data);
+      assert(error == 0);
+    }
+  }
 
-  VTREE_INIT(&vtree, ptr, sizeof(diskptr_t));
+  btree_checkpoint(&trees[0]);
+  for (int t = 0; t < 2; t++) {
+    for (int i = DIRTY_KEYS; i < 2 * DIRTY_KEYS; i++) {
+      error = btree_insert(&trees[t], kvs[i].key, &kvs[i].data);
+      assert(error == 0);
+    }
+  }
 
-  printf("Filling keys...\n");
-  for (uint64_t i = 0; i < 300000; i++) {
-    uint64_t key = generate_unique_key();
-    while (keys.find(key) != keys.end()) {
-      key = generate_unique_key();
+  printf("[Copied] Checkpointed: %lu, Other: %lu\n",
+         trees[0].tr_copied.load(),
+         trees[1].tr_copied.load());
+  assert(trees[0].tr_copied.load() > 0);
+  assert(trees[1].tr_copied.load() == 0);
+
+  /* The other tree still has every one of its nodes to checkpoint */
+  btree_checkpoint(&trees[1]);
+  error = btree_insert(&trees[1], kvs[0].key, &kvs[1].data);
+  assert(error == 0);
+  assert(trees[1].tr_copied.load() > 0);
+
+  for (int t = 0; t < 2; t++) {
+    for (int i = 1; i < 2 * DIRTY_KEYS; i++) {
+      error = btree_find(&trees[t], kvs[i].key, &check);
+      assert(error == 0);
+      assert(memcmp(&check, &kvs[i].data, sizeof(diskptr_t)) == 0);
     }
+  }
+
+  return 0;
+}
+
+#define FLUSH_KEYS (100000)
+#define FLUSH_NODESZ (4 * 1024)
+
+/*
+ * A checkpoint of thousands of small nodes is cut into many runs, which all
+ * the writers share. Every node has to be written and marked COW once it
+ * returns.
+ */
+int
+checkpoint_workers()
+{
+  uint64_t before[BT_CHECKPOINT_WORKERS];
+  uint64_t runs = 0;
+  diskptr_t check;
+  btree tree;
+  int error;
+
+  static_assert(BT_CHECKPOINT_WORKERS > 1, "checkpoints use a single writer");
+
+  keys = {};
+  std::vector<kvp> kvs;
+  for (int i = 0; i < FLUSH_KEYS; i++) {
+    kvs.push_back(generate_kvp());
+  }
+
+  error = btree_init(&tree, allocate_blk(FLUSH_NODESZ), sizeof(diskptr_t));
+  assert(error == 0);
+  for (auto kv : kvs) {
+    error = btree_insert(&tree, kv.key, &kv.data);
+    assert(error == 0);
+  }
+
+  btree_checkpoint_workers(BT_CHECKPOINT_WORKERS);
+  for (int w = 0; w < BT_CHECKPOINT_WORKERS; w++) {
+    before[w] = btree_checkpoint_runs(w);
+  }
+  btree_checkpoint(&tree);
+  btree_checkpoint_workers(-1);
+  printf("[Runs]");
+  for (int w = 0; w < BT_CHECKPOINT_WORKERS; w++) {
+    printf(" %lu", btree_checkpoint_runs(w) - before[w]);
+    runs += btree_checkpoint_runs(w) - before[w];
+  }
+  printf("\n");
+  assert(runs > 1);
+
+  /* Every node was marked, any insert has to copy its path */
+  error = btree_insert(&tree, kvs[0].key, &kvs[1].data);
+  assert(error == 0);
+  assert(tree.tr_copied.load() > 0);
+
+  for (int i = 1; i < FLUSH_KEYS; i++) {
+    error = btree_find(&tree, kvs[i].key, &check);
+    assert(error == 0);
+    assert(memcmp(&check, &kvs[i].data, sizeof(diskptr_t)) == 0);
+  }
+
+  return 0;
+}
+
+#define DELTA_KEYS (100000)
+#define DELTA_OPS (100000)
+#define DELTA_CHECKPOINT (1000)
+#define DELTA_NODESZ (4 * 1024)
+
+/*
+ * Random updates, inserts and deletes between frequent checkpoints, against
+ * a tree that copies paths and one that chains deltas to checkpointed leaves.
+ * Small nodes give many leaves, so few of them see more than a handful of
+ * updates between two checkpoints.
+ */
+int
+deltas()
+{
+  uint64_t start, stop;
+  diskptr_t check;
+  btree trees[2];
+  int error;
+
+  printf("Calculating clock speed\n");
+  FREQ = get_clock_speed_sleep();
+
+  Stat ops[2] = { Stat("OpsCopy"), Stat("OpsDelta") };
+  Stat finds[2] = { Stat("FindsCopy"), Stat("FindsDelta") };
+
+  keys = {};
+  std::vector<kvp> kvs;
+  std::vector<uint64_t> live;
+  std::map<uint64_t, diskptr_t> expected;
+  for (int i = 0; i < DELTA_KEYS; i++) {
+    kvs.push_back(generate_kvp());
+    live.push_back(kvs[i].key);
+    memcpy(&expected[kvs[i].key], &kvs[i].data, sizeof(diskptr_t));
+  }
+
+  /* Same operations for both trees, a value of zero size deletes */
+  std::vector<std::pair<kvp, bool>> sequence;
+  for (int i = 0; i < DELTA_OPS; i++) {
+    kvp kv;
     diskptr_t value = generate_diskptr();
+    size_t slot = generate_unique_key() % live.size();
+    switch (i % 8) {
+      case 0:
+        kv = generate_kvp();
+        live.push_back(kv.key);
+        memcpy(&expected[kv.key], &kv.data, sizeof(diskptr_t));
+        sequence.push_back({ kv, false });
+        break;
+      case 1:
+        kv.key = live[slot];
+        live[slot] = live.back();
+        live.pop_back();
+        expected.erase(kv.key);
+        sequence.push_back({ kv, true });
+        break;
+      default:
+        kv.key = live[slot];
+        memcpy(&kv.data, &value, sizeof(diskptr_t));
+        expected[kv.key] = value;
+        sequence.push_back({ kv, false });
+    }
+  }
 
-    keys.insert({ key, value });
-    start = rdtscp();
-    error = vtree_insert(&vtree, key, &value);
-    stop = rdtscp();
-    inserts.add(stop - start);
+  for (int t = 0; t < 2; t++) {
+    error = btree_init(&trees[t], allocate_blk(DELTA_NODESZ), sizeof(diskptr_t));
     assert(error == 0);
+    if (t == 1) {
+      trees[t].tr_flags |= BT_TREE_DELTA;
+    }
 
-    if ((i != 0) && ((i % 1000) == 0)) {
+    for (auto kv : kvs) {
+      error = btree_insert(&trees[t], kv.key, &kv.data);
+      assert(error == 0);
+    }
+    btree_checkpoint(&trees[t]);
+    trees[t].tr_copied.store(0);
+
+    for (int i = 0; i < DELTA_OPS; i++) {
+      kvp kv = sequence[i].first;
       start = rdtscp();
-      vtree_checkpoint(&vtree);
+      if (sequence[i].second) {
+        error = btree_delete(&trees[t], kv.key, &check);
+      } else {
+        error = btree_insert(&trees[t], kv.key, &kv.data);
+      }
       stop = rdtscp();
-      checkpoints.add(stop - start);
+      ops[t].add(stop - start);
+      assert(error == 0);
+
+      if ((i + 1) % DELTA_CHECKPOINT == 0) {
+        btree_checkpoint(&trees[t]);
+      }
     }
+  }
 
-    if ((i % 100000) == 0) {
-      printf("[Inserts Complete] %lu\n", i);
+  for (int t = 0; t < 2; t++) {
+    for (auto kv : expected) {
+      start = rdtscp();
+      error = btree_find(&trees[t], kv.first, &check);
+      stop = rdtscp();
+      finds[t].add(stop - start);
+      assert(error == 0);
+      assert(memcmp(&check, &kv.second, sizeof(diskptr_t)) == 0);
     }
   }
-  inserts.print_stat();
-  deletes.print_stat();
-  finds.print_stat();
-  checkpoints.print_stat();
+
+  printf("[Copied] Copy: %lu, Delta: %lu, Delta log: %lu\n",
+         trees[0].tr_copied.load(),
+         trees[1].tr_copied.load(),
+         trees[1].tr_logged.load());
+
+  /* Scans merge the chains in without folding them */
+  size_t nchains = trees[1].tr_nchains.load();
+  assert(nchains > 0);
+  void* iter = btree_iter_open(&trees[1], 0, UINT64_MAX);
+  auto it = expected.begin();
+  kvp* batch;
+  int n;
+  while ((n = btree_iter_next(iter, &batch)) > 0) {
+    for (int i = 0; i < n; i++, it++) {
+      assert(batch[i].key == it->first);
+      assert(memcmp(&batch[i].data, &it->second, sizeof(diskptr_t)) == 0);
+    }
+  }
+  assert(it == expected.end());
+  btree_iter_close(iter);
+  assert(trees[1].tr_nchains.load() == nchains);
+
+  /* A tree opened at the last checkpoint gets its chains back from the log */
+  btree reopened;
+  error = btree_init(&reopened, btree_checkpoint(&trees[1]), sizeof(diskptr_t));
+  assert(error == 0);
+  reopened.tr_flags |= BT_TREE_DELTA;
+  assert(reopened.tr_nchains.load() == trees[1].tr_nchains.load());
+  for (auto kv : expected) {
+    error = btree_find(&reopened, kv.first, &check);
+    assert(error == 0);
+    assert(memcmp(&check, &kv.second, sizeof(diskptr_t)) == 0);
+  }
+
+  printf("Operation Stats in microseconds\n");
+  for (int t = 0; t < 2; t++) {
+    ops[t].print_stat();
+    finds[t].print_stat();
+  }
 
   return 0;
 }
 
+#define EPOCH_KEYS (50000)
+#define EPOCH_ROUNDS (60)
+#define EPOCH_NODESZ (4 * 1024)
+
+/*
+ * Rounds of updates to every key, each followed by a checkpoint, while a
+ * reader keeps looking keys up. Copied nodes are freed once the checkpoint
+ * after them is out, so the cache and the device stop growing. A snapshot is
+ * held over a few rounds and has to stay readable until it is released.
+ */
 int
-main(int argc, char* argv[])
+epochs()
 {
-  printf("General Test\n");
-  general();
-  reset_buf_cache();
+  std::atomic<bool> done = false;
+  std::vector<diskptr_t> held;
+  diskptr_t snap, root, check;
+  size_t nbufs[2];
+  uint64_t nblks[2];
+  btree tree, old;
+  int error;
 
-  printf("Bulkinsert Test\n");
-  bulkinsert();
-  reset_buf_cache();
+  keys = {};
+  std::vector<kvp> kvs;
+  for (int i = 0; i < EPOCH_KEYS; i++) {
+    kvs.push_back(generate_kvp());
+  }
 
-  printf("VTree Test\n");
-  vtree_test();
-  reset_buf_cache();
+  error = btree_init(&tree, allocate_blk(EPOCH_NODESZ), sizeof(diskptr_t));
+  assert(error == 0);
+  for (auto kv : kvs) {
+    error = btree_insert(&tree, kv.key, &kv.data);
+    assert(error == 0);
+  }
+  btree_checkpoint(&tree);
+
+  /* Iterators only pin an epoch while they fill a batch */
+  kvp* batch;
+  int n, seen;
+  void* iter = btree_iter_open(&tree, 0, UINT64_MAX);
+  seen = btree_iter_next(iter, &batch);
+  assert(seen > 0);
+
+  /* Keys are never deleted, whatever value the reader sees is fine */
+  std::thread reader([&]() {
+    diskptr_t value;
+    while (!done.load()) {
+      for (size_t i = 0; i < kvs.size(); i += 13) {
+        int error = btree_find(&tree, kvs[i].key, &value);
+        assert(error == 0);
+      }
+    }
+  });
+
+  for (int r = 0; r < EPOCH_ROUNDS; r++) {
+    for (auto& kv : kvs) {
+      diskptr_t value = generate_diskptr();
+      memcpy(kv.data, &value, sizeof(diskptr_t));
+      error = btree_insert(&tree, kv.key, kv.data);
+      assert(error == 0);
+    }
+
+    root = btree_checkpoint(&tree);
+    if (r == EPOCH_ROUNDS / 8) {
+      snap = root;
+      btree_snapshot_hold(&tree, snap);
+      for (auto kv : kvs) {
+        held.push_back(*(diskptr_t*)kv.data);
+      }
+    }
+
+    if (r == EPOCH_ROUNDS / 4) {
+      error = btree_init(&old, snap, sizeof(diskptr_t));
+      assert(error == 0);
+      for (size_t i = 0; i < kvs.size(); i++) {
+        error = btree_find(&old, kvs[i].key, &check);
+        assert(error == 0);
+        assert(memcmp(&check, &held[i], sizeof(diskptr_t)) == 0);
+      }
+      btree_snapshot_release(&tree, snap);
+    }
+
+    if (r == EPOCH_ROUNDS / 2) {
+      buf_usage(&nbufs[0], &nblks[0]);
+    }
+  }
+  buf_usage(&nbufs[1], &nblks[1]);
+
+  done = true;
+  reader.join();
+
+  uint64_t last = batch[seen - 1].key;
+  while ((n = btree_iter_next(iter, &batch)) > 0) {
+    assert(batch[0].key > last);
+    last = batch[n - 1].key;
+    seen += n;
+  }
+  btree_iter_close(iter);
+  assert(seen == EPOCH_KEYS);
+
+  for (auto kv : kvs) {
+    error = btree_find(&tree, kv.key, &check);
+    assert(error == 0);
+    assert(memcmp(&check, kv.data, sizeof(diskptr_t)) == 0);
+  }
+
+  printf("[Epochs] Buffers: %lu -> %lu, Blocks: %lu -> %lu, Freed: %lu\n",
+         nbufs[0],
+         nbufs[1],
+         nblks[0],
+         nblks[1],
+         tree.tr_freed.load());
+  assert(tree.tr_freed.load() > 0);
+  /* Without reclamation every round would add a copy, an open iterator too */
+  assert(nblks[1] < 2 * nblks[0]);
+
+  return 0;
+}
+
+#define ALLOC_BLOCKS (100000)
+#define ALLOC_THREADS (4)
+#define ALLOC_KEYS (200000)
+#define ALLOC_CHECKPOINT (10000)
+
+/* Collect the blocks of the leaves under PTR in key order */
+static void
+leaf_blocks(btree* tree, diskptr_t ptr, std::vector<uint64_t>* blocks)
+{
+  struct buf* bp = getblk(ptr.offset, ptr.size * PBLKSZ, LK_SHARED);
+  btdata_t data = (btdata_t)bp->bp_data;
+  ct* children = (ct*)&data->bt_keys[tree->tr_max_keys];
+
+  if (data->bt_hdr.hdr_type == BT_LEAF) {
+    blocks->push_back(ptr.offset);
+  } else {
+    for (uint32_t i = 0; i <= data->bt_hdr.hdr_len; i++) {
+      leaf_blocks(tree, *(diskptr_t*)&children[i], blocks);
+    }
+  }
+  buf_unlock(bp, LK_SHARED);
+}
+
+static void
+allocator_worker(size_t count, std::vector<diskptr_t>* ptrs)
+{
+  for (size_t i = 0; i < count; i++) {
+    ptrs->push_back(allocate_blk(PBLKSZ));
+  }
+}
+
+/*
+ * Freed blocks are handed out again and coalesce with their neighbours, and
+ * threads allocate out of their own runs. Leaves split at random keep their
+ * new right half next to them where there is room.
+ */
+int
+allocator()
+{
+  std::vector<std::vector<diskptr_t>> ptrs(ALLOC_THREADS);
+  std::vector<uint64_t> blocks;
+  std::vector<std::thread> threads;
+  uint64_t size, start, stop, dist;
+  size_t adjacent, near;
+  diskptr_t big;
+  btree tree;
+  int error;
+
+  printf("Calculating clock speed\n");
+  FREQ = get_clock_speed_sleep();
+
+  for (int n = 1; n <= ALLOC_THREADS; n *= 2) {
+    threads.clear();
+    start = rdtscp();
+    for (int t = 0; t < n; t++) {
+      threads.emplace_back(allocator_worker, ALLOC_BLOCKS, &ptrs[t]);
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    stop = rdtscp();
+    printf("Threads: %d, Allocations/s: %f\n",
+           n,
+           n * ALLOC_BLOCKS / cycles_to_s(stop - start, FREQ));
+  }
+
+  /* Every other block leaves holes only single blocks fit into */
+  size = alloc_size();
+  for (auto& thread : ptrs) {
+    for (size_t i = 0; i < thread.size(); i += 2) {
+      free_blk(thread[i]);
+    }
+  }
+  for (auto& thread : ptrs) {
+    for (size_t i = 0; i < thread.size(); i += 2) {
+      thread[i] = allocate_blk(PBLKSZ);
+    }
+  }
+  assert(alloc_size() == size);
+
+  /* With the neighbours gone the holes merge back into large extents */
+  for (auto& thread : ptrs) {
+    for (auto ptr : thread) {
+      free_blk(ptr);
+    }
+  }
+  big = allocate_blk(BLKSZ);
+  assert(alloc_size() == size);
+  free_blk(big);
+  printf("[Alloc] Device: %lu, Free: %lu\n", size, alloc_free_blocks());
+
+  /* Checkpoints free copied nodes, so there are holes to place leaves in */
+  keys = {};
+  error = btree_init(&tree, allocate_blk(BT_MIN_NODESZ), sizeof(diskptr_t));
+  assert(error == 0);
+  for (int i = 0; i < ALLOC_KEYS; i++) {
+    kvp kv = generate_kvp();
+    error = btree_insert(&tree, kv.key, &kv.data);
+    assert(error == 0);
+    if ((i + 1) % ALLOC_CHECKPOINT == 0) {
+      btree_checkpoint(&tree);
+    }
+  }
+
+  leaf_blocks(&tree, btree_checkpoint(&tree), &blocks);
+  adjacent = 0;
+  near = 0;
+  for (size_t i = 1; i < blocks.size(); i++) {
+    dist = (blocks[i] > blocks[i - 1]) ? blocks[i] - blocks[i - 1]
+                                       : blocks[i - 1] - blocks[i];
+    adjacent += (blocks[i] == blocks[i - 1] + BT_MIN_NODESZ / PBLKSZ);
+    near += (dist <= ALLOC_NEAR);
+  }
+  printf("[Alloc] Leaves: %lu, Right behind their left neighbour: %f, "
+         "Within %d blocks: %f\n",
+         blocks.size(),
+         (double)adjacent / (blocks.size() - 1),
+         ALLOC_NEAR,
+         (double)near / (blocks.size() - 1));
+
+  return 0;
+}
+
+#define MULTI_KEYS (500000)
+#define MULTI_BATCH (1000)
+#define MULTI_BATCHES (200)
+
+/*
+ * Runs of neighbouring keys, like the block map of a file, looked up one at a
+ * time and as a batch. Every tenth key of a batch is one past a key of the
+ * tree, mostly not in it, and every other batch is shuffled.
+ */
+int
+multifind()
+{
+  std::vector<diskptr_t> values(MULTI_BATCH);
+  std::vector<uint64_t> batch(MULTI_BATCH);
+  std::vector<int> errors(MULTI_BATCH);
+  std::map<uint64_t, diskptr_t> expected;
+  uint64_t start, stop;
+  diskptr_t check;
+  btree tree;
+  int error;
+
+  printf("Calculating clock speed\n");
+  FREQ = get_clock_speed_sleep();
+
+  auto singles = Stat("FindPerKey");
+  auto batched = Stat("MultifindPerKey");
+
+  keys = {};
+  error = btree_init(&tree, allocate_blk(BLKSZ), sizeof(diskptr_t));
+  assert(error == 0);
+  for (int i = 0; i < MULTI_KEYS; i++) {
+    kvp kv = generate_kvp();
+    error = btree_insert(&tree, kv.key, &kv.data);
+    assert(error == 0);
+    memcpy(&expected[kv.key], &kv.data, sizeof(diskptr_t));
+  }
+
+  std::vector<uint64_t> sorted;
+  for (auto kv : expected) {
+    sorted.push_back(kv.first);
+  }
+
+  std::mt19937_64 rng(MULTI_KEYS);
+  for (int b = 0; b < MULTI_BATCHES; b++) {
+    size_t first = rng() % (sorted.size() - MULTI_BATCH);
+    for (int i = 0; i < MULTI_BATCH; i++) {
+      batch[i] = sorted[first + i] + (i % 10 == 9);
+    }
+    if (b % 2) {
+      std::shuffle(batch.begin(), batch.end(), rng);
+    }
+
+    start = rdtscp();
+    for (int i = 0; i < MULTI_BATCH; i++) {
+      errors[i] = btree_find(&tree, batch[i], &values[i]);
+    }
+    stop = rdtscp();
+    singles.add((stop - start) / MULTI_BATCH);
+
+    start = rdtscp();
+    error = btree_multifind(
+      &tree, batch.data(), MULTI_BATCH, values.data(), errors.data());
+    stop = rdtscp();
+    batched.add((stop - start) / MULTI_BATCH);
+    assert(error == 0);
+
+    for (int i = 0; i < MULTI_BATCH; i++) {
+      auto it = expected.find(batch[i]);
+      if (it == expected.end()) {
+        assert(errors[i] != 0);
+        continue;
+      }
+      assert(errors[i] == 0);
+      assert(memcmp(&values[i], &it->second, sizeof(diskptr_t)) == 0);
+    }
+  }
+
+  /* Same through the vtree */
+  struct vtree vtree = vtree_create(&tree, &btreeops, 0);
+  error = vtree_multifind(
+    &vtree, batch.data(), MULTI_BATCH, values.data(), errors.data());
+  assert(error == 0);
+  for (int i = 0; i < MULTI_BATCH; i++) {
+    error = btree_find(&tree, batch[i], &check);
+    assert(errors[i] == error);
+    assert(error != 0 || memcmp(&values[i], &check, sizeof(diskptr_t)) == 0);
+  }
+
+  printf("Operation Stats in microseconds\n");
+  singles.print_stat();
+  batched.print_stat();
+
+  return 0;
+}
+
+#define ASYNC_KEYS (200000)
+#define ASYNC_LOOKUPS (20000)
+/* Blocks that stay in memory, a small part of the tree */
+#define ASYNC_CACHED (64)
+
+/*
+ * Random lookups in a tree that does not fit in memory, one at a time and
+ * with more and more of them waiting on reads at once.
+ */
+int
+async_finds()
+{
+  std::vector<diskptr_t> values(ASYNC_LOOKUPS);
+  std::vector<uint64_t> lookups(ASYNC_LOOKUPS);
+  std::vector<int> errors(ASYNC_LOOKUPS);
+  std::map<uint64_t, diskptr_t> expected;
+  uint64_t start, stop;
+  std::vector<kvp> kvs;
+  btree tree;
+  int error;
+
+  printf("Calculating clock speed\n");
+  FREQ = get_clock_speed_sleep();
+
+  keys = {};
+  for (int i = 0; i < ASYNC_KEYS; i++) {
+    kvp kv = generate_kvp();
+    kvs.push_back(kv);
+    memcpy(&expected[kv.key], &kv.data, sizeof(diskptr_t));
+  }
+  std::sort(kvs.begin(), kvs.end(), sort_by_key);
+
+  error = btree_init(&tree, allocate_blk(BLKSZ), sizeof(diskptr_t));
+  assert(error == 0);
+  error = btree_bulkinsert(&tree, kvs.data(), kvs.size());
+  assert(error == 0);
+
+  /* Every tenth lookup is one past a key, mostly not in the tree */
+  std::mt19937_64 rng(ASYNC_KEYS);
+  for (int i = 0; i < ASYNC_LOOKUPS; i++) {
+    lookups[i] = kvs[rng() % kvs.size()].key + (i % 10 == 9);
+  }
+
+  buf_set_latency(ASYNC_CACHED);
+
+  auto singles = Stat("FindPerKey");
+  start = rdtscp();
+  for (int i = 0; i < ASYNC_LOOKUPS; i++) {
+    errors[i] = btree_find(&tree, lookups[i], &values[i]);
+  }
+  stop = rdtscp();
+  singles.add((stop - start) / ASYNC_LOOKUPS);
+
+  printf("Operation Stats in microseconds\n");
+  singles.print_stat();
+  for (int depth = 1; depth <= 64; depth *= 2) {
+    auto async = Stat("FindAsyncPerKey/" + std::to_string(depth));
+    start = rdtscp();
+    error = btree_find_async(&tree,
+                             lookups.data(),
+                             ASYNC_LOOKUPS,
+                             values.data(),
+                             errors.data(),
+                             depth);
+    stop = rdtscp();
+    async.add((stop - start) / ASYNC_LOOKUPS);
+    assert(error == 0);
+    async.print_stat();
+
+    for (int i = 0; i < ASYNC_LOOKUPS; i++) {
+      auto it = expected.find(lookups[i]);
+      if (it == expected.end()) {
+        assert(errors[i] != 0);
+        continue;
+      }
+      assert(errors[i] == 0);
+      assert(memcmp(&values[i], &it->second, sizeof(diskptr_t)) == 0);
+    }
+  }
+
+#ifdef DISK_LATENCY
+  buf_set_latency(LRU_CAPACITY);
+#else
+  buf_set_latency(0);
+#endif
+
+  return 0;
+}
+
+#define GETBLK_THREADS (8)
+#define GETBLK_BLOCKS (4096)
+#define GETBLK_OPS (1000000)
+
+static void
+getblk_worker(std::vector<diskptr_t>* ptrs, uint64_t seed)
+{
+  std::mt19937_64 rng(seed);
+  struct buf* bp;
+
+  for (int i = 0; i < GETBLK_OPS; i++) {
+    diskptr_t ptr = (*ptrs)[rng() % ptrs->size()];
+    bp = getblk(ptr.offset, ptr.size * PBLKSZ, LK_SHARED);
+    buf_unlock(bp, LK_SHARED);
+  }
+}
+
+/*
+ * Readers looking up buffers that are all in the cache, as descents of many
+ * threads do, only contend on the shards of the cache they share.
+ */
+int
+getblk_scaling()
+{
+  std::vector<std::thread> threads;
+  std::vector<diskptr_t> ptrs;
+  uint64_t start, stop;
+  struct buf* bp;
+
+  printf("Calculating clock speed\n");
+  FREQ = get_clock_speed_sleep();
+
+  for (int i = 0; i < GETBLK_BLOCKS; i++) {
+    ptrs.push_back(allocate_blk(BT_MIN_NODESZ));
+    bp = getblk(ptrs.back().offset, BT_MIN_NODESZ, LK_SHARED);
+    buf_unlock(bp, LK_SHARED);
+  }
+
+  for (int n = 1; n <= GETBLK_THREADS; n *= 2) {
+    threads.clear();
+    start = rdtscp();
+    for (int t = 0; t < n; t++) {
+      threads.emplace_back(getblk_worker, &ptrs, t);
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    stop = rdtscp();
+    printf("Threads: %d, Getblks/s: %f\n",
+           n,
+           (double)n * GETBLK_OPS / cycles_to_s(stop - start, FREQ));
+  }
+
+  return 0;
+}
+
+#define BOUNDED_KEYS (100000)
+#define BOUNDED_CHECKPOINT (10000)
+#define BOUNDED_CAPACITY (1 * MB)
+
+/*
+ * A tree many times the size of the cache. Buffers are evicted, dirty ones
+ * written back, and read back in on the next lookup. The second half of the
+ * keys goes in while a reader looks up the first. A reader preempted inside
+ * a call keeps what was looked up since in memory, so the cache has to be
+ * back within its capacity once the reader is done, through the lookups and
+ * the scan that follow.
+ */
+int
+bounded_cache()
+{
+  std::atomic<bool> done = false;
+  size_t most = 0;
+  diskptr_t check;
+  btree tree;
+  kvp* batch;
+  int error, n;
+
+  keys = {};
+  std::vector<kvp> kvs;
+  for (int i = 0; i < BOUNDED_KEYS; i++) {
+    kvs.push_back(generate_kvp());
+  }
+
+  buf_set_capacity(BOUNDED_CAPACITY);
+  error = btree_init(&tree, allocate_blk(BT_MIN_NODESZ), sizeof(diskptr_t));
+  assert(error == 0);
+  for (int i = 0; i < BOUNDED_KEYS / 2; i++) {
+    error = btree_insert(&tree, kvs[i].key, &kvs[i].data);
+    assert(error == 0);
+    if (i % BOUNDED_CHECKPOINT == 0) {
+      btree_checkpoint(&tree);
+      most = std::max(most, buf_resident());
+    }
+  }
+  btree_checkpoint(&tree);
+  most = std::max(most, buf_resident());
+
+  std::thread reader([&]() {
+    diskptr_t value;
+    while (!done.load()) {
+      for (size_t i = 0; i < kvs.size() / 2; i += 7) {
+        int error = btree_find(&tree, kvs[i].key, &value);
+        assert(error == 0);
+        assert(memcmp(&value, &kvs[i].data, sizeof(diskptr_t)) == 0);
+      }
+    }
+  });
+
+  for (int i = BOUNDED_KEYS / 2; i < BOUNDED_KEYS; i++) {
+    error = btree_insert(&tree, kvs[i].key, &kvs[i].data);
+    assert(error == 0);
+    if (i % BOUNDED_CHECKPOINT == 0) {
+      btree_checkpoint(&tree);
+    }
+  }
+  btree_checkpoint(&tree);
+
+  done = true;
+  reader.join();
+
+  for (auto kv : kvs) {
+    error = btree_find(&tree, kv.key, &check);
+    assert(error == 0);
+    assert(memcmp(&check, kv.data, sizeof(diskptr_t)) == 0);
+  }
+  most = std::max(most, buf_resident());
+
+  /* Iterators only pin buffers while they fill a batch */
+  n = 0;
+  void* iter = btree_iter_open(&tree, 0, UINT64_MAX);
+  for (int len; (len = btree_iter_next(iter, &batch)) > 0;) {
+    n += len;
+    most = std::max(most, buf_resident());
+  }
+  btree_iter_close(iter);
+  assert(n == BOUNDED_KEYS);
+
+  /* So do long range queries and batches of lookups, every so many leaves */
+  std::vector<kvp> all(BOUNDED_KEYS);
+  n = btree_rangequery(&tree, 0, UINT64_MAX, all.data(), all.size());
+  assert(n == BOUNDED_KEYS);
+  most = std::max(most, buf_resident());
+
+  std::vector<uint64_t> lookups;
+  std::vector<diskptr_t> values(BOUNDED_KEYS);
+  std::vector<int> errors(BOUNDED_KEYS);
+  for (auto kv : kvs) {
+    lookups.push_back(kv.key);
+  }
+  error = btree_multifind(
+    &tree, lookups.data(), lookups.size(), values.data(), errors.data());
+  assert(error == 0);
+  most = std::max(most, buf_resident());
+  for (int i = 0; i < BOUNDED_KEYS; i++) {
+    assert(errors[i] == 0);
+    assert(memcmp(&values[i], kvs[i].data, sizeof(diskptr_t)) == 0);
+  }
+
+  print_buf_stats();
+  printf("[Bounded] Capacity: %lu, Most resident: %lu\n",
+         BOUNDED_CAPACITY,
+         most);
+  assert(most <= 2 * BOUNDED_CAPACITY);
+
+  buf_set_capacity(BUF_CAPACITY);
+
+  return 0;
+}
+
+#define POLICY_KEYS (100000)
+#define POLICY_HOT (POLICY_KEYS / 8)
+/* Scans stay clear of the hot keys and cover more leaves than the cache */
+#define POLICY_SCAN (POLICY_KEYS * 3 / 8)
+#define POLICY_ROUNDS (20)
+#define POLICY_FINDS (500)
+#define POLICY_CAPACITY (1 * MB)
+/* Lookup hit rate 2Q has to gain over CLOCK */
+#define POLICY_MARGIN (0.02)
+
+/*
+ * Point lookups on a hot range of keys between scans over a quarter of a tree
+ * several times the size of the cache, returns the hit rate of the lookups.
+ */
+static double
+policy_run(const struct buf_policy* policy, std::vector<kvp>* kvs)
+{
+  std::vector<kvp> results(POLICY_SCAN);
+  struct bufstats before, after;
+  uint64_t hits = 0, misses = 0;
+  size_t hot = kvs->size() / 2;
+  size_t first, n;
+  diskptr_t check;
+  btree tree;
+  int error;
+
+  reset_buf_cache();
+  buf_set_policy(policy);
+  buf_set_capacity(POLICY_CAPACITY);
+  error = btree_init(&tree, allocate_blk(BT_MIN_NODESZ), sizeof(diskptr_t));
+  assert(error == 0);
+  btree_bulkinsert(&tree, kvs->data(), kvs->size());
+  btree_checkpoint(&tree);
+
+  std::mt19937_64 rng(POLICY_KEYS);
+  for (int r = 0; r < POLICY_ROUNDS; r++) {
+    buf_stats(&before);
+    for (int i = 0; i < POLICY_FINDS; i++) {
+      kvp& kv = (*kvs)[hot + rng() % POLICY_HOT];
+      error = btree_find(&tree, kv.key, &check);
+      assert(error == 0);
+      assert(memcmp(&check, kv.data, sizeof(diskptr_t)) == 0);
+    }
+    buf_stats(&after);
+    hits += after.bs_hits - before.bs_hits;
+    misses += after.bs_misses - before.bs_misses;
+
+    first = rng() % (hot - POLICY_SCAN);
+    n = btree_rangequery(&tree,
+                         (*kvs)[first].key,
+                         (*kvs)[first + POLICY_SCAN].key,
+                         results.data(),
+                         POLICY_SCAN);
+    assert(n == POLICY_SCAN);
+  }
+
+  buf_stats(&after);
+  printf("[Policy] %s, Lookup hit rate: %f, Overall hit rate: %f\n",
+         policy->po_name,
+         (double)hits / (hits + misses),
+         (double)after.bs_hits / (after.bs_hits + after.bs_misses));
+
+  return (double)hits / (hits + misses);
+}
+
+/*
+ * Scans read every leaf they cover once. A policy that lets them push out
+ * the leaves point lookups keep coming back to misses on every lookup after
+ * a scan.
+ */
+int
+policies()
+{
+  std::vector<kvp> kvs;
+  double clock, twoq;
+
+  /* The same tree and trace on every run */
+  std::mt19937_64 rng(POLICY_ROUNDS);
+  kvp kv = {};
+  for (int i = 0; i < POLICY_KEYS; i++) {
+    kv.key = rng();
+    kvs.push_back(kv);
+  }
+  std::sort(kvs.begin(), kvs.end(), sort_by_key);
+
+  clock = policy_run(&buf_clock, &kvs);
+  twoq = policy_run(&buf_2q, &kvs);
+  printf("[Policy] 2Q over CLOCK: %f\n", twoq - clock);
+  assert(twoq > clock + POLICY_MARGIN);
+
+  reset_buf_cache();
+  buf_set_policy(&BUF_POLICY);
+  buf_set_capacity(BUF_CAPACITY);
+
+  return 0;
+}
+
+/* File systems like tmpfs have no O_DIRECT, go through the page cache there */
+static int
+open_device(const char* path, int flags)
+{
+  if (buf_set_device(path, flags | DEV_DIRECT) == 0) {
+    return DEV_DIRECT;
+  }
+
+  return (buf_set_device(path, flags) == 0) ? 0 : -1;
+}
+
+#define DEVICE_KEYS (50000)
+#define DEVICE_CHECKPOINT (5000)
+#define DEVICE_CAPACITY (1 * MB)
+#define DEVICE_PATH ("btree.dev")
+
+/*
+ * A tree several times the size of the cache on a file. Once the cache drops
+ * everything it has in memory, as if it was restarted, the tree is opened
+ * again from its last checkpoint and read back from the file.
+ */
+int
+device()
+{
+  struct devstats stats;
+  diskptr_t root, check;
+  btree tree;
+  int error, flags;
+
+  keys = {};
+  std::vector<kvp> kvs;
+  for (int i = 0; i < DEVICE_KEYS; i++) {
+    kvs.push_back(generate_kvp());
+  }
+
+  flags = open_device(DEVICE_PATH, DEV_TRUNCATE);
+  assert(flags >= 0);
+  buf_set_capacity(DEVICE_CAPACITY);
+  error = btree_init(&tree, allocate_blk(BT_MIN_NODESZ), sizeof(diskptr_t));
+  assert(error == 0);
+  for (int i = 0; i < DEVICE_KEYS; i++) {
+    error = btree_insert(&tree, kvs[i].key, &kvs[i].data);
+    assert(error == 0);
+    if (i % DEVICE_CHECKPOINT == 0) {
+      btree_checkpoint(&tree);
+    }
+  }
+  root = btree_checkpoint(&tree);
+
+  /* Every checkpoint waits for its nodes to be durable */
+  dev_stats(&stats);
+  printf("[Device] Syncs: %lu, Sync latency: %lu ns\n",
+         stats.ds_syncs,
+         stats.ds_sync_ns / std::max(stats.ds_syncs, 1UL));
+  assert(stats.ds_syncs > DEVICE_KEYS / DEVICE_CHECKPOINT);
+
+  error = buf_set_device(DEVICE_PATH, flags);
+  assert(error == 0);
+  error = btree_init(&tree, root, sizeof(diskptr_t));
+  assert(error == 0);
+  for (auto kv : kvs) {
+    error = btree_find(&tree, kv.key, &check);
+    assert(error == 0);
+    assert(memcmp(&check, kv.data, sizeof(diskptr_t)) == 0);
+  }
+
+  print_buf_stats();
+  dev_stats(&stats);
+  printf("[Device] %s, Reads: %lu, Read latency: %lu ns\n",
+         (flags & DEV_DIRECT) ? "O_DIRECT" : "Buffered",
+         stats.ds_reads,
+         stats.ds_read_ns / std::max(stats.ds_reads, 1UL));
+  assert(stats.ds_reads > 0);
+
+#ifdef BUF_DEVICE
+  error = open_device(BUF_DEVICE, DEV_TRUNCATE);
+  assert(error >= 0);
+#else
+  buf_set_device(NULL, 0);
+#endif
+  unlink(DEVICE_PATH);
+  buf_set_capacity(BUF_CAPACITY);
+
+  return 0;
+}
+
+#define ENGINE_KEYS (50000)
+#define ENGINE_CAPACITY (1 * MB)
+#define ENGINE_DEPTH (32)
+
+static void
+io_engine_run(int flags, std::vector<kvp>* kvs)
+{
+  std::vector<diskptr_t> values(kvs->size());
+  std::vector<uint64_t> lookups(kvs->size());
+  std::vector<int> errors(kvs->size());
+  struct devstats stats;
+  uint64_t start, stop;
+  diskptr_t root;
+  btree tree;
+  int error;
+
+  error = open_device(DEVICE_PATH, DEV_TRUNCATE | flags);
+  assert(error >= 0);
+  flags |= error;
+  buf_set_capacity(ENGINE_CAPACITY);
+  error = btree_init(&tree, allocate_blk(BT_MIN_NODESZ), sizeof(diskptr_t));
+  assert(error == 0);
+  for (auto& kv : *kvs) {
+    error = btree_insert(&tree, kv.key, &kv.data);
+    assert(error == 0);
+  }
+
+  dev_stats(&stats);
+  auto checkpoint = Stat(std::string("Checkpoint/") + stats.ds_engine);
+  start = rdtscp();
+  root = btree_checkpoint(&tree);
+  stop = rdtscp();
+  checkpoint.add(stop - start);
+
+  error = buf_set_device(DEVICE_PATH, flags);
+  assert(error == 0);
+  error = btree_init(&tree, root, sizeof(diskptr_t));
+  assert(error == 0);
+  std::mt19937_64 rng(ENGINE_KEYS);
+  for (size_t i = 0; i < kvs->size(); i++) {
+    lookups[i] = (*kvs)[rng() % kvs->size()].key;
+  }
+
+  auto finds = Stat(std::string("ColdFindAsyncPerKey/") + stats.ds_engine);
+  start = rdtscp();
+  error = btree_find_async(&tree,
+                           lookups.data(),
+                           lookups.size(),
+                           values.data(),
+                           errors.data(),
+                           ENGINE_DEPTH);
+  stop = rdtscp();
+  finds.add((stop - start) / lookups.size());
+  assert(error == 0);
+  for (size_t i = 0; i < lookups.size(); i++) {
+    assert(errors[i] == 0);
+    assert(memcmp(&values[i], &keys[lookups[i]], sizeof(diskptr_t)) == 0);
+  }
+
+  checkpoint.print_stat();
+  finds.print_stat();
+  reset_buf_cache();
+}
+
+/*
+ * Checkpoints and cold lookups on a file, with pread and pwrite and then
+ * through the io_uring if the kernel has one. Checkpoints write their nodes
+ * as one batch, lookups after the cache dropped everything keep up to
+ * ENGINE_DEPTH reads in flight.
+ */
+int
+io_engines()
+{
+  std::vector<kvp> kvs;
+  int error;
+
+  printf("Calculating clock speed\n");
+  FREQ = get_clock_speed_sleep();
+
+  keys = {};
+  for (int i = 0; i < ENGINE_KEYS; i++) {
+    kvs.push_back(generate_kvp());
+  }
+
+  io_engine_run(DEV_SYNC, &kvs);
+  io_engine_run(0, &kvs);
+
+#ifdef BUF_DEVICE
+  error = open_device(BUF_DEVICE, DEV_TRUNCATE);
+  assert(error >= 0);
+#else
+  buf_set_device(NULL, 0);
+#endif
+  unlink(DEVICE_PATH);
+  buf_set_capacity(BUF_CAPACITY);
+
+  return 0;
+}
+
+int
+vtree_test()
+{
+  keys = {};
+  diskptr_t value;
+  diskptr_t check;
+  uint64_t start, stop;
+  btree tree, oldtree;
+  bool oldready = false;
+  int error;
+
+  printf("Calculating clock speed\n");
+  FREQ = get_clock_speed_sleep();
+  printf("WAL SIZE %lu\n", VTREE_MAXWAL);
+
+  auto inserts = Stat("Inserts");
+  auto deletes = Stat("Deletes");
+  auto finds = Stat("Finds");
+  auto checkpoints = Stat("Checkpoints");
+
+  keys = {};
+  diskptr_t ptr = allocate_blk(BLKSZ);
+
+  struct vtree vtree = vtree_create(&tree, &btreeops, VTREE_WITHWAL);
+
+  VTREE_INIT(&vtree, ptr, sizeof(diskptr_t));
+
+  printf("Filling keys...\n");
+  for (uint64_t i = 0; i < 300000; i++) {
+    uint64_t key = generate_unique_key();
+    while (keys.find(key) != keys.end()) {
+      key = generate_unique_key();
+    }
+    diskptr_t value = generate_diskptr();
+
+    keys.insert({ key, value });
+    start = rdtscp();
+    error = vtree_insert(&vtree, key, &value);
+    stop = rdtscp();
+    inserts.add(stop - start);
+    assert(error == 0);
+
+    if ((i != 0) && ((i % 1000) == 0)) {
+      start = rdtscp();
+      vtree_checkpoint(&vtree);
+      stop = rdtscp();
+      checkpoints.add(stop - start);
+    }
+
+    if ((i % 100000) == 0) {
+      printf("[Inserts Complete] %lu\n", i);
+    }
+  }
+
+  /* Stream every key back out, including what is still in the WAL */
+  auto scans = Stat("IterScan");
+  void* iter = vtree_iter_open(&vtree, 0, UINT64_MAX);
+  assert(iter != NULL);
+  auto it = keys.begin();
+  kvp* batch;
+  int n;
+  start = rdtscp();
+  while ((n = vtree_iter_next(&vtree, iter, &batch)) > 0) {
+    for (int i = 0; i < n; i++, it++) {
+      assert(batch[i].key == it->first);
+      assert(memcmp(&batch[i].data, &it->second, sizeof(diskptr_t)) == 0);
+    }
+  }
+  stop = rdtscp();
+  scans.add(stop - start);
+  assert(it == keys.end());
+
+  /* Seek back into the middle and resume from there */
+  it = keys.begin();
+  std::advance(it, keys.size() / 2);
+  vtree_iter_seek(&vtree, iter, it->first);
+  n = vtree_iter_next(&vtree, iter, &batch);
+  assert(n > 0 && batch[0].key == it->first);
+  vtree_iter_close(&vtree, iter);
+  vtree_destroy(&vtree);
+
+  inserts.print_stat();
+  deletes.print_stat();
+  finds.print_stat();
+  checkpoints.print_stat();
+  scans.print_stat();
+
+  return 0;
+}
+
+#define VLOG_KEYS (100000)
+#define VLOG_VALUE_SIZE (256)
+
+typedef struct vlogvalue
+{
+  uint64_t v_words[VLOG_VALUE_SIZE / sizeof(uint64_t)];
+} vlogvalue;
+
+static vlogvalue
+generate_vlogvalue()
+{
+  vlogvalue value;
+  for (auto& word : value.v_words) {
+    word = generate_unique_key();
+  }
+  return value;
+}
+
+/* Values too large for a leaf go through the value log */
+int
+vlog_test()
+{
+  std::map<uint64_t, vlogvalue> values;
+  vlogvalue value, check;
+  uint64_t start, stop;
+  size_t before, collected;
+  btree tree;
+  int error;
+
+  printf("Calculating clock speed\n");
+  FREQ = get_clock_speed_sleep();
+
+  auto inserts = Stat("VlogInserts");
+  auto finds = Stat("VlogFinds");
+  auto gcs = Stat("VlogGC");
+
+  struct vtree vtree =
+    vtree_create(&tree, &btreeops, VTREE_WITHWAL | VTREE_VALUELOG);
+  error = vtree_init(&vtree, allocate_blk(BLKSZ), VLOG_VALUE_SIZE);
+  assert(error == 0);
+
+  for (int i = 0; i < VLOG_KEYS; i++) {
+    uint64_t key = generate_unique_key();
+    value = generate_vlogvalue();
+    values[key] = value;
+    start = rdtscp();
+    error = vtree_insert(&vtree, key, &value);
+    stop = rdtscp();
+    inserts.add(stop - start);
+    assert(error == 0);
+
+    if ((i != 0) && ((i % 1000) == 0)) {
+      vtree_checkpoint(&vtree);
+    }
+  }
+
+  /* Overwrite half the keys and delete a quarter, leaving dead records */
+  int i = 0;
+  for (auto it = values.begin(); it != values.end(); i++) {
+    if (i % 4 == 0) {
+      vtree_checkpoint(&vtree);
+      error = vtree_delete(&vtree, it->first, &check);
+      assert(error == 0);
+      assert(memcmp(&check, &it->second, sizeof(check)) == 0);
+      it = values.erase(it);
+      continue;
+    }
+
+    if (i % 2 == 0) {
+      it->second = generate_vlogvalue();
+      error = vtree_insert(&vtree, it->first, &it->second);
+      assert(error == 0);
+    }
+    it++;
+  }
+  vtree_checkpoint(&vtree);
+
+  before = vtree.v_vlog->vl_blocks.size();
+  start = rdtscp();
+  collected = vtree_vlog_gc(&vtree, before);
+  stop = rdtscp();
+  gcs.add(stop - start);
+  vtree_checkpoint(&vtree);
+  printf("[Value log] Blocks: %lu, Collected: %lu, Left: %lu\n",
+         before,
+         collected,
+         vtree.v_vlog->vl_blocks.size());
+  assert(vtree.v_vlog->vl_blocks.size() < before);
+
+  for (auto kv : values) {
+    start = rdtscp();
+    error = vtree_find(&vtree, kv.first, &check);
+    stop = rdtscp();
+    finds.add(stop - start);
+    assert(error == 0);
+    assert(memcmp(&check, &kv.second, sizeof(check)) == 0);
+  }
+
+  void* iter = vtree_iter_open(&vtree, 0, UINT64_MAX);
+  auto it = values.begin();
+  kvp* batch;
+  int n;
+  while ((n = vtree_iter_next(&vtree, iter, &batch)) > 0) {
+    for (int i = 0; i < n; i++, it++) {
+      assert(batch[i].key == it->first);
+      vtree_value(&vtree, &batch[i], &check);
+      assert(memcmp(&check, &it->second, sizeof(check)) == 0);
+    }
+  }
+  assert(it == values.end());
+  vtree_iter_close(&vtree, iter);
+  vtree_destroy(&vtree);
+
+  print_tree_stats("Value log", &tree);
+
+  inserts.print_stat();
+  finds.print_stat();
+  gcs.print_stat();
+
+  return 0;
+}
+
+#define CONCURRENT_THREADS (4)
+#define CONCURRENT_KEYS (100000)
+
+static void
+concurrent_worker(btree* tree, kvp* kvs, size_t len, uint64_t* cycles)
+{
+  diskptr_t check;
+  uint64_t start, stop;
+  int error;
+
+  start = rdtscp();
+  for (size_t i = 0; i < len; i++) {
+    error = btree_insert(tree, kvs[i].key, &kvs[i].data);
+    assert(error == 0);
+    error = btree_find(tree, kvs[i].key, &check);
+    assert(error == 0);
+    assert(memcmp(&check, &kvs[i].data, sizeof(diskptr_t)) == 0);
+  }
+
+  /* Delete every other key so leaves shrink while others are growing */
+  for (size_t i = 0; i < len; i += 2) {
+    error = btree_delete(tree, kvs[i].key, &check);
+    assert(error == 0);
+    assert(memcmp(&check, &kvs[i].data, sizeof(diskptr_t)) == 0);
+  }
+  stop = rdtscp();
+
+  *cycles = stop - start;
+}
+
+/* Keeps looking up keys nobody modifies while the writers are running */
+static void
+concurrent_reader(btree* tree,
+                  std::vector<kvp>* kvs,
+                  std::atomic<bool>* done,
+                  uint64_t* finds)
+{
+  diskptr_t check;
+  int error;
+
+  *finds = 0;
+  while (!done->load()) {
+    for (size_t i = 0; i < kvs->size(); i += 97) {
+      error = btree_find(tree, (*kvs)[i].key, &check);
+      assert(error == 0);
+      assert(memcmp(&check, &(*kvs)[i].data, sizeof(diskptr_t)) == 0);
+      *finds += 1;
+    }
+  }
+}
+
+int
+concurrent()
+{
+  keys = {};
+  diskptr_t check;
+  uint64_t start, stop;
+  btree tree;
+  int error;
+
+  diskptr_t ptr = allocate_blk(BLKSZ);
+  printf("Calculating clock speed\n");
+  FREQ = get_clock_speed_sleep();
+
+  auto inserts = Stat("Inserts");
+  auto threaded = Stat("ThreadedOps");
+  auto checkpoints = Stat("Checkpoints");
+
+  error = btree_init(&tree, ptr, sizeof(ptr));
+  if (error) {
+    printf("Problem initing\n");
+  }
+
+  /* Generate everything up front, our generator is not thread safe */
+  std::vector<kvp> seed;
+  std::vector<kvp> kvs;
+  for (int i = 0; i < CONCURRENT_KEYS; i++) {
+    seed.push_back(generate_kvp());
+  }
+  for (int i = 0; i < CONCURRENT_KEYS * CONCURRENT_THREADS; i++) {
+    kvs.push_back(generate_kvp());
+  }
+
+  for (auto kv : seed) {
+    start = rdtscp();
+    error = btree_insert(&tree, kv.key, &kv.data);
+    stop = rdtscp();
+    inserts.add(stop - start);
+    assert(error == 0);
+  }
+
+  /* Checkpoint so the threads have to COW the seeded nodes while racing */
+  start = rdtscp();
+  btree_checkpoint(&tree);
+  stop = rdtscp();
+  checkpoints.add(stop - start);
+
+  std::vector<std::thread> threads;
+  std::vector<std::thread> readers;
+  std::atomic<bool> done = false;
+  uint64_t cycles[CONCURRENT_THREADS];
+  uint64_t finds[CONCURRENT_THREADS];
+
+  for (int t = 0; t < CONCURRENT_THREADS; t++) {
+    readers.emplace_back(concurrent_reader, &tree, &seed, &done, &finds[t]);
+  }
+
+  start = rdtscp();
+  for (int t = 0; t < CONCURRENT_THREADS; t++) {
+    threads.emplace_back(concurrent_worker,
+                         &tree,
+                         &kvs[t * CONCURRENT_KEYS],
+                         CONCURRENT_KEYS,
+                         &cycles[t]);
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  stop = rdtscp();
+
+  done = true;
+  for (auto& thread : readers) {
+    thread.join();
+  }
+
+  uint64_t total_finds = 0;
+  for (int t = 0; t < CONCURRENT_THREADS; t++) {
+    threaded.add(cycles[t]);
+    total_finds += finds[t];
+  }
+
+  printf("Checking all keys\n");
+  for (auto kv : seed) {
+    error = btree_find(&tree, kv.key, &check);
+    assert(error == 0);
+    assert(memcmp(&check, &kv.data, sizeof(diskptr_t)) == 0);
+  }
+
+  for (size_t i = 0; i < kvs.size(); i++) {
+    error = btree_find(&tree, kvs[i].key, &check);
+    /* Workers delete the even keys of their slice */
+    if ((i % CONCURRENT_KEYS) % 2 == 0) {
+      assert(error != 0);
+      continue;
+    }
+    assert(error == 0);
+    assert(memcmp(&check, &kvs[i].data, sizeof(diskptr_t)) == 0);
+  }
+
+  double ops = CONCURRENT_THREADS * (CONCURRENT_KEYS * 2.5);
+  printf("Threads: %d, Ops/s: %f, Reader finds/s: %f\n",
+         CONCURRENT_THREADS,
+         ops / cycles_to_s(stop - start, FREQ),
+         total_finds / cycles_to_s(stop - start, FREQ));
+
+  printf("Operation Stats in microseconds\n");
+  inserts.print_stat();
+  threaded.print_stat();
+  checkpoints.print_stat();
+
+  return 0;
+}
+
+#define SWEEP_KEYS (200000)
+#define SWEEP_CHECKPOINT (10000)
+
+/*
+ * Random inserts against every node size, checkpointing as they go so every
+ * checkpoint is followed by COW copies of the paths that get modified.
+ */
+int
+nodesize_sweep()
+{
+  keys = {};
+  size_t sizes[] = { 4 * 1024, 8 * 1024, 16 * 1024, 32 * 1024, 64 * 1024 };
+  diskptr_t check;
+  uint64_t start, stop;
+  btree tree;
+  int error;
+
+  printf("Calculating clock speed\n");
+  FREQ = get_clock_speed_sleep();
+
+  std::vector<kvp> kvs;
+  for (int i = 0; i < SWEEP_KEYS; i++) {
+    kvs.push_back(generate_kvp());
+  }
+
+  for (size_t size : sizes) {
+    auto inserts = Stat("Inserts");
+    auto finds = Stat("Finds");
+    auto checkpoints = Stat("Checkpoints");
+
+    error = btree_init(&tree, allocate_blk(size), sizeof(diskptr_t));
+    assert(error == 0);
+
+    for (int i = 0; i < SWEEP_KEYS; i++) {
+      start = rdtscp();
+      error = btree_insert(&tree, kvs[i].key, &kvs[i].data);
+      stop = rdtscp();
+      inserts.add(stop - start);
+      assert(error == 0);
+
+      if ((i + 1) % SWEEP_CHECKPOINT == 0) {
+        start = rdtscp();
+        btree_checkpoint(&tree);
+        stop = rdtscp();
+        checkpoints.add(stop - start);
+      }
+    }
+
+    for (int i = 0; i < SWEEP_KEYS; i++) {
+      start = rdtscp();
+      error = btree_find(&tree, kvs[i].key, &check);
+      stop = rdtscp();
+      finds.add(stop - start);
+      assert(error == 0);
+      assert(memcmp(&check, &kvs[i].data, sizeof(diskptr_t)) == 0);
+    }
+
+    printf("Node size %lu\n", size);
+    print_tree_stats("Sweep", &tree);
+    inserts.print_stat();
+    finds.print_stat();
+    checkpoints.print_stat();
+    printf("[Copied] Total: %lu, Per insert: %f\n",
+           tree.tr_copied.load(),
+           (double)tree.tr_copied.load() / SWEEP_KEYS);
+    reset_buf_cache();
+  }
+
+  return 0;
+}
+
+#define SEARCH_NODES (1024)
+#define SEARCH_LOOKUPS (1000000)
+
+typedef int (*node_search_t)(btdata_t node, size_t size, uint64_t key);
+
+static int
+node_search_scalar(btdata_t node, size_t size, uint64_t key)
+{
+  return binary_search_scalar(node->bt_keys, size, key);
+}
+
+static int
+node_search_avx2(btdata_t node, size_t size, uint64_t key)
+{
+  return binary_search_avx2(node->bt_keys, size, key);
+}
+
+static int
+node_search_avx512(btdata_t node, size_t size, uint64_t key)
+{
+  return binary_search_avx512(node->bt_keys, size, key);
+}
+
+static int
+node_search_dir(btdata_t node, size_t size, uint64_t key)
+{
+  return dir_search(node->bt_keys, size, node->bt_dir, node->bt_dir_top, key);
+}
+
+/*
+ * Run every lookup against a random node of the set, which is larger than
+ * the caches, so like a real descent most searches start with a cold node
+ */
+static void
+search_bench_run(const char* name,
+                 node_search_t search,
+                 btdata_t nodes,
+                 size_t size,
+                 std::vector<std::pair<int, uint64_t>>& lookups,
+                 std::vector<int>& results)
+{
+  uint64_t start, stop;
+
+  start = rdtscp();
+  for (size_t i = 0; i < lookups.size(); i++) {
+    results[i] = search(&nodes[lookups[i].first], size, lookups[i].second);
+  }
+  stop = rdtscp();
+
+  printf("[%s] Average: %f ns\n",
+         name,
+         cycles_to_ns(stop - start, FREQ) / lookups.size());
+}
+
+int
+search_bench()
+{
+  static std::mt19937_64 rng(std::random_device{}());
+
+  printf("Calculating clock speed\n");
+  FREQ = get_clock_speed_sleep();
+  printf("Dispatching to %s\n", search_kernel_name());
+
+  btdata_t nodes =
+    (btdata_t)aligned_alloc(PBLKSZ, SEARCH_NODES * sizeof(btdata));
+  size_t sizes[] = { BT_MAX_KEYS, SPLIT_KEYS };
+  for (size_t size : sizes) {
+    for (int n = 0; n < SEARCH_NODES; n++) {
+      for (size_t i = 0; i < size; i++) {
+        nodes[n].bt_keys[i] = generate_unique_key();
+      }
+      std::sort(&nodes[n].bt_keys[0], &nodes[n].bt_keys[size]);
+      dir_build(
+        nodes[n].bt_keys, size, nodes[n].bt_dir, nodes[n].bt_dir_top);
+    }
+
+    /* Half of the lookups hit a key in the node, half fall between keys */
+    std::vector<std::pair<int, uint64_t>> lookups;
+    for (int i = 0; i < SEARCH_LOOKUPS; i++) {
+      int n = rng() % SEARCH_NODES;
+      uint64_t key =
+        (i & 1) ? nodes[n].bt_keys[rng() % size] : generate_unique_key();
+      lookups.push_back({ n, key });
+    }
+
+    printf("Node with %lu keys\n", size);
+    std::vector<int> scalar(lookups.size()), results(lookups.size());
+    search_bench_run(
+      "Scalar", node_search_scalar, nodes, size, lookups, scalar);
+
+    if (__builtin_cpu_supports("avx2")) {
+      search_bench_run(
+        "AVX2", node_search_avx2, nodes, size, lookups, results);
+      assert(scalar == results);
+    }
+
+    if (__builtin_cpu_supports("avx512f")) {
+      search_bench_run(
+        "AVX512", node_search_avx512, nodes, size, lookups, results);
+      assert(scalar == results);
+    }
+
+    /* Inner node layout, directory lines first then one block of keys */
+    search_bench_run(
+      "Directory", node_search_dir, nodes, size, lookups, results);
+    assert(scalar == results);
+  }
+  free(nodes);
+
+  /* Edges of the window, every size the kernels can see */
+  std::vector<uint64_t> arr;
+  for (uint64_t i = 0; i < BT_MAX_KEYS; i++) {
+    arr.push_back(2 * i + 1);
+  }
+  for (size_t size = 0; size < BT_MAX_KEYS; size += 7) {
+    for (uint64_t key : { (uint64_t)0, (uint64_t)size, (uint64_t)2 * size + 2 }) {
+      int expected = binary_search_scalar(arr.data(), size, key);
+      assert(binary_search(arr.data(), size, key) == expected);
+      if (__builtin_cpu_supports("avx2")) {
+        assert(binary_search_avx2(arr.data(), size, key) == expected);
+      }
+    }
+  }
+
+  return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+  /* Benchmark mode, only compares node sizes */
+  if (argc > 1 && strcmp(argv[1], "sweep") == 0) {
+    nodesize_sweep();
+    return 0;
+  }
+
+#ifdef BUF_DEVICE
+  if (open_device(BUF_DEVICE, DEV_TRUNCATE) < 0) {
+    printf("Cannot open %s\n", BUF_DEVICE);
+    return 1;
+  }
+#endif
+
+  printf("Search Benchmark\n");
+  search_bench();
+
+  printf("General Test\n");
+  general();
+  reset_buf_cache();
+
+  printf("Bulkinsert Test\n");
+  bulkinsert();
+  reset_buf_cache();
+
+  printf("Bulkload Test\n");
+  bulkload();
+  reset_buf_cache();
+
+  printf("Compression Test\n");
+  compression();
+  reset_buf_cache();
+
+  printf("Dirty Tracking Test\n");
+  dirty_tracking();
+  reset_buf_cache();
+
+  printf("Checkpoint Workers Test\n");
+  checkpoint_workers();
+  reset_buf_cache();
+
+  printf("Delta Test\n");
+  deltas();
+  reset_buf_cache();
+
+  printf("Epoch Test\n");
+  epochs();
+  reset_buf_cache();
+
+  printf("Allocator Test\n");
+  allocator();
+  reset_buf_cache();
+
+  printf("Multifind Test\n");
+  multifind();
+  reset_buf_cache();
+
+  printf("Async Find Test\n");
+  async_finds();
+  reset_buf_cache();
+
+  printf("Getblk Scaling Test\n");
+  getblk_scaling();
+  reset_buf_cache();
+
+  printf("Bounded Cache Test\n");
+  bounded_cache();
+  reset_buf_cache();
+
+  printf("Replacement Policy Test\n");
+  policies();
+  reset_buf_cache();
+
+  printf("Device Test\n");
+  device();
+  reset_buf_cache();
+
+  printf("IO Engine Test\n");
+  io_engines();
+  reset_buf_cache();
+
+  printf("VTree Test\n");
+  vtree_test();
+  reset_buf_cache();
+
+  printf("Value Log Test\n");
+  vlog_test();
+  reset_buf_cache();
+
+  printf("Concurrent Test\n");
+  concurrent();
+  reset_buf_cache();
+
+  printf("Node Size Sweep\n");
+  nodesize_sweep();
   return 0;
 }
@@ -15,11 +15,49 @@
  */
 #define THROUGHPUT (2UL * GB)
 
+/*
+ * Bytes of buffers the buffer cache keeps in memory, 0 for no bound. Evicted
+ * buffers are written to the simulated device and read back when needed.
+ */
+#define BUF_CAPACITY (0)
+
+/*
+ * Replacement policy of the buffer cache once it is bounded, see bufpolicy.h
+ */
+#define BUF_POLICY (buf_clock)
+
+/*
+ * Keep the blocks of the buffer cache on this file or raw device instead of
+ * in memory, with O_DIRECT where it is supported, see dev.h. Blocks are only
+ * read back from it once they were evicted, which takes a BUF_CAPACITY. Turns
+ * off DISK_LATENCY, I/O takes as long as the device does.
+ */
+// #define BUF_DEVICE ("btree.dev")
+
 /*
  * On LRU cache miss induce disk latency
  */
 // #define DISK_LATENCY (1)
 
+/*
+ * Readers descend without taking buffer locks and validate the per node
+ * version counters instead, falling back to locking if writers keep getting
+ * in the way
+ */
+#define OPTIMISTIC_READS (1)
+
+/*
+ * Inner nodes keep a small directory of separator keys that is searched
+ * before the keys themselves, see DIR_STRIDE
+ */
+#define INNER_DIRECTORY (1)
+
+/*
+ * Full leaves whose keys are clustered are re-encoded as deltas from a base
+ * key instead of being split, see BT_ENC_D16
+ */
+#define LEAF_COMPRESSION (1)
+
 /*
  * This feature is not enabled be default as it will
  * hurt our LRU cache and induce increased latency
@@ -63,7 +63,8 @@ rdtscp_cycles()
   _Static_assert(false, "Unsupported architecture");
 #elif defined(__x86_64__) || defined(_M_X64)
   unsigned hi, lo;
-  asm __volatile__("rdtscp" : "=a"(lo), "=d"(hi));
+  /* rdtscp also loads IA32_TSC_AUX into ecx */
+  asm __volatile__("rdtscp" : "=a"(lo), "=d"(hi)::"rcx");
   uint64_t ret = ((uint64_t)lo) | (((uint64_t)hi) << 32);
 #else
   _Static_assert(false, "Unsupported architecture");
@@ -0,0 +1,258 @@
+#include "search.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define BINARY_SEARCH_CUTOFF (64)
+
+/* Window size at which the SIMD kernels stop bisecting and start counting */
+#define SIMD_SEARCH_CUTOFF (32)
+
+int
+binary_search_scalar(uint64_t* arr, size_t size, uint64_t key)
+{
+
+  /* In many cases linear search is faster then binary as it
+   * can take advantage of streaming prefetching so have a cut
+   * off where we switch to linear search */
+  if (size <= BINARY_SEARCH_CUTOFF) {
+    for (int i = 0; i < size; i++) {
+      if (arr[i] >= key) {
+        return i;
+      }
+    }
+
+    return size;
+  }
+
+  size_t low = 0;
+  size_t high = size;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (arr[mid] >= key) {
+      high = mid;
+    } else {
+      low = mid + 1;
+    }
+  }
+  if (low >= size) {
+    return size;
+  } else {
+    return low;
+  }
+}
+
+template<typename T>
+static inline int
+binary_search_narrow(T* arr, size_t size, T key)
+{
+  size_t low = 0;
+  size_t high = size;
+
+  while (high - low > BINARY_SEARCH_CUTOFF) {
+    size_t mid = low + (high - low) / 2;
+    if (arr[mid] >= key) {
+      high = mid;
+    } else {
+      low = mid + 1;
+    }
+  }
+
+  /* Narrow keys pack a window into a couple of cache lines, count it out */
+  for (; low < high; low++) {
+    if (arr[low] >= key) {
+      break;
+    }
+  }
+
+  return low;
+}
+
+int
+binary_search16(uint16_t* arr, size_t size, uint16_t key)
+{
+  return binary_search_narrow(arr, size, key);
+}
+
+int
+binary_search32(uint32_t* arr, size_t size, uint32_t key)
+{
+  return binary_search_narrow(arr, size, key);
+}
+
+/*
+ * Bisect until [*low, *high) holds at most SIMD_SEARCH_CUTOFF keys, the answer
+ * is always within the window (or is *high)
+ */
+static inline void
+search_narrow(uint64_t* arr, size_t* low, size_t* high, uint64_t key)
+{
+  while (*high - *low > SIMD_SEARCH_CUTOFF) {
+    size_t mid = *low + (*high - *low) / 2;
+    if (arr[mid] >= key) {
+      *high = mid;
+    } else {
+      *low = mid + 1;
+    }
+  }
+}
+
+#if defined(__x86_64__)
+
+/*
+ * AVX2 only has a signed 64 bit compare, flipping the sign bit of both sides
+ * turns it into an unsigned one. Keys are sorted so the number of keys below
+ * KEY in the window is the offset of the first key >= KEY.
+ */
+__attribute__((target("avx2,popcnt"))) int
+binary_search_avx2(uint64_t* arr, size_t size, uint64_t key)
+{
+  const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+  size_t low = 0;
+  size_t high = size;
+  size_t i;
+  int count = 0;
+
+  search_narrow(arr, &low, &high, key);
+
+  __m256i k = _mm256_xor_si256(_mm256_set1_epi64x(key), sign);
+  for (i = low; i + 4 <= high; i += 4) {
+    __m256i v = _mm256_loadu_si256((__m256i*)&arr[i]);
+    __m256i lt = _mm256_cmpgt_epi64(k, _mm256_xor_si256(v, sign));
+    count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(lt)));
+  }
+
+  for (; i < high; i++) {
+    count += (arr[i] < key);
+  }
+
+  return low + count;
+}
+
+/* AVX-512 compares unsigned directly and masks off the tail of the window */
+__attribute__((target("avx512f,popcnt"))) int
+binary_search_avx512(uint64_t* arr, size_t size, uint64_t key)
+{
+  size_t low = 0;
+  size_t high = size;
+  size_t i;
+  int count = 0;
+
+  search_narrow(arr, &low, &high, key);
+
+  __m512i k = _mm512_set1_epi64(key);
+  for (i = low; i < high; i += 8) {
+    __mmask8 valid = (high - i >= 8) ? 0xff : ((1u << (high - i)) - 1);
+    __m512i v = _mm512_maskz_loadu_epi64(valid, &arr[i]);
+    count += __builtin_popcount(_mm512_mask_cmplt_epu64_mask(valid, v, k));
+  }
+
+  return low + count;
+}
+
+static search_func_t
+search_select(const char** name)
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    *name = "avx512";
+    return binary_search_avx512;
+  }
+
+  if (__builtin_cpu_supports("avx2")) {
+    *name = "avx2";
+    return binary_search_avx2;
+  }
+
+  *name = "scalar";
+  return binary_search_scalar;
+}
+
+#else
+
+int
+binary_search_avx2(uint64_t* arr, size_t size, uint64_t key)
+{
+  return binary_search_scalar(arr, size, key);
+}
+
+int
+binary_search_avx512(uint64_t* arr, size_t size, uint64_t key)
+{
+  return binary_search_scalar(arr, size, key);
+}
+
+static search_func_t
+search_select(const char** name)
+{
+  *name = "scalar";
+  return binary_search_scalar;
+}
+
+#endif
+
+static const char* search_name;
+static search_func_t search_impl = search_select(&search_name);
+
+int
+binary_search(uint64_t* arr, size_t size, uint64_t key)
+{
+  return search_impl(arr, size, key);
+}
+
+const char*
+search_kernel_name()
+{
+  return search_name;
+}
+
+void
+dir_build(uint64_t* arr, size_t size, uint64_t* dir, uint64_t* top)
+{
+  size_t nblocks = (size + DIR_STRIDE - 1) / DIR_STRIDE;
+  size_t ngroups = (nblocks + DIR_FANOUT - 1) / DIR_FANOUT;
+
+  for (size_t i = 0; i < nblocks; i++) {
+    dir[i] = arr[std::min((i + 1) * DIR_STRIDE, size) - 1];
+  }
+
+  for (size_t i = 0; i < ngroups; i++) {
+    top[i] = dir[std::min((i + 1) * DIR_FANOUT, nblocks) - 1];
+  }
+}
+
+/* Same result as binary_search, provided the directory is up to date */
+int
+dir_search(uint64_t* arr,
+           size_t size,
+           uint64_t* dir,
+           uint64_t* top,
+           uint64_t key)
+{
+  size_t nblocks = (size + DIR_STRIDE - 1) / DIR_STRIDE;
+  size_t ngroups = (nblocks + DIR_FANOUT - 1) / DIR_FANOUT;
+  size_t group, block, first, low;
+
+  /* Every key in the array is smaller */
+  group = binary_search(top, ngroups, key);
+  if (group >= ngroups) {
+    return size;
+  }
+
+  first = group * DIR_FANOUT;
+  block = first + binary_search(&dir[first],
+                                std::min((size_t)DIR_FANOUT, nblocks - first),
+                                key);
+  /* Only possible if an optimistic reader raced a writer */
+  if (block >= nblocks) {
+    return size;
+  }
+
+  low = block * DIR_STRIDE;
+  return low + binary_search(&arr[low],
+                             std::min((size_t)DIR_STRIDE, size - low),
+                             key);
+}
@@ -0,0 +1,57 @@
+#ifndef _SEARCH_H_
+#define _SEARCH_H_
+/*
+ * Intra node key search
+ *
+ * Every find, insert and split searches a sorted array of up to BT_MAX_KEYS
+ * keys. binary_search returns the index of the first key greater than or
+ * equal to KEY, or SIZE if there is none.
+ *
+ * The SIMD kernels binary search until the window fits in a handful of
+ * vectors and then count the keys below KEY with vector compares. The
+ * kernel is picked once at startup based on what the CPU supports.
+ */
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef int (*search_func_t)(uint64_t* arr, size_t size, uint64_t key);
+
+int
+binary_search(uint64_t* arr, size_t size, uint64_t key);
+
+int
+binary_search_scalar(uint64_t* arr, size_t size, uint64_t key);
+int
+binary_search_avx2(uint64_t* arr, size_t size, uint64_t key);
+int
+binary_search_avx512(uint64_t* arr, size_t size, uint64_t key);
+
+/* Same as binary_search over the narrow key deltas of encoded leaves */
+int
+binary_search16(uint16_t* arr, size_t size, uint16_t key);
+int
+binary_search32(uint32_t* arr, size_t size, uint32_t key);
+
+/* Name of the kernel binary_search dispatches to */
+const char*
+search_kernel_name();
+
+/*
+ * Two level directory over a sorted array, so a search touches a couple of
+ * cache lines before the keys themselves. Keys are split into blocks of
+ * DIR_STRIDE, DIR holds the last key of every block and TOP the last key of
+ * every DIR_FANOUT blocks, which is one cache line.
+ */
+#define DIR_STRIDE (32)
+#define DIR_FANOUT (8)
+
+void
+dir_build(uint64_t* arr, size_t size, uint64_t* dir, uint64_t* top);
+int
+dir_search(uint64_t* arr,
+           size_t size,
+           uint64_t* dir,
+           uint64_t* top,
+           uint64_t key);
+
+#endif
@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <cassert>
+#include <string.h>
 #include <sys/types.h>
 
 #include "buf.h"
@@ -69,15 +71,170 @@ vtree_create(void* tree, struct vtreeops* ops, uint32_t v_flags)
   struct vtree vtree;
   vtree.v_tree = tree;
   vtree.v_flags = v_flags;
+  vtree.v_wal = NULL;
   if (v_flags & VTREE_WITHWAL) {
     vtree.v_wal = (kvp*)malloc(VTREE_WALSIZE);
   }
   vtree.v_ops = ops;
   vtree.v_cur_wal_idx = 0;
+  vtree.v_vs = 0;
+  vtree.v_vlog = NULL;
+  if (v_flags & VTREE_VALUELOG) {
+    vtree.v_vlog = new vlog{};
+  }
 
   return vtree;
 }
 
+/* Free what vtree_create allocated, the tree itself belongs to the caller */
+void
+vtree_destroy(vtree* tree)
+{
+  free(tree->v_wal);
+  tree->v_wal = NULL;
+  delete tree->v_vlog;
+  tree->v_vlog = NULL;
+}
+
+/* In value log mode the tree itself only stores a vlogptr per key */
+int
+vtree_init(vtree* tree, diskptr_t ptr, size_t value_size)
+{
+  tree->v_vs = value_size;
+  if (tree->v_flags & VTREE_VALUELOG) {
+    if (value_size > VLOG_MAX_VALUE) {
+      return -1;
+    }
+
+    return VTREE_INIT(tree, ptr, sizeof(vlogptr));
+  }
+
+  return VTREE_INIT(tree, ptr, value_size);
+}
+
+/*
+ * The log never goes through the dirty queue of the tree, a checkpoint would
+ * take its blocks for tree nodes, it has a queue of its own. Blocks are
+ * written out as soon as they fill up, and the head on every checkpoint.
+ */
+static void
+vlog_flush(struct vlog* vl)
+{
+  struct buf** ds;
+  size_t size;
+
+  ds = get_dirty_set(&vl->vl_bo, &size);
+  for (size_t i = 0; i < size; i++) {
+    /* Read it back in if it was evicted since it was appended to */
+    getblk(ds[i]->bp_lblkno, ds[i]->bp_size, LK_SHARED);
+    bawrite(ds[i]);
+    buf_unlock(ds[i], LK_SHARED);
+  }
+  free(ds);
+}
+
+/* Append KEY and its value to the head of the log, PTR is set to where */
+static void
+vlog_append(vtree* tree, uint64_t key, void* value, vlogptr* ptr)
+{
+  struct vlog* vl = tree->v_vlog;
+  size_t len = VLOG_RECSZ(tree->v_vs);
+  struct buf* bp;
+  vlogrec* rec;
+
+  if (vl->vl_blocks.empty() || vl->vl_used + len > VLOG_BLKSZ) {
+    vlog_flush(vl);
+    vl->vl_blocks.push_back(allocate_blk(VLOG_BLKSZ));
+    vl->vl_used = VLOG_HDRSZ;
+  }
+
+  bp = getblk(vl->vl_blocks.back().offset, VLOG_BLKSZ, LK_EXCLUSIVE);
+  rec = (vlogrec*)((char*)bp->bp_data + vl->vl_used);
+  rec->vr_key = key;
+  rec->vr_len = tree->v_vs;
+  memcpy(rec + 1, value, tree->v_vs);
+
+  ptr->vp_blk = vl->vl_blocks.back().offset;
+  ptr->vp_off = vl->vl_used;
+  ptr->vp_len = tree->v_vs;
+
+  vl->vl_used += len;
+  *(uint64_t*)bp->bp_data = vl->vl_used;
+  bdirty(bp, &vl->vl_bo);
+  buf_unlock(bp, LK_EXCLUSIVE);
+}
+
+static void
+vlog_read(vlogptr* ptr, void* value)
+{
+  struct buf* bp;
+
+  bp = getblk(ptr->vp_blk, VLOG_BLKSZ, LK_SHARED);
+  memcpy(value,
+         (char*)bp->bp_data + ptr->vp_off + sizeof(vlogrec),
+         ptr->vp_len);
+  buf_unlock(bp, LK_SHARED);
+}
+
+/*
+ * Collect up to NBLOCKS of the oldest log blocks. A record is live if the
+ * tree still points at it, live records are appended to the head again
+ * before the block is dropped. Returns the number of blocks collected.
+ */
+size_t
+vtree_vlog_gc(vtree* tree, size_t nblocks)
+{
+  struct vlog* vl = tree->v_vlog;
+  vlogptr cur, moved;
+  uint64_t off, used;
+  struct buf* bp;
+  diskptr_t blk;
+  vlogrec* rec;
+  size_t n;
+  int error;
+
+  if (!(tree->v_flags & VTREE_VALUELOG)) {
+    return 0;
+  }
+
+  /* Liveness is checked against the tree, it has to be up to date */
+  vtree_empty_wal(tree);
+
+  /* Never the head, nor what the collection itself appends */
+  if (vl->vl_blocks.size() <= 1) {
+    return 0;
+  }
+  nblocks = std::min(nblocks, vl->vl_blocks.size() - 1);
+
+  for (n = 0; n < nblocks; n++) {
+    blk = vl->vl_blocks.front();
+    bp = getblk(blk.offset, VLOG_BLKSZ, LK_SHARED);
+    used = *(uint64_t*)bp->bp_data;
+    for (off = VLOG_HDRSZ; off < used; off += VLOG_RECSZ(rec->vr_len)) {
+      rec = (vlogrec*)((char*)bp->bp_data + off);
+      if (VTREE_FIND(tree, rec->vr_key, &cur) != 0) {
+        continue;
+      }
+
+      if (cur.vp_blk != blk.offset || cur.vp_off != off) {
+        continue;
+      }
+
+      vlog_append(tree, rec->vr_key, rec + 1, &moved);
+      error = VTREE_INSERT(tree, rec->vr_key, &moved);
+      assert(error == 0);
+    }
+
+    /* Nothing but the last checkpoint points into the block anymore */
+    bclean(bp);
+    buf_unlock(bp, LK_SHARED);
+    vl->vl_dead.push_back(blk);
+    vl->vl_blocks.pop_front();
+  }
+
+  return n;
+}
+
 static inline void
 wal_insert(vtree* tree, size_t keysize, uint64_t key, void* data)
 {
@@ -103,6 +260,14 @@ vtree_insert(vtree* tree, uint64_t key, void* value)
 {
   int error;
   size_t ks = VTREE_GETKEYSIZE(tree);
+  vlogptr ptr;
+
+  /* From here on the log pointer stands in for the value */
+  if (tree->v_flags & VTREE_VALUELOG) {
+    vlog_append(tree, key, value, &ptr);
+    value = &ptr;
+  }
+
   if (tree->v_flags & VTREE_WITHWAL) {
     /* Checkpoint should also clear out the wal hopefully before this point */
     if (tree->v_cur_wal_idx == VTREE_MAXWAL) {
@@ -116,28 +281,127 @@ vtree_insert(vtree* tree, uint64_t key, void* value)
   return VTREE_INSERT(tree, key, value);
 }
 
+/* Bulk operations take values inline in a kvp, which the log cannot */
 int
 vtree_bulkinsert(vtree* tree, kvp* keyvalues, size_t len)
 {
+  if (tree->v_flags & VTREE_VALUELOG) {
+    return -1;
+  }
+
   return VTREE_BULKINSERT(tree, keyvalues, len);
 }
 
+int
+vtree_bulkload(vtree* tree, kvp* keyvalues, size_t len, int fill)
+{
+  if (tree->v_flags & VTREE_VALUELOG) {
+    return -1;
+  }
+
+  return VTREE_BULKLOAD(tree, keyvalues, len, fill);
+}
+
 int
 vtree_delete(vtree* tree, uint64_t key, void* value)
 {
-  return VTREE_DELETE(tree, key, value);
+  vlogptr ptr;
+  int error;
+
+  if (!(tree->v_flags & VTREE_VALUELOG)) {
+    return VTREE_DELETE(tree, key, value);
+  }
+
+  /* The record stays in the log until the garbage collector gets to it */
+  error = VTREE_DELETE(tree, key, &ptr);
+  if (error == 0 && value != NULL) {
+    vlog_read(&ptr, value);
+  }
+
+  return error;
 }
 
 int
 vtree_find(vtree* tree, uint64_t key, void* value)
 {
-  return VTREE_FIND(tree, key, value);
+  vlogptr ptr;
+  int error;
+
+  if (!(tree->v_flags & VTREE_VALUELOG)) {
+    return VTREE_FIND(tree, key, value);
+  }
+
+  error = VTREE_FIND(tree, key, &ptr);
+  if (error == 0) {
+    vlog_read(&ptr, value);
+  }
+
+  return error;
 }
 
 int
 vtree_ge(vtree* tree, uint64_t* key, void* value)
 {
-  return VTREE_GE(tree, key, value);
+  vlogptr ptr;
+  int error;
+
+  if (!(tree->v_flags & VTREE_VALUELOG)) {
+    return VTREE_GE(tree, key, value);
+  }
+
+  error = VTREE_GE(tree, key, &ptr);
+  if (error == 0) {
+    vlog_read(&ptr, value);
+  }
+
+  return error;
+}
+
+/* In value log mode the values of the keys found are read from the log */
+int
+vtree_multifind(vtree* tree,
+                uint64_t* keys,
+                size_t n,
+                void* values,
+                int* errors)
+{
+  vlogptr* ptrs;
+  int error;
+
+  if (!(tree->v_flags & VTREE_VALUELOG)) {
+    return VTREE_MULTIFIND(tree, keys, n, values, errors);
+  }
+
+  ptrs = (vlogptr*)malloc(n * sizeof(vlogptr));
+  if (ptrs == NULL) {
+    return -1;
+  }
+
+  error = VTREE_MULTIFIND(tree, keys, n, ptrs, errors);
+  for (size_t i = 0; error == 0 && i < n; i++) {
+    if (errors[i] == 0) {
+      vlog_read(&ptrs[i], (char*)values + i * tree->v_vs);
+    }
+  }
+  free(ptrs);
+
+  return error;
+}
+
+/*
+ * Copy out the value of a range query or iterator result, in value log mode
+ * results only carry the log pointer.
+ */
+int
+vtree_value(vtree* tree, kvp* kv, void* value)
+{
+  if (tree->v_flags & VTREE_VALUELOG) {
+    vlog_read((vlogptr*)kv->data, value);
+    return 0;
+  }
+
+  memcpy(value, kv->data, VTREE_GETKEYSIZE(tree));
+  return 0;
 }
 
 int
@@ -150,9 +414,51 @@ vtree_rangequery(vtree* tree,
   return VTREE_RANGEQUERY(tree, key_low, key_max, results, results_max);
 }
 
+/* The iterator reads the tree directly, so flush the WAL into it first */
+void*
+vtree_iter_open(vtree* tree, uint64_t key_low, uint64_t key_max)
+{
+  vtree_empty_wal(tree);
+  return VTREE_ITER_OPEN(tree, key_low, key_max);
+}
+
+int
+vtree_iter_next(vtree* tree, void* iter, kvp** batch)
+{
+  return VTREE_ITER_NEXT(tree, iter, batch);
+}
+
+int
+vtree_iter_seek(vtree* tree, void* iter, uint64_t key)
+{
+  return VTREE_ITER_SEEK(tree, iter, key);
+}
+
+void
+vtree_iter_close(vtree* tree, void* iter)
+{
+  VTREE_ITER_CLOSE(tree, iter);
+}
+
 diskptr_t
 vtree_checkpoint(vtree* tree)
 {
+  diskptr_t ptr;
+
   vtree_empty_wal(tree);
-  return VTREE_CHECKPOINT(tree);
+  if (tree->v_flags & VTREE_VALUELOG) {
+    vlog_flush(tree->v_vlog);
+  }
+
+  ptr = VTREE_CHECKPOINT(tree);
+
+  /* The new checkpoint no longer points into collected log blocks */
+  if (tree->v_flags & VTREE_VALUELOG) {
+    for (diskptr_t blk : tree->v_vlog->vl_dead) {
+      free_blk(blk);
+    }
+    tree->v_vlog->vl_dead.clear();
+  }
+
+  return ptr;
 }
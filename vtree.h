@@ -1,6 +1,8 @@
 #ifndef _VTREE_H_
 #define _VTREE_H_
 
+#include <deque>
+#include <vector>
 #include <sys/types.h>
 
 #include "buf.h"
@@ -24,19 +26,43 @@ typedef int (*vtree_init_t)(void* tree, diskptr_t key, size_t value_size);
 /* Write ops */
 typedef int (*vtree_insert_t)(void* tree, uint64_t key, void* value);
 typedef int (*vtree_bulkinsert_t)(void* tree, kvp* keyvalues, size_t len);
+typedef int (*vtree_bulkload_t)(void* tree,
+                                kvp* keyvalues,
+                                size_t len,
+                                int fill);
 typedef int (*vtree_delete_t)(void* tree, uint64_t key, void* value);
 
 /* Query Ops */
 typedef int (*vtree_find_t)(void* tree, uint64_t key, void* value);
 typedef int (*vtree_ge_t)(void* tree, uint64_t* key, void* value);
+/*
+ * Look up N keys at once, in any order. The value of KEYS[i] goes to slot i
+ * of VALUES and ERRORS[i] is 0 if it was found, -1 if not
+ */
+typedef int (*vtree_multifind_t)(void* tree,
+                                 uint64_t* keys,
+                                 size_t n,
+                                 void* values,
+                                 int* errors);
 typedef int (*vtree_rangequery_t)(void* tree,
                                   uint64_t keylow,
                                   uint64_t keymax,
                                   kvp* results,
                                   size_t results_max);
 
+/*
+ * Iterators stream a range out in batches the tree owns, so a scan runs in
+ * constant memory however many keys it covers
+ */
+typedef void* (*vtree_iter_open_t)(void* tree,
+                                   uint64_t keylow,
+                                   uint64_t keymax);
+typedef int (*vtree_iter_next_t)(void* iter, kvp** batch);
+typedef int (*vtree_iter_seek_t)(void* iter, uint64_t key);
+typedef void (*vtree_iter_close_t)(void* iter);
+
 typedef diskptr_t (*vtree_checkpoint_t)(void* tree);
-typedef size_t (*vtree_getkeysize)(void* tree);
+typedef size_t (*vtree_getkeysize_t)(void* tree);
 
 struct vtreeops
 {
@@ -44,15 +70,22 @@ struct vtreeops
 
   vtree_insert_t vtree_insert;
   vtree_bulkinsert_t vtree_bulkinsert;
+  vtree_bulkload_t vtree_bulkload;
   vtree_delete_t vtree_delete;
 
   vtree_find_t vtree_find;
   vtree_ge_t vtree_ge;
+  vtree_multifind_t vtree_multifind;
   vtree_rangequery_t vtree_rangequery;
 
+  vtree_iter_open_t vtree_iter_open;
+  vtree_iter_next_t vtree_iter_next;
+  vtree_iter_seek_t vtree_iter_seek;
+  vtree_iter_close_t vtree_iter_close;
+
   vtree_checkpoint_t vtree_checkpoint;
 
-  vtree_getkeysize vtree_getkeysize;
+  vtree_getkeysize_t vtree_getkeysize;
 };
 
 #define VTREE_WALSIZE (64UL * 1024)
@@ -60,6 +93,47 @@ struct vtreeops
 
 #define VTREE_WITHWAL (0x1)
 #define VTREE_WALBULK (0x2)
+/*
+ * Values live in an append only log and the tree only holds pointers into
+ * it, so values can be larger than BT_MAX_VALUE_SIZE and leaves stay small.
+ */
+#define VTREE_VALUELOG (0x4)
+
+#define VLOG_BLKSZ (64UL * 1024)
+
+/* Where a value is in the log, what the tree stores in value log mode */
+typedef struct vlogptr
+{
+  uint64_t vp_blk;
+  uint32_t vp_off;
+  uint32_t vp_len;
+} vlogptr;
+
+/*
+ * Log blocks start with the number of bytes used in them, followed by
+ * records. Every record is a header and the value, 8 byte aligned, the key
+ * lets the garbage collector check whether the tree still points at it.
+ */
+typedef struct vlogrec
+{
+  uint64_t vr_key;
+  uint64_t vr_len;
+} vlogrec;
+
+#define VLOG_HDRSZ (sizeof(uint64_t))
+#define VLOG_RECSZ(len) ((sizeof(vlogrec) + (len) + 7) & ~7UL)
+#define VLOG_MAX_VALUE (VLOG_BLKSZ - VLOG_HDRSZ - sizeof(vlogrec))
+
+struct vlog
+{
+  /* Oldest first, the last one is the head being appended to */
+  std::deque<diskptr_t> vl_blocks;
+  uint64_t vl_used;
+  /* Blocks appended to since they were last written out */
+  struct bufobj vl_bo;
+  /* Collected blocks the last checkpoint may point into, freed by the next */
+  std::vector<diskptr_t> vl_dead;
+};
 
 struct vtree
 {
@@ -68,6 +142,9 @@ struct vtree
   kvp* v_wal;
   int v_cur_wal_idx;
   struct vtreeops* v_ops;
+  /* Size of the values handed to us, see vtree_init */
+  size_t v_vs;
+  struct vlog* v_vlog;
 };
 
 #define VTREE_INIT(tree, ptr, keysize)                                         \
@@ -79,6 +156,9 @@ struct vtree
 #define VTREE_BULKINSERT(tree, kvp, len)                                       \
   ((tree)->v_ops->vtree_bulkinsert((tree)->v_tree, kvp, len))
 
+#define VTREE_BULKLOAD(tree, kvp, len, fill)                                   \
+  ((tree)->v_ops->vtree_bulkload((tree)->v_tree, kvp, len, fill))
+
 #define VTREE_DELETE(tree, key, value)                                         \
   ((tree)->v_ops->vtree_delete((tree)->v_tree, key, value))
 
@@ -88,33 +168,73 @@ struct vtree
 #define VTREE_GE(tree, key, value)                                             \
   ((tree)->v_ops->vtree_ge((tree)->v_tree, key, value))
 
+#define VTREE_MULTIFIND(tree, keys, n, values, errors)                         \
+  ((tree)->v_ops->vtree_multifind((tree)->v_tree, keys, n, values, errors))
+
 #define VTREE_RANGEQUERY(tree, keylow, keymax, results, results_max)           \
   ((tree)->v_ops->vtree_rangequery(                                            \
     (tree)->v_tree, keylow, keymax, results, results_max))
 
+#define VTREE_ITER_OPEN(tree, keylow, keymax)                                  \
+  ((tree)->v_ops->vtree_iter_open((tree)->v_tree, keylow, keymax))
+
+#define VTREE_ITER_NEXT(tree, iter, batch)                                     \
+  ((tree)->v_ops->vtree_iter_next(iter, batch))
+
+#define VTREE_ITER_SEEK(tree, iter, key)                                       \
+  ((tree)->v_ops->vtree_iter_seek(iter, key))
+
+#define VTREE_ITER_CLOSE(tree, iter) ((tree)->v_ops->vtree_iter_close(iter))
+
 #define VTREE_CHECKPOINT(tree) ((tree)->v_ops->vtree_checkpoint((tree)->v_tree))
 
 #define VTREE_GETKEYSIZE(tree) ((tree)->v_ops->vtree_getkeysize((tree)->v_tree))
 
 struct vtree
 vtree_create(void* tree, struct vtreeops* ops, uint32_t v_flags);
+void
+vtree_destroy(vtree* tree);
+int
+vtree_init(vtree* tree, diskptr_t ptr, size_t value_size);
 int
 vtree_insert(vtree* tree, uint64_t key, void* value);
 int
 vtree_bulkinsert(vtree* tree, kvp* keyvalues, size_t len);
 int
+vtree_bulkload(vtree* tree, kvp* keyvalues, size_t len, int fill);
+int
 vtree_delete(vtree* tree, uint64_t key, void* value);
 int
 vtree_find(vtree* tree, uint64_t key, void* value);
 int
 vtree_ge(vtree* tree, uint64_t* key, void* value);
 int
+vtree_multifind(vtree* tree,
+                uint64_t* keys,
+                size_t n,
+                void* values,
+                int* errors);
+int
 vtree_rangequery(vtree* tree,
                  uint64_t key_low,
                  uint64_t key_max,
                  kvp* results,
                  size_t results_max);
 
+void*
+vtree_iter_open(vtree* tree, uint64_t key_low, uint64_t key_max);
+int
+vtree_iter_next(vtree* tree, void* iter, kvp** batch);
+int
+vtree_iter_seek(vtree* tree, void* iter, uint64_t key);
+void
+vtree_iter_close(vtree* tree, void* iter);
+
+int
+vtree_value(vtree* tree, kvp* kv, void* value);
+size_t
+vtree_vlog_gc(vtree* tree, size_t nblocks);
+
 diskptr_t
 vtree_checkpoint(vtree* tree);
 